@@ -0,0 +1,152 @@
+//
+//  bench_common.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Pieces shared by the benchmarks : percentiles, a dome class that opens up the single queries
+//  and a stand in for the dome controller. The controller answers from the simulator's model
+//  (sim/rigelsimmodel.h) stepped in real time, so the replies are the firmware's and the dome
+//  really moves after a GO. CBenchPty puts it on the master side of a pseudo terminal.
+
+#ifndef __BENCH_COMMON__
+#define __BENCH_COMMON__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../rigeldome.h"
+#include "../sim/rigelsimmodel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// dValues sorted
+static inline double percentile(std::vector<double> &dValues, double dPercent)
+{
+    size_t nIndex = (size_t)(dPercent / 100.0 * (double)(dValues.size() - 1));
+    return dValues[nIndex];
+}
+
+class CBenchDome : public CRigelDome
+{
+public:
+    using CRigelDome::getDomeAz;
+    using CRigelDome::domeCommandBatch;
+};
+
+// one command line in, one reply line out. Not thread safe, each controller has its own.
+class CBenchModel
+{
+public:
+    CBenchModel() : m_Sim(config()), m_tLast(Clock::now()) {}
+
+    std::string reply(const std::string &sCmd)
+    {
+        bool bShutterLink;
+        long nTicks;
+        long i;
+
+        // catch up with the time spent since the last command
+        nTicks = (long)(std::chrono::duration<double, std::milli>(Clock::now() - m_tLast).count() / SIM_TICK);
+        for(i = 0; i < nTicks; i++)
+            m_Sim.update(SIM_TICK / 1000.0);
+        m_tLast += std::chrono::milliseconds(nTicks * SIM_TICK);
+        return m_Sim.command(sCmd, bShutterLink) + "\r";
+    }
+
+private:
+    // the link latency is up to the caller, the model only answers
+    static SimConfig config()
+    {
+        SimConfig Config = {0, 0, 0, 2.0, 5.0, 30.0, 1.0, 68400, true, false, NULL, 1};
+        return Config;
+    }
+
+    CRigelSim           m_Sim;
+    Clock::time_point   m_tLast;
+};
+
+// the controller on the master side of a pty, answers each line after nDelayMs
+class CBenchPty
+{
+public:
+    CBenchPty() : m_nMasterFd(-1), m_nDelayMs(0), m_bRunning(false) {}
+    ~CBenchPty() { stop(); }
+
+    int start(int nDelayMs)
+    {
+        struct termios Tio;
+
+        m_nMasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+        if(m_nMasterFd < 0 || grantpt(m_nMasterFd) || unlockpt(m_nMasterFd)) {
+            fprintf(stderr, "can't open a pseudo terminal : %s\n", strerror(errno));
+            return 1;
+        }
+        tcgetattr(m_nMasterFd, &Tio);
+        cfmakeraw(&Tio);
+        tcsetattr(m_nMasterFd, TCSANOW, &Tio);
+
+        m_nDelayMs = nDelayMs;
+        m_bRunning = true;
+        m_Thread = std::thread(&CBenchPty::controller, this);
+        return 0;
+    }
+
+    void stop()
+    {
+        m_bRunning = false;
+        if(m_Thread.joinable())
+            m_Thread.join();
+        if(m_nMasterFd >= 0)
+            close(m_nMasterFd);
+        m_nMasterFd = -1;
+    }
+
+    const char *port() { return ptsname(m_nMasterFd); }
+
+private:
+    void controller()
+    {
+        struct pollfd Poll;
+        std::string sLine;
+        std::string sReply;
+        char cByte;
+
+        Poll.fd = m_nMasterFd;
+        Poll.events = POLLIN;
+        while(m_bRunning) {
+            if(poll(&Poll, 1, 50) <= 0)
+                continue;
+            if(read(m_nMasterFd, &cByte, 1) != 1)
+                continue;
+            if(cByte != '\r') {
+                sLine += cByte;
+                continue;
+            }
+            sReply = m_Model.reply(sLine);
+            sLine.clear();
+            if(m_nDelayMs)
+                std::this_thread::sleep_for(std::chrono::milliseconds(m_nDelayMs));
+            if(write(m_nMasterFd, sReply.data(), sReply.size()) < 0)
+                break;
+        }
+    }
+
+    CBenchModel         m_Model;
+    int                 m_nMasterFd;
+    int                 m_nDelayMs;
+    std::atomic<bool>   m_bRunning;
+    std::thread         m_Thread;
+};
+
+#endif
@@ -0,0 +1,106 @@
+//
+//  bench_iothread.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Command round trip time on a loaded machine, exchanges run on the calling thread,
+//  on the I/O thread, and on the I/O thread with SCHED_FIFO and pinned to a core.
+//  The load is a set of busy threads at normal priority, twice the number of cores,
+//  which is roughly what an imaging PC looks like while it's stacking frames.
+//  A thread on the master side of a pseudo terminal plays the dome controller (see bench_common.h).
+//  SCHED_FIFO needs root or CAP_SYS_NICE (or an rtprio limit), without it the last
+//  run falls back to normal scheduling and says so.
+//
+//  make bench && ./bench/bench_iothread [nb commands] [priority] [cpu]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "bench_common.h"
+
+static volatile double g_dSink;
+
+static void busyLoad(std::atomic<bool> &bRunning)
+{
+    double dValue = 1.0;
+
+    while(bRunning) {
+        for(int i = 0; i < 10000; i++)
+            dValue = dValue * 1.0000001 + 0.0000001;
+        g_dSink = dValue;
+    }
+}
+
+static int run(const char *pszName, const char *pszPort, int nCommands, bool bIoThread, int nPriority, int nCpu)
+{
+    CBenchDome Dome;
+    std::vector<double> dTimes;
+    Clock::time_point tStart;
+    bool bRealTime = false;
+    bool bPinned = false;
+    double dAz;
+    int i;
+
+    Dome.setCoalesceWindow(0);
+    Dome.setIoThread(bIoThread, nPriority, nCpu);
+    if(Dome.setTransport(TRANSPORT_NATIVE_SERIAL) || Dome.Connect(pszPort)) {
+        fprintf(stderr, "can't connect to %s\n", pszPort);
+        return 1;
+    }
+    Dome.getIoThreadSched(bRealTime, bPinned);
+
+    for(i = 0; i < nCommands; i++) {
+        tStart = Clock::now();
+        if(Dome.getDomeAz(dAz))
+            continue;
+        dTimes.push_back(std::chrono::duration<double, std::milli>(Clock::now() - tStart).count());
+    }
+    Dome.Disconnect();
+
+    if(dTimes.empty()) {
+        fprintf(stderr, "no reply for %s\n", pszName);
+        return 1;
+    }
+    std::sort(dTimes.begin(), dTimes.end());
+    printf("%-16s %d commands (ms) : min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f%s%s\n",
+           pszName, (int)dTimes.size(), dTimes.front(), percentile(dTimes, 50), percentile(dTimes, 90),
+           percentile(dTimes, 99), dTimes.back(),
+           bIoThread && nPriority && !bRealTime ? "  (no SCHED_FIFO)" : "",
+           bIoThread && nCpu >= 0 && !bPinned ? "  (not pinned)" : "");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    std::atomic<bool> bLoad(true);
+    std::vector<std::thread> Load;
+    CBenchPty Pty;
+    int nCommands = argc > 1 ? atoi(argv[1]) : 2000;
+    int nPriority = argc > 2 ? atoi(argv[2]) : 50;
+    int nCpu = argc > 3 ? atoi(argv[3]) : 0;
+    int nLoad = 2 * (int)std::max(1u, std::thread::hardware_concurrency());
+    int nErr = 0;
+    int i;
+
+    if(Pty.start(0))
+        return 1;
+
+    for(i = 0; i < nLoad; i++)
+        Load.push_back(std::thread(busyLoad, std::ref(bLoad)));
+    printf("%d busy threads\n", nLoad);
+
+    nErr |= run("caller thread", Pty.port(), nCommands, false, 0, DEFAULT_IO_CPU);
+    nErr |= run("io thread", Pty.port(), nCommands, true, 0, DEFAULT_IO_CPU);
+    nErr |= run("io thread rt", Pty.port(), nCommands, true, nPriority, nCpu);
+
+    bLoad = false;
+    for(i = 0; i < nLoad; i++)
+        Load[i].join();
+    Pty.stop();
+    return nErr;
+}
@@ -0,0 +1,373 @@
+//
+//  bench_micro.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Per poll CPU costs : command formatting, reply parsing, log timestamps and timers.
+//  Each case runs in a tight loop right after a fixed reference loop, the median of a few
+//  runs is kept as ns per call and as a ratio to the reference. Comparisons use the ratio,
+//  so a slower machine or a busy one doesn't show up as a regression.
+//  Results are CSV (name,ns_per_op,relative,iterations) so they can be stored and compared :
+//
+//  make bench-micro                                        compare with bench/bench_micro_baseline.csv
+//  make bench-micro-rebaseline                             store a new baseline, to commit with the change
+//  ./bench/bench_micro -b base.csv [-t percent]            compare, exit 1 if a case got slower than the threshold
+//
+//  make bench-micro only warns, a busy machine can still push a case over the threshold.
+//
+//  The baseline is in git so a review sees a change in the relative costs. ns_per_op in it is
+//  only for reference, it depends on the machine that wrote it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../rigeldome.h"
+#include "../StopWatch.h"
+
+typedef std::chrono::steady_clock Clock;
+
+#define MICRO_RUNS          9       // the median is kept
+#define MICRO_MIN_TIME      0.02    // s per run
+#define MICRO_THRESHOLD     40.0    // %
+#define MICRO_LOOSE_THRESHOLD 100.0 // %, cases bound by syscalls or locks, they don't track the reference loop
+
+static const char *g_pszVReply = "123.4\t0\t1\t0\t0\t1\t0\t0\t0\t0\t0\t12.2\t0";
+
+// keeps the compiler from dropping the work
+static volatile double g_dSink;
+static volatile int g_nSink;
+
+struct MicroResult {
+    std::string     sName;
+    double          dNsPerOp;
+    double          dRelative;      // ns per call over the reference loop's
+    unsigned long   nIterations;
+};
+
+#pragma mark - cases
+
+// the yardstick, plain arithmetic with no memory or library calls
+static void caseReference(unsigned long nIterations)
+{
+    double dValue = 1.0;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++)
+        dValue = dValue * 1.0000001 + 0.0000001;
+    g_dSink = dValue;
+}
+
+// the stringstream splitter V replies went through before parseExtendedState, kept as the reference point
+static int parseFields(const char *pszResp, std::vector<std::string> &svFields, char cSeparator)
+{
+    std::string sSegment;
+    std::stringstream ssTmp(pszResp);
+
+    svFields.clear();
+    while(std::getline(ssTmp, sSegment, cSeparator))
+        svFields.push_back(sSegment);
+    return svFields.size() ? RD_OK : ERR_CMDFAILED;
+}
+
+static void caseGoFormat(unsigned long nIterations)
+{
+    char szBuf[SERIAL_BUFFER_SIZE];
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++) {
+        snprintf(szBuf, SERIAL_BUFFER_SIZE, "GO %3.1f\r", (double)(i % 3600) / 10.0);
+        g_nSink = szBuf[3];
+    }
+}
+
+static void caseAngleAtof(unsigned long nIterations)
+{
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++)
+        g_dSink = atof("123.4");
+}
+
+static void caseBatSscanf(unsigned long nIterations)
+{
+    double dShutterVolts;
+    int nPercent;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++) {
+        sscanf("87 12250", "%d %lf", &nPercent, &dShutterVolts);
+        g_dSink = dShutterVolts + nPercent;
+    }
+}
+
+static void caseVParseFields(unsigned long nIterations)
+{
+    std::vector<std::string> svFields;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++) {
+        parseFields(g_pszVReply, svFields, '\t');
+        g_dSink = atof(svFields[0].c_str()) + atoi(svFields[1].c_str()) + atoi(svFields[2].c_str());
+    }
+}
+
+static void caseVParseExtendedState(unsigned long nIterations)
+{
+    DomeStatus Status;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++) {
+        CRigelDome::parseExtendedState(g_pszVReply, Status);
+        g_dSink = Status.dAz + Status.nMotorState + Status.nShutterState;
+    }
+}
+
+// what every PLUGIN_DEBUG log line does before the fprintf
+static void caseLogTimestamp(unsigned long nIterations)
+{
+    time_t ltime;
+    char *timestamp;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++) {
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        g_nSink = timestamp[0];
+    }
+}
+
+static void caseStopWatch(unsigned long nIterations)
+{
+    CStopWatch Timer;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++)
+        g_dSink = Timer.GetElapsedSeconds();
+}
+
+static void caseRigelTimer(unsigned long nIterations)
+{
+    CRigelTimer Timer;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++)
+        g_dSink = Timer.GetElapsedSeconds();
+}
+
+// what the synchronous commands add on top of the command itself : a future and a lane check.
+// Disconnected, so the command returns right away.
+static void caseSyncWrapper(unsigned long nIterations)
+{
+    static CRigelDome Dome;
+    unsigned long i;
+
+    for(i = 0; i < nIterations; i++)
+        g_nSink = Dome.gotoAzimuth(123.4);
+}
+
+class CMicroDome : public CRigelDome
+{
+public:
+    using CRigelDome::observeState;
+};
+
+// status engine cost on each published snapshot when nothing changed, our log subscriber plus an az one
+static void caseObserveState(unsigned long nIterations)
+{
+    static CMicroDome Dome;
+    static int nSub = Dome.subscribe(EVENT_AZ, [](const DomeEvent &Event) { g_dSink = Event.dNew; }, 1.0);
+    ObservedState Observed = {123.4, IDLE, CLOSED, 1, 0, 0, 0};
+    unsigned long i;
+
+    g_nSink = nSub;
+    for(i = 0; i < nIterations; i++)
+        Dome.observeState(EVENT_AZ | EVENT_MOTOR | EVENT_SHUTTER, Observed);
+}
+
+struct MicroCase {
+    const char  *pszName;
+    void        (*pRun)(unsigned long nIterations);
+    double      dThreshold;     // %, allowed slowdown if more than -t
+};
+
+static const MicroCase g_Reference = {"reference", caseReference, 0};
+
+static const MicroCase g_Cases[] = {
+    {"go_snprintf",             caseGoFormat,               0},
+    {"angle_atof",              caseAngleAtof,              0},
+    {"bat_sscanf",              caseBatSscanf,              0},
+    {"v_parsefields",           caseVParseFields,           0},
+    {"v_parseextendedstate",    caseVParseExtendedState,    0},
+    {"log_asctime",             caseLogTimestamp,           MICRO_LOOSE_THRESHOLD},    // localtime stats the zone file
+    {"timer_cstopwatch",        caseStopWatch,              0},
+    {"timer_crigeltimer",       caseRigelTimer,             0},
+    {"sync_wrapper",            caseSyncWrapper,            MICRO_LOOSE_THRESHOLD},    // future and lane lock
+    {"observe_state",           caseObserveState,           MICRO_LOOSE_THRESHOLD}     // state lock
+};
+
+#pragma mark - runner
+
+static double timeRun(const MicroCase &Case, unsigned long nIterations)
+{
+    Clock::time_point tStart = Clock::now();
+
+    Case.pRun(nIterations);
+    return std::chrono::duration<double>(Clock::now() - tStart).count();
+}
+
+// grow the iteration count until a run is long enough to time
+static unsigned long calibrate(const MicroCase &Case)
+{
+    unsigned long nIterations = 1000;
+    double dElapsed;
+
+    while((dElapsed = timeRun(Case, nIterations)) < MICRO_MIN_TIME)
+        nIterations *= dElapsed < MICRO_MIN_TIME / 10 ? 10 : 2;
+    return nIterations;
+}
+
+static double median(std::vector<double> dValues)
+{
+    std::sort(dValues.begin(), dValues.end());
+    return dValues[dValues.size() / 2];
+}
+
+// each run times the reference right before the case, so both see the same clock speed and load
+static MicroResult runCase(const MicroCase &Case, unsigned long nRefIterations)
+{
+    MicroResult Result = {Case.pszName, 0, 0, calibrate(Case)};
+    std::vector<double> dNsPerOp;
+    std::vector<double> dRelative;
+    double dRefNs;
+    int nRun;
+
+    for(nRun = 0; nRun < MICRO_RUNS; nRun++) {
+        dRefNs = timeRun(g_Reference, nRefIterations) * 1e9 / (double)nRefIterations;
+        dNsPerOp.push_back(timeRun(Case, Result.nIterations) * 1e9 / (double)Result.nIterations);
+        dRelative.push_back(dNsPerOp.back() / dRefNs);
+    }
+    Result.dNsPerOp = median(dNsPerOp);
+    Result.dRelative = median(dRelative);
+    return Result;
+}
+
+// name -> relative cost
+static int readBaseline(const char *pszFile, std::map<std::string, double> &Baseline)
+{
+    FILE *pFile = fopen(pszFile, "r");
+    char szLine[256];
+    char szName[128];
+    double dNsPerOp;
+    double dRelative;
+
+    if(!pFile) {
+        fprintf(stderr, "can't read %s\n", pszFile);
+        return 1;
+    }
+    if(!fgets(szLine, sizeof(szLine), pFile) || strncmp(szLine, "name,ns_per_op,relative,", 24)) {
+        fprintf(stderr, "%s is in an old format, remove it and run again to make a new one\n", pszFile);
+        fclose(pFile);
+        return 1;
+    }
+    while(fgets(szLine, sizeof(szLine), pFile)) {
+        if(szLine[0] == '#' || sscanf(szLine, "%127[^,],%lf,%lf", szName, &dNsPerOp, &dRelative) != 3)
+            continue;
+        Baseline[szName] = dRelative;
+    }
+    fclose(pFile);
+    return 0;
+}
+
+static void writeResults(FILE *pFile, const std::vector<MicroResult> &Results)
+{
+    size_t i;
+
+    fprintf(pFile, "name,ns_per_op,relative,iterations\n");
+    for(i = 0; i < Results.size(); i++)
+        fprintf(pFile, "%s,%.2f,%.4f,%lu\n", Results[i].sName.c_str(), Results[i].dNsPerOp, Results[i].dRelative,
+                Results[i].nIterations);
+}
+
+static void usage(const char *pszName)
+{
+    fprintf(stderr,
+            "usage : %s [options]\n"
+            "  -b file     compare with a baseline CSV\n"
+            "  -t percent  allowed slowdown against the baseline (default %.0f, %.0f for the cases bound by syscalls or locks)\n"
+            "  -w file     write the results as the new baseline\n", pszName, MICRO_THRESHOLD, MICRO_LOOSE_THRESHOLD);
+}
+
+int main(int argc, char **argv)
+{
+    const char *pszBaseline = NULL;
+    const char *pszWrite = NULL;
+    double dThreshold = MICRO_THRESHOLD;
+    std::vector<MicroResult> Results;
+    std::map<std::string, double> Baseline;
+    std::map<std::string, double>::iterator it;
+    FILE *pFile;
+    unsigned long nRefIterations;
+    double dRatio;
+    double dCaseThreshold;
+    int nRegressions = 0;
+    int nOpt;
+    size_t i;
+
+    while((nOpt = getopt(argc, argv, "b:t:w:h")) != -1) {
+        switch(nOpt) {
+            case 'b': pszBaseline = optarg; break;
+            case 't': dThreshold = atof(optarg); break;
+            case 'w': pszWrite = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(pszBaseline && readBaseline(pszBaseline, Baseline))
+        return 1;
+
+    nRefIterations = calibrate(g_Reference);
+    for(i = 0; i < sizeof(g_Cases) / sizeof(g_Cases[0]); i++)
+        Results.push_back(runCase(g_Cases[i], nRefIterations));
+
+    if(!pszBaseline) {
+        writeResults(stdout, Results);
+    }
+    else {
+        printf("name,ns_per_op,relative,baseline_relative,change_pct,status\n");
+        for(i = 0; i < Results.size(); i++) {
+            it = Baseline.find(Results[i].sName);
+            if(it == Baseline.end() || it->second <= 0) {
+                printf("%s,%.2f,%.4f,,,new\n", Results[i].sName.c_str(), Results[i].dNsPerOp, Results[i].dRelative);
+                continue;
+            }
+            dRatio = (Results[i].dRelative / it->second - 1.0) * 100.0;
+            dCaseThreshold = std::max(dThreshold, g_Cases[i].dThreshold);
+            printf("%s,%.2f,%.4f,%.4f,%+.1f,%s\n", Results[i].sName.c_str(), Results[i].dNsPerOp, Results[i].dRelative,
+                   it->second, dRatio, dRatio > dCaseThreshold ? "REGRESSION" : "ok");
+            if(dRatio > dCaseThreshold)
+                nRegressions++;
+        }
+    }
+
+    if(pszWrite) {
+        pFile = fopen(pszWrite, "w");
+        if(!pFile) {
+            fprintf(stderr, "can't write %s\n", pszWrite);
+            return 1;
+        }
+        writeResults(pFile, Results);
+        fclose(pFile);
+    }
+    return nRegressions ? 1 : 0;
+}
@@ -0,0 +1,279 @@
+//
+//  bench_night.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Whole night slaving session in virtual time. The driver runs on a CVirtualClock and talks to
+//  the simulator's dome model through an in-process transport, time only moves when the driver
+//  waits for a reply or when the host loop waits for its next call. A 10 hour session runs in
+//  a few seconds and gives the same numbers on every run for a given seed.
+//
+//  The host loop plays TheSkyX : it slaves the dome to a mount following a list of targets,
+//  calls what dapiGotoAzEl / dapiIsGotoComplete / dapiGetAzEl call (gotoAzimuth, isGoToComplete,
+//  getCurrentAzEl) at the rates of each strategy and we report round trips, bytes on the wire
+//  and how long the dome wasn't lined up with the telescope.
+//  The background poller runs on real time threads so it isn't part of this comparison.
+//  There's a single caller, so query coalescing never has anything to merge and isn't compared.
+//
+//  make bench && ./bench/bench_night [hours] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+
+#include "../rigeldome.h"
+#include "../sim/rigelsimmodel.h"
+
+#define OBS_LATITUDE        45.0    // deg
+#define TARGET_DURATION     2.0     // hours on each target
+#define OFF_TARGET_LIMIT    4.0     // deg, half the slit width
+#define WIRE_BYTE_TIME      (10.0 / 115200.0)   // s, 8N1 at 115200
+
+struct Target {
+    double  dDec;           // deg
+    double  dStartHa;       // hours
+};
+
+static const Target g_Targets[] = {
+    {20.0, -1.0},
+    {60.0, -1.5},
+    {-10.0, -0.5},
+    {44.0, -1.0},           // goes almost through the zenith, fastest az rate of the night
+    {5.0, -1.0}
+};
+
+struct Strategy {
+    const char  *pszName;
+    double      dSlaveInterval;     // s, how often the host checks the dome against the mount
+    double      dSlaveThreshold;    // deg, error before it sends a goto
+    double      dGotoPoll;          // s, dapiIsGotoComplete rate while a goto is running
+    double      dAzElPoll;          // s, dapiGetAzEl rate
+};
+
+static const Strategy g_Strategies[] = {
+    {"default",        10.0, 1.0, 0.5,  1.0},
+    {"lazy slaving",   30.0, 3.0, 1.0,  2.0},
+    {"eager slaving",   2.0, 0.5, 0.2,  0.5},
+    {"fast ui",        10.0, 1.0, 0.1,  0.25}
+};
+
+// dome model, virtual clock and the telescope the dome should follow
+class CNightSim
+{
+public:
+    CNightSim(const SimConfig &Config, double dHours) :
+        m_Sim(Config), m_dHours(dHours), m_dModelTime(0), m_dOffTarget(0) {}
+
+    CVirtualClock   &clock() { return m_Clock; }
+    CRigelSim       &model() { return m_Sim; }
+    double          offTarget() { return m_dOffTarget; }
+    bool            done() { return m_Clock.now() >= m_dHours * 3600.0; }
+
+    // telescope azimuth, north = 0, east = 90
+    double targetAz(double dTime)
+    {
+        int nTarget = (int)(dTime / 3600.0 / TARGET_DURATION) % (int)(sizeof(g_Targets) / sizeof(g_Targets[0]));
+        double dHa = g_Targets[nTarget].dStartHa + fmod(dTime / 3600.0, TARGET_DURATION);
+        double dH = dHa * 15.0 * M_PI / 180.0;
+        double dDec = g_Targets[nTarget].dDec * M_PI / 180.0;
+        double dLat = OBS_LATITUDE * M_PI / 180.0;
+        double dAz = atan2(sin(dH), cos(dH) * sin(dLat) - tan(dDec) * cos(dLat)) * 180.0 / M_PI + 180.0;
+        return CRigelSim::wrap(dAz);
+    }
+
+    // move time and the dome forward
+    void advanceTo(double dTime)
+    {
+        while(m_dModelTime + SIM_TICK / 1000.0 <= dTime) {
+            m_Sim.update(SIM_TICK / 1000.0);
+            m_dModelTime += SIM_TICK / 1000.0;
+            if(fabs(CRigelSim::shortest(m_Sim.getAz(), targetAz(m_dModelTime))) > OFF_TARGET_LIMIT)
+                m_dOffTarget += SIM_TICK / 1000.0;
+        }
+        m_Clock.advanceTo(dTime);
+    }
+
+private:
+    CVirtualClock   m_Clock;
+    CRigelSim       m_Sim;
+    double          m_dHours;
+    double          m_dModelTime;
+    double          m_dOffTarget;
+};
+
+// the serial link, replies come back after the controller latency plus the time on the wire
+class CSimTransport : public CRigelTransport
+{
+public:
+    CSimTransport(CNightSim &Night, const SimConfig &Config) :
+        m_Night(Night), m_Config(Config), m_Rng(Config.nSeed), m_Jitter(0.0, Config.dJitter),
+        m_bOpen(false), m_nBytesTx(0), m_nBytesRx(0) {}
+
+    int     open(const char *) { m_bOpen = true; return SB_OK; }
+    void    close() { m_bOpen = false; }
+    bool    isOpen() { return m_bOpen; }
+
+    int write(const char *pData, unsigned long ulLen)
+    {
+        double dNow = m_Night.clock().now();
+        double dReady;
+        bool bShutterLink;
+        unsigned long i;
+        std::string sReply;
+
+        m_nBytesTx += ulLen;
+        for(i = 0; i < ulLen; i++) {
+            if(pData[i] != '\r') {
+                m_sLine += pData[i];
+                continue;
+            }
+            sReply = m_Night.model().command(m_sLine, bShutterLink) + "\r";
+            m_sLine.clear();
+            dReady = dNow + (i + 1) * WIRE_BYTE_TIME;
+            if(!m_Replies.empty() && m_Replies.back().first > dReady)
+                dReady = m_Replies.back().first;
+            dReady += (m_Config.dLatency + m_Jitter(m_Rng) + (bShutterLink ? m_Config.dBtLatency : 0)) / 1000.0;
+            dReady += sReply.size() * WIRE_BYTE_TIME;
+            m_Replies.push_back(std::make_pair(dReady, sReply));
+        }
+        return SB_OK;
+    }
+
+    int read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs)
+    {
+        double dNow = m_Night.clock().now();
+        double dDeadline = dNow + nTimeoutMs / 1000.0;
+        std::string &sReply = m_Replies.empty() ? m_sEmpty : m_Replies.front().second;
+
+        ulRead = 0;
+        if(m_Replies.empty() || m_Replies.front().first > dDeadline) {
+            m_Night.advanceTo(dDeadline);
+            return SB_OK;
+        }
+        m_Night.advanceTo(m_Replies.front().first);
+
+        ulRead = std::min<unsigned long>(ulLen, (unsigned long)sReply.size());
+        memcpy(pBuffer, sReply.data(), ulRead);
+        sReply.erase(0, ulRead);
+        m_nBytesRx += ulRead;
+        if(sReply.empty())
+            m_Replies.pop_front();
+        return SB_OK;
+    }
+
+    int purge()
+    {
+        m_Replies.clear();
+        m_sLine.clear();
+        return SB_OK;
+    }
+
+    unsigned long   bytesTx() { return m_nBytesTx; }
+    unsigned long   bytesRx() { return m_nBytesRx; }
+
+private:
+    CNightSim       &m_Night;
+    SimConfig       m_Config;
+    std::mt19937    m_Rng;
+    std::uniform_real_distribution<double> m_Jitter;
+    std::deque<std::pair<double, std::string> > m_Replies;
+    std::string     m_sLine;
+    std::string     m_sEmpty;
+    bool            m_bOpen;
+    unsigned long   m_nBytesTx;
+    unsigned long   m_nBytesRx;
+};
+
+static int runNight(const Strategy &Strat, double dHours, unsigned int nSeed)
+{
+    SimConfig Config = {15.0, 5.0, 100.0, 2.0, 5.0, 30.0, 1.0, 68400, true, false, NULL, nSeed};
+    CNightSim Night(Config, dHours);
+    CSimTransport Transport(Night, Config);
+    CRigelDome Dome;
+    std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+    double dNextSlave = 0;
+    double dNextGotoPoll = -1;
+    double dNextAzEl = 0;
+    double dNext;
+    double dCommandedAz = -1000;
+    double dTarget;
+    double dAz;
+    double dEl;
+    bool bComplete;
+    unsigned long nGotos = 0;
+    unsigned long nGotoPolls = 0;
+    unsigned long nAzElPolls = 0;
+    unsigned long nErrors = 0;
+    LinkStats Stats;
+
+    Dome.setClock(&Night.clock());
+    Dome.setTransport(&Transport);
+    if(Dome.Connect("sim")) {
+        fprintf(stderr, "%s : connect failed\n", Strat.pszName);
+        return 1;
+    }
+
+    while(!Night.done()) {
+        dNext = std::min(dNextSlave, dNextAzEl);
+        if(dNextGotoPoll >= 0)
+            dNext = std::min(dNext, dNextGotoPoll);
+        Night.advanceTo(dNext);
+
+        if(Night.clock().now() >= dNextAzEl) {
+            Dome.getCurrentAzEl(dAz, dEl);
+            nAzElPolls++;
+            dNextAzEl = Night.clock().now() + Strat.dAzElPoll;
+        }
+
+        if(dNextGotoPoll >= 0 && Night.clock().now() >= dNextGotoPoll) {
+            nGotoPolls++;
+            if(Dome.isGoToComplete(bComplete)) {
+                nErrors++;
+                bComplete = true;
+            }
+            dNextGotoPoll = bComplete ? -1 : Night.clock().now() + Strat.dGotoPoll;
+        }
+
+        // slaving only sends a new goto once the previous one is done
+        if(Night.clock().now() >= dNextSlave) {
+            dTarget = Night.targetAz(Night.clock().now());
+            if(dNextGotoPoll < 0 && fabs(CRigelSim::shortest(dCommandedAz, dTarget)) > Strat.dSlaveThreshold) {
+                if(Dome.gotoAzimuth(dTarget))
+                    nErrors++;
+                dCommandedAz = dTarget;
+                nGotos++;
+                dNextGotoPoll = Night.clock().now() + Strat.dGotoPoll;
+            }
+            dNextSlave = Night.clock().now() + Strat.dSlaveInterval;
+        }
+    }
+
+    Dome.getLinkStats(Stats);
+    Dome.Disconnect();
+
+    printf("%-14s %7lu %8lu %8lu %9lu %10lu %9lu %7.1f %5.2f%% %6lu %8.0f\n", Strat.pszName, nGotos, nGotoPolls, nAzElPolls,
+           Stats.nRoundTrips, Transport.bytesTx(), Transport.bytesRx(), Night.offTarget() / 60.0,
+           100.0 * Night.offTarget() / (dHours * 3600.0), nErrors,
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count());
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    double dHours = argc > 1 ? atof(argv[1]) : 10.0;
+    unsigned int nSeed = argc > 2 ? (unsigned int)atoi(argv[2]) : 1;
+    int nErr = 0;
+    size_t i;
+
+    printf("%.1f hour session, seed %u, off target = more than %.1f deg from the telescope\n", dHours, nSeed, OFF_TARGET_LIMIT);
+    printf("%-14s %7s %8s %8s %9s %10s %9s %7s %6s %6s %8s\n", "strategy", "gotos", "gc polls", "azel", "round trp",
+           "bytes tx", "bytes rx", "off min", "off %", "errors", "wall ms");
+    for(i = 0; i < sizeof(g_Strategies) / sizeof(g_Strategies[0]); i++)
+        nErr |= runNight(g_Strategies[i], dHours, nSeed);
+    return nErr;
+}
@@ -0,0 +1,208 @@
+//
+//  bench_priority.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Measures the time between abortCurrentCommand() and the STOP command reaching the wire
+//  while the background poller and host threads keep the link busy.
+//  The serial port is simulated : the simulator's model answers (see bench_common.h), the replies
+//  come back after a fixed latency, in order, and some of the BAT replies (which go to the shutter
+//  over BT) are lost.
+//
+//  make bench && ./bench/bench_priority [nb samples]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_common.h"
+
+#define QUERY_LATENCY   15      // ms, dome controller
+#define SHUTTER_LATENCY 120     // ms, dome controller <-> shutter over BT
+#define BAT_LOSS        5       // one BAT reply in BAT_LOSS is lost
+
+class CBenchSerX : public SerXInterface
+{
+public:
+    CBenchSerX() : m_nBatCount(0), m_bStopSeen(false) {}
+
+    int open(const char *, const unsigned long &, const Parity &, const char *) { return 0; }
+    int close() { return 0; }
+    bool isConnected() const { return true; }
+    int flushTx() { return 0; }
+    int waitForBytesRx(const int &, const int &) { return 0; }
+
+    // like a real port, only what has already arrived is dropped, late replies still come in
+    int purgeTxRx()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        moveReady();
+        m_sReady.clear();
+        return 0;
+    }
+
+    int writeFile(void *pBuffer, const unsigned long &ulLen, unsigned long &ulWritten)
+    {
+        std::string sData((const char *)pBuffer, ulLen);
+        std::string sCmd;
+        size_t nPos;
+        Clock::time_point tReady;
+
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        ulWritten = ulLen;
+        // the controller answers in order, a reply can't be ready before the previous one
+        tReady = m_Pending.empty() ? Clock::now() : std::max(Clock::now(), m_Pending.back().first);
+        while((nPos = sData.find('\r')) != std::string::npos) {
+            sCmd = sData.substr(0, nPos);
+            sData.erase(0, nPos + 1);
+
+            if(sCmd == "STOP" && !m_bStopSeen) {
+                m_tStop = Clock::now();
+                m_bStopSeen = true;
+            }
+
+            if(sCmd == "SHUTTER" || sCmd == "BBOND" || sCmd == "BAT") {
+                tReady += std::chrono::milliseconds(SHUTTER_LATENCY);
+                if(sCmd == "BAT" && (++m_nBatCount % BAT_LOSS) == 0)
+                    continue;
+            }
+            else
+                tReady += std::chrono::milliseconds(QUERY_LATENCY);
+
+            m_Pending.push_back(std::make_pair(tReady, m_Model.reply(sCmd)));
+        }
+        m_Cond.notify_all();
+        return 0;
+    }
+
+    int readFile(void *pBuffer, const unsigned long ulLen, unsigned long &ulRead, const unsigned long &ulTimeout)
+    {
+        Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(ulTimeout);
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        moveReady();
+        while(m_sReady.empty() && Clock::now() < tDeadline) {
+            if(m_Pending.empty())
+                m_Cond.wait_until(lock, tDeadline);
+            else
+                m_Cond.wait_until(lock, std::min(tDeadline, m_Pending.front().first));
+            moveReady();
+        }
+        ulRead = std::min<unsigned long>(ulLen, (unsigned long)m_sReady.size());
+        memcpy(pBuffer, m_sReady.data(), ulRead);
+        m_sReady.erase(0, ulRead);
+        return 0;
+    }
+
+    int bytesWaitingRx(int &nBytes)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        moveReady();
+        nBytes = (int)m_sReady.size();
+        return 0;
+    }
+
+    void armStop()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_bStopSeen = false;
+    }
+
+    bool stopTime(Clock::time_point &tStop)
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        tStop = m_tStop;
+        return m_bStopSeen;
+    }
+
+private:
+    void moveReady()
+    {
+        Clock::time_point tNow = Clock::now();
+        while(!m_Pending.empty() && m_Pending.front().first <= tNow) {
+            m_sReady += m_Pending.front().second;
+            m_Pending.pop_front();
+        }
+    }
+
+    CBenchModel                 m_Model;        // m_Mutex
+    std::mutex                  m_Mutex;
+    std::condition_variable     m_Cond;
+    std::deque<std::pair<Clock::time_point, std::string> > m_Pending;
+    std::string                 m_sReady;
+    int                         m_nBatCount;
+    bool                        m_bStopSeen;
+    Clock::time_point           m_tStop;
+};
+
+int main(int argc, char **argv)
+{
+    CBenchSerX Serx;
+    CRigelDome Dome;
+    std::atomic<bool> bRunning(true);
+    std::vector<std::thread> Load;
+    std::vector<double> dLatencies;
+    Clock::time_point tAbort;
+    Clock::time_point tStop;
+    LinkStats Stats;
+    int nSamples = argc > 1 ? atoi(argv[1]) : 100;
+    int i;
+
+    Dome.SetSerxPointer(&Serx);
+    Dome.setCoalesceWindow(0);
+    Dome.setPolling(true, 20, 20, 20, 1000);
+    if(Dome.Connect("bench")) {
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+
+    // host threads asking for the battery and the shutter on top of the poller
+    for(i = 0; i < 2; i++) {
+        Load.push_back(std::thread([&] {
+            double dVolts;
+            int nPercent;
+            while(bRunning) {
+                Dome.getBatteryLevels(dVolts, nPercent);
+                Dome.getCurrentShutterState();
+            }
+        }));
+    }
+
+    srand(1);
+    for(i = 0; i < nSamples; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20 + rand() % 80));
+        Serx.armStop();
+        tAbort = Clock::now();
+        Dome.abortCurrentCommand();
+        if(!Serx.stopTime(tStop))
+            continue;
+        dLatencies.push_back(std::chrono::duration<double, std::milli>(tStop - tAbort).count());
+    }
+
+    bRunning = false;
+    for(i = 0; i < (int)Load.size(); i++)
+        Load[i].join();
+    Dome.getLinkStats(Stats);
+    Dome.Disconnect();
+
+    if(dLatencies.empty()) {
+        fprintf(stderr, "no STOP seen on the wire\n");
+        return 1;
+    }
+    std::sort(dLatencies.begin(), dLatencies.end());
+    printf("abort to wire latency over %d samples (ms) : min %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+           (int)dLatencies.size(), dLatencies.front(), percentile(dLatencies, 50), percentile(dLatencies, 90),
+           percentile(dLatencies, 99), dLatencies.back());
+    printf("round trips %lu, polls preempted %lu, retries %lu (%lu ok), resyncs %lu, stale lines %lu\n",
+           Stats.nRoundTrips, Stats.nPreempted, Stats.nRetries, Stats.nRetriesOk, Stats.nResyncs, Stats.nStaleLines);
+    return 0;
+}
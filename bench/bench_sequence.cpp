@@ -0,0 +1,172 @@
+//
+//  bench_sequence.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Night start (unpark, open) then night end (close, park) against the simulator, run two ways :
+//  - blocking : the caller sends each command and polls is*Complete with a sleep in between,
+//    what a host does with SleeperInterface. One thread is parked for the whole sequence.
+//  - coroutine : nightStartSequence / nightEndSequence on a CDomeSequencer (rigelsequence.h),
+//    the caller only waits on the final future.
+//  We report the time each sequence took, serial round trips and CPU time for the process.
+//
+//  Needs C++20 and the simulator : make sim bench/bench_sequence && ./bench/bench_sequence [poll ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../rigeldome.h"
+#include "../rigelsequence.h"
+
+#define SEQ_SIM_PATH        "./sim/rigelsim"
+#define SEQ_SIM_LATENCY     "15"    // ms
+#define SEQ_SIM_TIMESCALE   "10"    // shutter and rotation 10x faster than real time
+#define SEQ_SIM_WAIT        2000    // ms
+
+typedef std::chrono::steady_clock Clock;
+
+extern char **environ;
+
+static pid_t startSimulator(const char *pszLink)
+{
+    const char *pszArgs[] = {SEQ_SIM_PATH, "-L", pszLink, "-l", SEQ_SIM_LATENCY, "-x", SEQ_SIM_TIMESCALE, NULL};
+    Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(SEQ_SIM_WAIT);
+    struct stat Stat;
+    pid_t nPid;
+
+    unlink(pszLink);
+    if(posix_spawn(&nPid, SEQ_SIM_PATH, NULL, NULL, (char **)pszArgs, environ)) {
+        fprintf(stderr, "can't start %s, run make sim first\n", SEQ_SIM_PATH);
+        return -1;
+    }
+    while(Clock::now() < tDeadline) {
+        if(!stat(pszLink, &Stat))
+            return nPid;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    kill(nPid, SIGTERM);
+    waitpid(nPid, NULL, 0);
+    fprintf(stderr, "%s didn't come up\n", SEQ_SIM_PATH);
+    return -1;
+}
+
+static double cpuSeconds()
+{
+    struct rusage Usage;
+
+    getrusage(RUSAGE_SELF, &Usage);
+    return (double)(Usage.ru_utime.tv_sec + Usage.ru_stime.tv_sec) + (double)(Usage.ru_utime.tv_usec + Usage.ru_stime.tv_usec) / 1e6;
+}
+
+static int waitComplete(CRigelDome &Dome, int (CRigelDome::*pfnIsComplete)(bool &), int nPollMs)
+{
+    bool bComplete = false;
+    int nErr;
+
+    while(true) {
+        nErr = (Dome.*pfnIsComplete)(bComplete);
+        if(nErr || bComplete)
+            return nErr;
+        std::this_thread::sleep_for(std::chrono::milliseconds(nPollMs));
+    }
+}
+
+static int blockingNightStart(CRigelDome &Dome, int nPollMs)
+{
+    int nErr;
+
+    nErr = Dome.unparkDome();
+    if(nErr == RD_OK)
+        nErr = waitComplete(Dome, &CRigelDome::isUnparkComplete, nPollMs);
+    if(nErr || !Dome.hasShutterUnit())
+        return nErr;
+    nErr = Dome.openShutter();
+    if(nErr == RD_OK)
+        nErr = waitComplete(Dome, &CRigelDome::isOpenComplete, nPollMs);
+    return nErr;
+}
+
+static int blockingNightEnd(CRigelDome &Dome, int nPollMs)
+{
+    int nErr;
+
+    if(Dome.hasShutterUnit()) {
+        nErr = Dome.closeShutter();
+        if(nErr == RD_OK)
+            nErr = waitComplete(Dome, &CRigelDome::isCloseComplete, nPollMs);
+        if(nErr)
+            return nErr;
+    }
+    nErr = Dome.parkDome();
+    if(nErr == RD_OK)
+        nErr = waitComplete(Dome, &CRigelDome::isParkComplete, nPollMs);
+    return nErr;
+}
+
+static void report(const char *pszName, const char *pszStep, int nErr, Clock::time_point tStart,
+                   unsigned long nRoundTrips, double dCpu)
+{
+    printf("%-10s %-12s err %d  %7.1f ms  %4lu round trips  cpu %6.1f ms\n", pszName, pszStep, nErr,
+           std::chrono::duration<double, std::milli>(Clock::now() - tStart).count(), nRoundTrips, dCpu * 1000.0);
+}
+
+static int run(bool bCoroutine, const char *pszLink, int nPollMs)
+{
+    const char *pszName = bCoroutine ? "coroutine" : "blocking";
+    CRigelDome Dome;
+    LinkStats Before;
+    LinkStats After;
+    Clock::time_point tStart;
+    double dCpu;
+    int nErr = 0;
+    int nStep;
+
+    if(Dome.setTransport(TRANSPORT_NATIVE_SERIAL) || Dome.Connect(pszLink)) {
+        fprintf(stderr, "can't connect to %s\n", pszLink);
+        return 1;
+    }
+
+    CDomeSequencer Seq(Dome, nPollMs);
+    for(nStep = 0; nStep < 2; nStep++) {
+        Dome.getLinkStats(Before);
+        dCpu = cpuSeconds();
+        tStart = Clock::now();
+        if(bCoroutine)
+            nErr = Seq.start(nStep ? nightEndSequence(Seq) : nightStartSequence(Seq)).get();
+        else
+            nErr = nStep ? blockingNightEnd(Dome, nPollMs) : blockingNightStart(Dome, nPollMs);
+        Dome.getLinkStats(After);
+        report(pszName, nStep ? "night end" : "night start", nErr, tStart, After.nRoundTrips - Before.nRoundTrips, cpuSeconds() - dCpu);
+        if(nErr)
+            break;
+    }
+    Seq.stop();
+    Dome.Disconnect();
+    return nErr ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int nPollMs = argc > 1 ? atoi(argv[1]) : SEQUENCE_POLL_INTERVAL;
+    char szLink[64];
+    pid_t nSimPid;
+    int nErr = 0;
+
+    snprintf(szLink, sizeof(szLink), "/tmp/bench-sequence-%d", (int)getpid());
+    nSimPid = startSimulator(szLink);
+    if(nSimPid < 0)
+        return 1;
+
+    nErr |= run(false, szLink, nPollMs);
+    nErr |= run(true, szLink, nPollMs);
+
+    kill(nSimPid, SIGTERM);
+    waitpid(nSimPid, NULL, 0);
+    unlink(szLink);
+    return nErr;
+}
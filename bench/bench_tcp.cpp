@@ -0,0 +1,188 @@
+//
+//  bench_tcp.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Runs the driver over the TCP transport against a local stand in for a serial to Ethernet
+//  server with the dome behind it. Measures single query and batched status round trips,
+//  then has the server drop the connection to check that the driver reconnects on its own.
+//
+//  make bench && ./bench/bench_tcp [nb commands] [controller delay in ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_common.h"
+
+class CDomeServer
+{
+public:
+    CDomeServer(int nDelayMs) : m_nDelayMs(nDelayMs), m_bRunning(true), m_bDrop(false), m_nConnections(0)
+    {
+        struct sockaddr_in Addr;
+        socklen_t nLen = sizeof(Addr);
+        int nOn = 1;
+
+        m_nListenFd = socket(AF_INET, SOCK_STREAM, 0);
+        setsockopt(m_nListenFd, SOL_SOCKET, SO_REUSEADDR, &nOn, sizeof(nOn));
+        memset(&Addr, 0, sizeof(Addr));
+        Addr.sin_family = AF_INET;
+        Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Addr.sin_port = 0;
+        bind(m_nListenFd, (struct sockaddr *)&Addr, sizeof(Addr));
+        listen(m_nListenFd, 4);
+        getsockname(m_nListenFd, (struct sockaddr *)&Addr, &nLen);
+        m_nPort = ntohs(Addr.sin_port);
+        m_Thread = std::thread(&CDomeServer::serve, this);
+    }
+
+    ~CDomeServer()
+    {
+        m_bRunning = false;
+        m_Thread.join();
+        close(m_nListenFd);
+    }
+
+    int port() { return m_nPort; }
+    int connections() { return m_nConnections; }
+    void dropConnection() { m_bDrop = true; }
+
+private:
+    void serve()
+    {
+        struct pollfd Poll;
+        std::string sLine;
+        std::string sReply;
+        char cBuffer[256];
+        ssize_t nRead;
+        ssize_t i;
+        int nFd;
+
+        while(m_bRunning) {
+            Poll.fd = m_nListenFd;
+            Poll.events = POLLIN;
+            if(poll(&Poll, 1, 50) <= 0)
+                continue;
+            nFd = accept(m_nListenFd, NULL, NULL);
+            if(nFd < 0)
+                continue;
+            m_nConnections++;
+            sLine.clear();
+
+            while(m_bRunning && !m_bDrop) {
+                Poll.fd = nFd;
+                Poll.events = POLLIN;
+                if(poll(&Poll, 1, 50) <= 0)
+                    continue;
+                nRead = read(nFd, cBuffer, sizeof(cBuffer));
+                if(nRead <= 0)
+                    break;
+                for(i = 0; i < nRead; i++) {
+                    if(cBuffer[i] != '\r') {
+                        sLine += cBuffer[i];
+                        continue;
+                    }
+                    sReply = m_Model.reply(sLine);
+                    sLine.clear();
+                    if(m_nDelayMs)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(m_nDelayMs));
+                    if(write(nFd, sReply.data(), sReply.size()) < 0)
+                        break;
+                }
+            }
+            m_bDrop = false;
+            close(nFd);
+        }
+    }
+
+    CBenchModel         m_Model;
+    int                 m_nDelayMs;
+    int                 m_nListenFd;
+    int                 m_nPort;
+    std::atomic<bool>   m_bRunning;
+    std::atomic<bool>   m_bDrop;
+    std::atomic<int>    m_nConnections;
+    std::thread         m_Thread;
+};
+
+static void report(const char *pszName, std::vector<double> &dTimes)
+{
+    std::sort(dTimes.begin(), dTimes.end());
+    printf("%-28s %d (ms) : min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", pszName, (int)dTimes.size(),
+           dTimes.front(), percentile(dTimes, 50), percentile(dTimes, 90), percentile(dTimes, 99), dTimes.back());
+}
+
+int main(int argc, char **argv)
+{
+    int nCommands = argc > 1 ? atoi(argv[1]) : 1000;
+    int nDelayMs = argc > 2 ? atoi(argv[2]) : 0;
+    CDomeServer Server(nDelayMs);
+    CBenchDome Dome;
+    std::vector<double> dSingle;
+    std::vector<double> dBatch;
+    Clock::time_point tStart;
+    char szAddress[64];
+    char szAngle[SERIAL_BUFFER_SIZE];
+    char szState[SERIAL_BUFFER_SIZE];
+    char szShutter[SERIAL_BUFFER_SIZE];
+    char szBond[SERIAL_BUFFER_SIZE];
+    RigelCommand Status[4] = {
+        {"ANGLE\r", szAngle, SERIAL_BUFFER_SIZE, 0},
+        {"MSTATE\r", szState, SERIAL_BUFFER_SIZE, 0},
+        {"SHUTTER\r", szShutter, SERIAL_BUFFER_SIZE, 0},
+        {"BBOND\r", szBond, SERIAL_BUFFER_SIZE, 0}};
+    LinkStats Stats;
+    double dAz;
+    int nErr;
+    int i;
+
+    snprintf(szAddress, sizeof(szAddress), "127.0.0.1:%d", Server.port());
+    Dome.setCoalesceWindow(0);
+    if(Dome.setTransport(TRANSPORT_TCP) || Dome.Connect(szAddress)) {
+        fprintf(stderr, "can't connect to %s\n", szAddress);
+        return 1;
+    }
+
+    for(i = 0; i < nCommands; i++) {
+        tStart = Clock::now();
+        if(!Dome.getDomeAz(dAz))
+            dSingle.push_back(std::chrono::duration<double, std::milli>(Clock::now() - tStart).count());
+        tStart = Clock::now();
+        if(!Dome.domeCommandBatch(Status, 4))
+            dBatch.push_back(std::chrono::duration<double, std::milli>(Clock::now() - tStart).count());
+    }
+    if(dSingle.empty() || dBatch.empty()) {
+        fprintf(stderr, "no replies\n");
+        return 1;
+    }
+    report("ANGLE", dSingle);
+    report("ANGLE MSTATE SHUTTER BBOND", dBatch);
+
+    // server side drop, the driver should be back on the next command or the one after
+    Server.dropConnection();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    tStart = Clock::now();
+    nErr = Dome.getDomeAz(dAz);
+    if(nErr)
+        nErr = Dome.getDomeAz(dAz);
+    printf("after server drop : err %d in %.3f ms, %d connections\n", nErr,
+           std::chrono::duration<double, std::milli>(Clock::now() - tStart).count(), Server.connections());
+
+    Dome.getLinkStats(Stats);
+    printf("round trips %lu, resyncs %lu, retries %lu (%lu ok)\n", Stats.nRoundTrips, Stats.nResyncs, Stats.nRetries, Stats.nRetriesOk);
+    Dome.Disconnect();
+    return nErr ? 1 : 0;
+}
@@ -0,0 +1,160 @@
+//
+//  bench_transport.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Compares the command round trip time through the SerX transport and the native Linux
+//  serial transport. Both talk to the same pseudo terminal, a thread on the master side
+//  plays the dome controller (see bench_common.h) and answers each line after a fixed delay.
+//  TheSkyX's own SerX isn't available outside of it, the stand in here blocks in poll()
+//  on the fd until data comes in or the timeout expires, so what's left is the cost of the
+//  transport itself : one blocking read per chunk vs epoll and the native read path.
+//  A pty has no USB adapter behind it, so the FTDI latency timer gain doesn't show here.
+//
+//  make bench && ./bench/bench_transport [nb commands] [controller delay in ms]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench_common.h"
+
+class CBenchSerX : public SerXInterface
+{
+public:
+    CBenchSerX() : m_nFd(-1) {}
+    ~CBenchSerX() { close(); }
+
+    int open(const char *pszPort, const unsigned long &, const Parity &, const char *)
+    {
+        struct termios Tio;
+
+        m_nFd = ::open(pszPort, O_RDWR | O_NOCTTY);
+        if(m_nFd < 0)
+            return 1;
+        tcgetattr(m_nFd, &Tio);
+        cfmakeraw(&Tio);
+        Tio.c_cc[VMIN] = 0;
+        Tio.c_cc[VTIME] = 0;
+        tcsetattr(m_nFd, TCSANOW, &Tio);
+        return 0;
+    }
+
+    int close()
+    {
+        if(m_nFd >= 0)
+            ::close(m_nFd);
+        m_nFd = -1;
+        return 0;
+    }
+
+    bool isConnected() const { return m_nFd >= 0; }
+    int flushTx() { return tcdrain(m_nFd); }
+    int purgeTxRx() { return tcflush(m_nFd, TCIOFLUSH); }
+    int waitForBytesRx(const int &, const int &) { return 0; }
+
+    int writeFile(void *pBuffer, const unsigned long &ulLen, unsigned long &ulWritten)
+    {
+        ssize_t nWritten = ::write(m_nFd, pBuffer, ulLen);
+        ulWritten = nWritten > 0 ? (unsigned long)nWritten : 0;
+        return nWritten < 0;
+    }
+
+    int readFile(void *pBuffer, const unsigned long ulLen, unsigned long &ulRead, const unsigned long &ulTimeout)
+    {
+        Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(ulTimeout);
+        struct pollfd Poll;
+        ssize_t nRead;
+        int nWait;
+
+        ulRead = 0;
+        Poll.fd = m_nFd;
+        Poll.events = POLLIN;
+        while(true) {
+            nRead = ::read(m_nFd, pBuffer, ulLen);
+            if(nRead > 0) {
+                ulRead = (unsigned long)nRead;
+                return 0;
+            }
+            nWait = (int)std::chrono::duration_cast<std::chrono::milliseconds>(tDeadline - Clock::now()).count();
+            if(nWait <= 0)
+                return 0;
+            if(poll(&Poll, 1, nWait) < 0 && errno != EINTR)
+                return 1;
+        }
+    }
+
+    int bytesWaitingRx(int &nBytes)
+    {
+        return ioctl(m_nFd, FIONREAD, &nBytes);
+    }
+
+private:
+    int m_nFd;
+};
+
+static int run(int nTransport, const char *pszPort, int nCommands)
+{
+    CBenchSerX Serx;
+    CBenchDome Dome;
+    std::vector<double> dTimes;
+    Clock::time_point tStart;
+    RttStats Rtt;
+    double dAz;
+    int i;
+
+    Dome.SetSerxPointer(&Serx);
+    Dome.setCoalesceWindow(0);
+    if(Dome.setTransport(nTransport) || Dome.Connect(pszPort)) {
+        fprintf(stderr, "can't connect with transport %d\n", nTransport);
+        return 1;
+    }
+
+    for(i = 0; i < nCommands; i++) {
+        tStart = Clock::now();
+        if(Dome.getDomeAz(dAz))
+            continue;
+        dTimes.push_back(std::chrono::duration<double, std::milli>(Clock::now() - tStart).count());
+    }
+    Dome.getRttStats(TIMING_QUERY, Rtt);
+    Dome.Disconnect();
+
+    if(dTimes.empty()) {
+        fprintf(stderr, "no reply with transport %d\n", nTransport);
+        return 1;
+    }
+    std::sort(dTimes.begin(), dTimes.end());
+    printf("%-8s %d commands (ms) : min %.3f  p50 %.3f  p90 %.3f  p99 %.3f  max %.3f  (srtt %.3f)\n",
+           nTransport == TRANSPORT_SERX ? "serx" : "native", (int)dTimes.size(), dTimes.front(),
+           percentile(dTimes, 50), percentile(dTimes, 90), percentile(dTimes, 99), dTimes.back(), Rtt.dSrtt);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    CBenchPty Pty;
+    int nCommands = argc > 1 ? atoi(argv[1]) : 1000;
+    int nDelayMs = argc > 2 ? atoi(argv[2]) : 0;
+    int nErr = 0;
+
+    if(Pty.start(nDelayMs))
+        return 1;
+
+    nErr |= run(TRANSPORT_SERX, Pty.port(), nCommands);
+    nErr |= run(TRANSPORT_NATIVE_SERIAL, Pty.port(), nCommands);
+
+    Pty.stop();
+    return nErr;
+}
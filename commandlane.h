@@ -0,0 +1,199 @@
+//
+//  commandlane.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Runs dome commands one after the other on a worker thread, each submission gets a std::future.
+//  Commands run in the order they were submitted. The ones that haven't started can be cancelled,
+//  their future then gets the value given when they were submitted.
+//  The worker is started by the first queued command and stopped by stop(), anything submitted
+//  while stop() runs is cancelled right away.
+//  An optional hook is called after each queued command completes or is cancelled.
+
+#ifndef __COMMAND_LANE__
+#define __COMMAND_LANE__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class CCommandLane
+{
+public:
+    CCommandLane() : m_bRunning(false), m_bBusy(false), m_bStopping(false), m_nHookCalls(0) {}
+    ~CCommandLane() { stop(); }
+
+    // bInline runs the command on the calling thread when nothing is queued or running,
+    // otherwise it waits its turn like any other. Called from the worker it always runs inline.
+    template <typename R, typename F>
+    std::future<R> submit(F fnCommand, const R &Cancelled, bool bInline)
+    {
+        std::shared_ptr<std::promise<R>> pPromise;
+        std::promise<R> Promise;
+        std::future<R> Result;
+        LaneTask Task;
+
+        {
+            std::unique_lock<std::mutex> lock(m_Mutex);
+            if(std::this_thread::get_id() == m_WorkerId) {
+                lock.unlock();
+                Result = Promise.get_future();
+                Promise.set_value(fnCommand());
+                return Result;
+            }
+
+            if(m_bStopping) {
+                Result = Promise.get_future();
+                Promise.set_value(Cancelled);
+                return Result;
+            }
+
+            if(bInline && !m_bBusy && m_Tasks.empty()) {
+                // busy keeps the worker from starting a queued command under us
+                m_bBusy = true;
+                lock.unlock();
+                Result = Promise.get_future();
+                Promise.set_value(fnCommand());
+                lock.lock();
+                m_bBusy = false;
+                lock.unlock();
+                m_Cond.notify_all();
+                return Result;
+            }
+
+            pPromise = std::make_shared<std::promise<R>>();
+            Result = pPromise->get_future();
+            Task.fnRun = [pPromise, fnCommand] { pPromise->set_value(fnCommand()); };
+            Task.fnCancel = [pPromise, Cancelled] { pPromise->set_value(Cancelled); };
+            m_Tasks.push_back(std::move(Task));
+            if(!m_Worker.joinable()) {
+                m_bRunning = true;
+                m_Worker = std::thread(&CCommandLane::worker, this);
+                m_WorkerId = m_Worker.get_id();
+            }
+        }
+        m_Cond.notify_all();
+        return Result;
+    }
+
+    // once it returns the old hook isn't running anywhere, except when called from a hook
+    void setDoneHook(std::function<void()> fnHook)
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_fnDoneHook = fnHook;
+        if(!hookDepth())
+            m_Cond.wait(lock, [&] { return !m_nHookCalls; });
+    }
+
+    // drop everything that hasn't started, the command running now completes normally
+    void cancel()
+    {
+        std::deque<LaneTask> Cancelled;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            Cancelled.swap(m_Tasks);
+        }
+        for(LaneTask &Task : Cancelled)
+            Task.fnCancel();
+        if(!Cancelled.empty())
+            callDoneHook();
+    }
+
+    // cancel what's pending, wait for the running command and the worker. Not from a command.
+    void stop()
+    {
+        std::deque<LaneTask> Cancelled;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bStopping = true;
+            m_bRunning = false;
+            Cancelled.swap(m_Tasks);
+        }
+        m_Cond.notify_all();
+        for(LaneTask &Task : Cancelled)
+            Task.fnCancel();
+        if(!Cancelled.empty())
+            callDoneHook();
+        if(m_Worker.joinable())
+            m_Worker.join();
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        // an inline command started before we did
+        m_Cond.wait(lock, [&] { return !m_bBusy; });
+        m_WorkerId = std::thread::id();
+        m_bStopping = false;
+    }
+
+private:
+    struct LaneTask {
+        std::function<void()>   fnRun;
+        std::function<void()>   fnCancel;
+    };
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        LaneTask Task;
+
+        while(true) {
+            m_Cond.wait(lock, [&] { return (!m_Tasks.empty() && !m_bBusy) || !m_bRunning; });
+            if(!m_bRunning)
+                break;
+            Task = std::move(m_Tasks.front());
+            m_Tasks.pop_front();
+            m_bBusy = true;
+            lock.unlock();
+            Task.fnRun();
+            callDoneHook();
+            lock.lock();
+            m_bBusy = false;
+            m_Cond.notify_all();
+        }
+    }
+
+    void callDoneHook()
+    {
+        std::function<void()> fnHook;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if(!m_fnDoneHook)
+                return;
+            fnHook = m_fnDoneHook;
+            m_nHookCalls++;
+        }
+        hookDepth()++;
+        fnHook();
+        hookDepth()--;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_nHookCalls--;
+        }
+        m_Cond.notify_all();
+    }
+
+    // > 0 while this thread runs a done hook, of any lane
+    static int &hookDepth()
+    {
+        static thread_local int nDepth = 0;
+        return nDepth;
+    }
+
+    std::thread                 m_Worker;
+    std::thread::id             m_WorkerId;
+    std::mutex                  m_Mutex;
+    std::condition_variable     m_Cond;
+    std::deque<LaneTask>        m_Tasks;
+    std::function<void()>       m_fnDoneHook;
+    bool                        m_bRunning;
+    bool                        m_bBusy;
+    bool                        m_bStopping;
+    int                         m_nHookCalls;
+};
+
+#endif
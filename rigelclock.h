@@ -0,0 +1,84 @@
+//
+//  rigelclock.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Time source for the driver timers. CRigelDome reads the real monotonic clock unless
+//  a simulation gives it a CVirtualClock, in which case time only moves when the
+//  simulation advances it (see bench/bench_night.cpp).
+
+#ifndef __RIGEL_CLOCK__
+#define __RIGEL_CLOCK__
+
+#include <atomic>
+#include <chrono>
+
+class CRigelClock
+{
+public:
+    virtual ~CRigelClock() {}
+
+    // seconds since an arbitrary origin, never goes back
+    virtual double  now() = 0;
+
+    static CRigelClock *realClock();
+};
+
+class CRealClock : public CRigelClock
+{
+public:
+    double  now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
+
+inline CRigelClock *CRigelClock::realClock()
+{
+    static CRealClock RealClock;
+    return &RealClock;
+}
+
+// read by every thread with a driver timer, advanced by the simulation
+class CVirtualClock : public CRigelClock
+{
+public:
+    CVirtualClock() : m_dNow(0) {}
+
+    double  now() { return m_dNow; }
+
+    void advance(double dSeconds)
+    {
+        double dNow = m_dNow;
+
+        while(dSeconds > 0 && !m_dNow.compare_exchange_weak(dNow, dNow + dSeconds))
+            ;
+    }
+
+    void advanceTo(double dTime)
+    {
+        double dNow = m_dNow;
+
+        while(dTime > dNow && !m_dNow.compare_exchange_weak(dNow, dTime))
+            ;
+    }
+
+private:
+    std::atomic<double> m_dNow;
+};
+
+// same interface as CStopWatch, on a CRigelClock
+class CRigelTimer
+{
+public:
+    CRigelTimer(CRigelClock *pClock = CRigelClock::realClock()) : m_pClock(pClock) { Reset(); }
+
+    void    setClock(CRigelClock *pClock) { m_pClock = pClock; Reset(); }
+    void    Reset() { m_dStart = m_pClock->now(); }
+    double  GetElapsedSeconds() { return m_pClock->now() - m_dStart; }
+
+private:
+    CRigelClock *m_pClock;
+    double      m_dStart;
+};
+
+#endif
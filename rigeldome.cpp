@@ -10,9 +10,127 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <memory.h>
+#include <charconv>
 #ifdef SB_MAC_BUILD
 #include <unistd.h>
 #endif
+#ifdef SB_LINUX_BUILD
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Everything we send. Queries are matched on the whole command, their reply only depends on the
+// dome state so callers asking the same thing within the coalescing window get the same reply.
+// Commands with an argument are matched on their prefix, first match wins.
+// The shutter commands go to the shutter over BT and take a lot longer to answer.
+// STOP and CLOSE get the link before anything else, see acquireLink.
+struct RigelCommandInfo {
+    const char  *pszCmd;
+    int         nQuery;     // RigelQueries index, -1 if the command changes something
+    int         nReplyType;
+    int         nTimingClass;
+    int         nPriority;
+};
+
+static const RigelCommandInfo g_RigelCommands[] = {
+    {"ANGLE\r",     Q_ANGLE,    REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"MSTATE\r",    Q_MSTATE,   REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"SHUTTER\r",   Q_SHUTTER,  REPLY_NUMBER,   TIMING_SHUTTER,   PRIO_POLL},
+    {"BBOND\r",     Q_BBOND,    REPLY_NUMBER,   TIMING_SHUTTER,   PRIO_POLL},
+    {"BAT\r",       Q_BAT,      REPLY_NUMBER,   TIMING_SHUTTER,   PRIO_POLL},
+    {"V\r",         Q_V,        REPLY_FIELDS,   TIMING_QUERY,     PRIO_POLL},
+    {"VER\r",       Q_VER,      REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"PULSAR\r",    Q_PULSAR,   REPLY_TEXT,     TIMING_QUERY,     PRIO_POLL},
+    {"ENCREV\r",    Q_ENCREV,   REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"HOME ?\r",    Q_AT_HOME,  REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"HOME\r",      Q_HOME,     REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"PARK\r",      Q_PARK,     REPLY_NUMBER,   TIMING_QUERY,     PRIO_POLL},
+    {"ANGLE K ",    -1,         REPLY_ACK,      TIMING_MOTION,    PRIO_MOTION},
+    {"GO ",         -1,         REPLY_ACK,      TIMING_MOTION,    PRIO_MOTION},
+    {"OPEN\r",      -1,         REPLY_ACK,      TIMING_SHUTTER,   PRIO_MOTION},
+    {"CLOSE\r",     -1,         REPLY_ACK,      TIMING_SHUTTER,   PRIO_SAFETY},
+    {"CALIBRATE\r", -1,         REPLY_ACK,      TIMING_MOTION,    PRIO_MOTION},
+    {"HOME ",       -1,         REPLY_ACK,      TIMING_MOTION,    PRIO_CONFIG},
+    {"PARK ",       -1,         REPLY_ACK,      TIMING_MOTION,    PRIO_CONFIG},
+    {"STOP\r",      -1,         REPLY_ACK,      TIMING_MOTION,    PRIO_SAFETY},
+    {"BTFORCE\r",   -1,         REPLY_ANY,      TIMING_SHUTTER,   PRIO_CONFIG},
+    {"BBOND 1\r",   -1,         REPLY_ANY,      TIMING_SHUTTER,   PRIO_CONFIG}
+};
+
+static const RigelCommandInfo *findCommand(const char *pszCmd)
+{
+    size_t i;
+
+    for(i = 0; i < sizeof(g_RigelCommands) / sizeof(g_RigelCommands[0]); i++) {
+        if(!strncmp(pszCmd, g_RigelCommands[i].pszCmd, strlen(g_RigelCommands[i].pszCmd)))
+            return &g_RigelCommands[i];
+    }
+    return NULL;
+}
+
+static int findQuery(const char *pszCmd)
+{
+    const RigelCommandInfo *pInfo = findCommand(pszCmd);
+    return pInfo ? pInfo->nQuery : -1;
+}
+
+static int findReplyType(const char *pszCmd)
+{
+    const RigelCommandInfo *pInfo = findCommand(pszCmd);
+    return pInfo ? pInfo->nReplyType : REPLY_ANY;
+}
+
+static int findTimingClass(const char *pszCmd)
+{
+    const RigelCommandInfo *pInfo = findCommand(pszCmd);
+    return pInfo ? pInfo->nTimingClass : TIMING_MOTION;
+}
+
+static int findPriority(const char *pszCmd)
+{
+    const RigelCommandInfo *pInfo = findCommand(pszCmd);
+    return pInfo ? pInfo->nPriority : PRIO_CONFIG;
+}
+
+static bool isNumericReply(const char *pszReply)
+{
+    while(*pszReply == ' ' || *pszReply == '\n')
+        pszReply++;
+    if(*pszReply == '-' || *pszReply == '+')
+        pszReply++;
+    return isdigit((unsigned char)*pszReply) || (*pszReply == '.' && isdigit((unsigned char)pszReply[1]));
+}
+
+static int countFields(const char *pszReply)
+{
+    int nNbFields = 1;
+
+    while((pszReply = strchr(pszReply, '\t')) != NULL) {
+        nNbFields++;
+        pszReply++;
+    }
+    return nNbFields;
+}
+
+// Does this line look like a reply to a command expecting nReplyType ?
+// A late reply to an earlier command is either an ack, a number, or a V reply.
+static bool isExpectedReply(const char *pszReply, int nReplyType)
+{
+    switch(nReplyType) {
+        case REPLY_ACK:
+            return pszReply[0] == 'A';
+        case REPLY_NUMBER:
+            return isNumericReply(pszReply) && !strchr(pszReply, '\t');
+        case REPLY_TEXT:
+            return pszReply[0] != 0 && strcmp(pszReply, "A") != 0;
+        case REPLY_FIELDS:
+            // a full V reply, anything else is a late reply to another command. Firmware without
+            // V times out here and refreshState falls back to the individual queries.
+            return countFields(pszReply) >= V_RESPONSE_FIELDS;
+        default:
+            return true;
+    }
+}
 
 CRigelDome::CRigelDome()
 {
@@ -21,6 +139,9 @@ CRigelDome::CRigelDome()
     m_pLogger = NULL;
     
     m_pSerx = NULL;
+    m_pTransport = &m_SerXTransport;
+    m_nTransport = TRANSPORT_SERX;
+    m_pClock = CRigelClock::realClock();
     m_bIsConnected = false;
 
     m_nNbStepPerRev = 0;
@@ -36,14 +157,76 @@ CRigelDome::CRigelDome()
 
     m_bHasShutter = false;
     m_bShutterOpened = false;
+    m_nShutterState = UNKNOWN;
+    m_nMotorState = IDLE;
+
+    m_nCmdGeneration = 0;
+    m_nAbortGeneration = 0;
+    m_bShutterStateValid = false;
+    m_nShutterStateErr = RD_OK;
+    m_bUseExtendedState = true;
+    m_nExtendedStateFailures = 0;
+    m_bExtendedStateOk = false;
+    memset(&m_DomeStatus, 0, sizeof(DomeStatus));
+    m_StatusClock.Reset();
+
+    m_bDispatching = false;
+    m_nDispatchingId = 0;
+    m_nNextSubscription = 1;
+    resetObserved();
+    subscribe(EVENT_SHUTTER | EVENT_BOND, [this](const DomeEvent &Event) { logStateEvent(Event); });
+
+    m_bPollNow = false;
+    m_bPollerRunning = false;
+    m_nPollingRequests = 0;
+    m_bPollingEnabled = false;
+    m_nPollInterval = DEFAULT_POLL_INTERVAL;
+    m_nPollIdleInterval = DEFAULT_POLL_IDLE_INTERVAL;
+    m_nPollIdleMax = DEFAULT_POLL_IDLE_MAX;
+    m_nPollIdleCurrent = DEFAULT_POLL_IDLE_INTERVAL;
+    m_nPollWaitMs = 0;
+    m_bPollResetBackoff = false;
+    m_dMaxStatusAge = DEFAULT_MAX_STATUS_AGE / 1000.0;
+
+    m_nIoSeq = 0;
+    m_bIoRunning = false;
+    m_bIoEnabled = false;
+    m_nIoPriority = DEFAULT_IO_PRIORITY;
+    m_nIoCpu = DEFAULT_IO_CPU;
+    m_bIoRealTime = false;
+    m_bIoPinned = false;
+
+    m_dCoalesceWindow = DEFAULT_COALESCE_WINDOW / 1000.0;
+    m_nRoundTrips = 0;
+    m_nCoalesced = 0;
+    clearQueryCache();
+
+    m_bLinkResync = true;
+    m_nStaleLines = 0;
+    m_nResyncs = 0;
+    m_nRetries = 0;
+    m_nRetriesOk = 0;
+    m_nPreempted = 0;
+    resetLockStats();
+    resetRttStats();
+
+    m_bLinkBusy = false;
+    m_nLinkPriority = PRIO_POLL;
+    memset(m_nLinkWaiting, 0, sizeof(m_nLinkWaiting));
+    m_bLinkPreempt = false;
     
     m_bParked = true;
     m_bHomed = false;
     memset(m_szFirmwareVersion,0,SERIAL_BUFFER_SIZE);
     memset(m_szLogBuffer,0,ND_LOG_BUFFER_SIZE);
+    clearRxBuffer();
 
 	m_cmdDelayCheckTimer.Reset();
 
+    m_bShutterBonded = false;
+    m_bShutterBondValid = false;
+    m_BondCheckTimer.Reset();
+
 #ifdef PLUGIN_DEBUG
 #if defined(SB_WIN_BUILD)
     m_sLogfilePath = getenv("HOMEDRIVE");
@@ -72,11 +255,18 @@ CRigelDome::CRigelDome()
 
 CRigelDome::~CRigelDome()
 {
-
+    m_CmdLane.stop();
+    m_SafetyLane.stop();
+    {
+        std::lock_guard<std::mutex> lock(m_PollerCtlMutex);
+        stopPoller();
+    }
+    stopIoThread();
 }
 
 int CRigelDome::Connect(const char *pszPort)
 {
+    double dDomeAz;
     int nErr;
     int nState;
 
@@ -88,8 +278,7 @@ int CRigelDome::Connect(const char *pszPort)
     fflush(Logfile);
 #endif
 
-    // 115200 8N1
-    if(m_pSerx->open(pszPort, 115200, SerXInterface::B_NOPARITY, "-DTR_CONTROL 1") == 0)
+    if(m_pTransport->open(pszPort) == SB_OK)
         m_bIsConnected = true;
     else
         m_bIsConnected = false;
@@ -97,6 +286,27 @@ int CRigelDome::Connect(const char *pszPort)
     if(!m_bIsConnected)
         return ERR_COMMNOLINK;
 
+    clearRxBuffer();
+    clearQueryCache();
+    invalidateShutterBond();
+    invalidateState(true);
+    resetObserved();        // could be a different dome
+    m_bUseExtendedState = true;
+    m_nExtendedStateFailures = 0;
+    m_bLinkResync = true;   // start from a clean port
+    m_nRoundTrips = 0;
+    m_nCoalesced = 0;
+    m_nStaleLines = 0;
+    m_nResyncs = 0;
+    m_nRetries = 0;
+    m_nRetriesOk = 0;
+    m_nPreempted = 0;
+    resetLockStats();
+    resetRttStats();   // could be a different port or adapter
+
+    if(m_bIoEnabled)
+        startIoThread();
+
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
     ltime = time(NULL);
     timestamp = asctime(localtime(&ltime));
@@ -117,7 +327,8 @@ int CRigelDome::Connect(const char *pszPort)
         fflush(Logfile);
 #endif
         m_bIsConnected = false;
-        m_pSerx->close();
+        stopIoThread();
+        m_pTransport->close();
         return ERR_CMDFAILED;
     }
 
@@ -135,286 +346,806 @@ int CRigelDome::Connect(const char *pszPort)
     if(nState != NOT_FITTED && nState != UNKNOWN )
         m_bHasShutter = true;
 
-    getDomeAz(m_dCurrentAzPosition);
-    getDomeAz(m_dGotoAz);
-    
+    // getDomeAz updates m_dCurrentAzPosition
+    if(getDomeAz(dDomeAz) == RD_OK)
+        m_dGotoAz = dDomeAz;
+
+    {
+        std::lock_guard<std::mutex> lock(m_PollerCtlMutex);
+        if(m_bPollingEnabled || m_nPollingRequests)
+            startPoller();
+    }
+
     return SB_OK;
 }
 
 
 void CRigelDome::Disconnect()
 {
+    // queued async commands get RD_ABORTED, a running one completes before we take the link
+    m_CmdLane.stop();
+    m_SafetyLane.stop();
+    {
+        std::lock_guard<std::mutex> lock(m_PollerCtlMutex);
+        stopPoller();
+    }
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+    ltime = time(NULL);
+    timestamp = asctime(localtime(&ltime));
+    timestamp[strlen(timestamp) - 1] = 0;
+    fprintf(Logfile, "[%s] [CRigelDome::Disconnect] %lu round trips, %lu queries coalesced, %lu stale lines, %lu resyncs, %lu retries (%lu ok)\n", timestamp,
+            (unsigned long)m_nRoundTrips, (unsigned long)m_nCoalesced, (unsigned long)m_nStaleLines, (unsigned long)m_nResyncs,
+            (unsigned long)m_nRetries, (unsigned long)m_nRetriesOk);
+    fprintf(Logfile, "[%s] [CRigelDome::Disconnect] %lu polls preempted\n", timestamp, (unsigned long)m_nPreempted);
+    for(int nClass = 0; nClass < NB_TIMING_CLASSES; nClass++)
+        fprintf(Logfile, "[%s] [CRigelDome::Disconnect] timing class %d : srtt %3.1f ms, rttvar %3.1f ms, timeout %d ms, %lu samples, %lu timeouts\n", timestamp,
+                nClass, m_Rtt[nClass].dSrtt, m_Rtt[nClass].dRttVar, m_Rtt[nClass].nTimeout, m_Rtt[nClass].nSamples, m_Rtt[nClass].nTimeouts);
+    fflush(Logfile);
+#endif
+    CLinkLock link(this, PRIO_CONFIG);
+    // we own the link, the I/O thread is idle
+    stopIoThread();
     if(m_bIsConnected) {
-        m_pSerx->purgeTxRx();
-        m_pSerx->close();
+        m_pTransport->purge();
+        m_pTransport->close();
     }
+    clearRxBuffer();
     m_bIsConnected = false;
 }
 
+void CRigelDome::acquireLink(int nPriority)
+{
+    std::unique_lock<std::mutex> lock(m_LinkMutex);
+    auto bLinkFree = [&] {
+        int nPrio;
+        if(m_bLinkBusy)
+            return false;
+        for(nPrio = 0; nPrio < nPriority; nPrio++) {
+            if(m_nLinkWaiting[nPrio])
+                return false;
+        }
+        return true;
+    };
+    double dWaitMs;
+
+    m_nLinkWaiting[nPriority]++;
+    // a poll can be abandoned without harm, it's sent again or the next poll gets it
+    if(nPriority == PRIO_SAFETY && m_bLinkBusy && m_nLinkPriority == PRIO_POLL)
+        m_bLinkPreempt = true;
+
+    if(!bLinkFree()) {
+        CRigelTimer Wait;
+        m_LinkCond.wait(lock, bLinkFree);
+        dWaitMs = Wait.GetElapsedSeconds() * 1000.0;
+        m_nLinkWaits++;
+        m_dLinkWaitMs += dWaitMs;
+        m_dLinkWaitMaxMs = std::max(m_dLinkWaitMaxMs, dWaitMs);
+    }
+
+    m_nLinkWaiting[nPriority]--;
+    m_bLinkBusy = true;
+    m_nLinkPriority = nPriority;
+}
+
+void CRigelDome::releaseLink()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_LinkMutex);
+        m_bLinkBusy = false;
+        m_bLinkPreempt = false;
+    }
+    m_LinkCond.notify_all();
+}
+
+// only called by the link owner
+bool CRigelDome::isLinkPreempted()
+{
+    return m_nLinkPriority == PRIO_POLL && m_bLinkPreempt;
+}
+
+// how many m_DomeMutex locks this thread holds
+static thread_local int g_nStateLockDepth = 0;
+
+CRigelDome::CStateLock::CStateLock(CRigelDome *pDome, bool bRecordWait) : m_pDome(pDome)
+{
+    if(!bRecordWait) {
+        m_pDome->m_DomeMutex.lock();
+    }
+    else if(!m_pDome->m_DomeMutex.try_lock()) {
+        CRigelTimer Wait;
+        m_pDome->m_DomeMutex.lock();
+        m_pDome->recordStateWait(Wait.GetElapsedSeconds() * 1000.0);
+    }
+    g_nStateLockDepth++;
+}
+
+CRigelDome::CStateLock::~CStateLock()
+{
+    m_pDome->m_DomeMutex.unlock();
+    if(--g_nStateLockDepth == 0)
+        m_pDome->dispatchEvents();
+}
+
 
-int CRigelDome::readResponse(char *pszRespBuffer, int nBufferLen)
+int CRigelDome::readResponse(char *pszRespBuffer, int nBufferLen, int nReplyType, int nTimeoutMs)
 {
     int nErr = RD_OK;
-    unsigned long ulBytesRead = 0;
-    unsigned long ulTotalBytesRead = 0;
-    char *pszBufPtr;
+    int nStaleLines = 0;
+    int nTimeLeft;
+    CRigelTimer Deadline(m_pClock);
 
     memset(pszRespBuffer, 0, (size_t) nBufferLen);
-    pszBufPtr = pszRespBuffer;
 
-    do {
-        nErr = m_pSerx->readFile(pszBufPtr, 1, ulBytesRead, MAX_TIMEOUT);
-        if(nErr) {
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
-            ltime = time(NULL);
-            timestamp = asctime(localtime(&ltime));
-            timestamp[strlen(timestamp) - 1] = 0;
-            fprintf(Logfile, "[%s] [CRigelDome::readResponse] readFile error.\n", timestamp);
-            fflush(Logfile);
-#endif
-            return nErr;
+    while(true) {
+        // the reply might already be in the ring buffer from a previous read,
+        // otherwise pull what the port has and scan again.
+        while(!extractRxLine(pszRespBuffer, nBufferLen)) {
+            if(isLinkPreempted())
+                return RD_PREEMPTED;
+            nTimeLeft = nTimeoutMs - (int)(Deadline.GetElapsedSeconds() * 1000);
+            if(nTimeLeft <= 0)
+                return RD_TIMEOUT;
+            // a poll reads in short slices so it notices quickly when a safety command wants the link
+            if(m_nLinkPriority == PRIO_POLL && nTimeLeft > LINK_PREEMPT_SLICE)
+                nTimeLeft = LINK_PREEMPT_SLICE;
+            nErr = fillRxBuffer(nTimeLeft);
+            if(nErr == RD_TIMEOUT)
+                continue;
+            if(nErr)
+                return nErr;
         }
 
-        if (ulBytesRead !=1) {// timeout
+        if(isExpectedReply(pszRespBuffer, nReplyType))
+            return nErr;
+
+        // a late reply to an earlier command, skip it and keep reading
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
-            ltime = time(NULL);
-            timestamp = asctime(localtime(&ltime));
-            timestamp[strlen(timestamp) - 1] = 0;
-            fprintf(Logfile, "[%s] [CRigelDome::readResponse] readFile Timeout.\n", timestamp);
-            fflush(Logfile);
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::readResponse] dropping stale line : %s\n", timestamp, pszRespBuffer);
+        fflush(Logfile);
 #endif
-            nErr = RD_BAD_CMD_RESPONSE;
-            break;
-        }
-        ulTotalBytesRead += ulBytesRead;
-    } while (*pszBufPtr++ != 0x0D && ulTotalBytesRead < nBufferLen );
+        m_nStaleLines++;
+        if(++nStaleLines >= MAX_STALE_LINES)
+            return RD_BAD_CMD_RESPONSE;
+    }
+}
 
-    if(ulTotalBytesRead)
-        *(pszBufPtr-1) = 0; //remove the \r
+// Complete lines still in the ring buffer when we're about to send are replies nobody waited for.
+// Keep a partial line, the rest of it is still on its way and the framing check will drop it.
+void CRigelDome::dropStaleRxLines()
+{
+    unsigned int nIndex;
+    unsigned int nLastCR = m_nRxTail;
+    bool bFound = false;
+
+    for(nIndex = m_nRxTail; nIndex != m_nRxHead; nIndex++) {
+        if(m_cRxBuffer[nIndex & (RX_BUFFER_SIZE - 1)] == 0x0D) {
+            nLastCR = nIndex;
+            bFound = true;
+        }
+    }
+    if(!bFound)
+        return;
 
-    return nErr;
+    m_nStaleLines++;
+    m_nRxTail = nLastCR + 1;
 }
 
-
-int CRigelDome::domeCommand(const char *pszCmd, char *pszResult, int nResultMaxLen)
+int CRigelDome::fillRxBuffer(int nTimeoutMs)
 {
     int nErr = RD_OK;
-    char szResp[SERIAL_BUFFER_SIZE];
-    unsigned long  ulBytesWrite;
+    unsigned long ulBytesRead = 0;
+    unsigned long ulBytesToRead;
+    unsigned int nHeadIndex;
+    unsigned int nFree;
+    unsigned int nContiguous;
+
+    nFree = RX_BUFFER_SIZE - (m_nRxHead - m_nRxTail);
+    if(!nFree) {
+        // a full buffer without a terminator is garbage, drop it
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::fillRxBuffer] receive buffer overflow.\n", timestamp);
+        fflush(Logfile);
+#endif
+        clearRxBuffer();
+        return RD_BAD_CMD_RESPONSE;
+    }
 
-    m_pSerx->purgeTxRx();
+    nHeadIndex = m_nRxHead & (RX_BUFFER_SIZE - 1);
+    nContiguous = RX_BUFFER_SIZE - nHeadIndex;
 
+    // the transport returns whatever is there as soon as something is.
+    ulBytesToRead = nFree < nContiguous ? nFree : nContiguous;
+    nErr = m_pTransport->read(m_cRxBuffer + nHeadIndex, ulBytesToRead, ulBytesRead, nTimeoutMs);
+    if(nErr) {
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] [CRigelDome::domeCommand] Sending %s\n", timestamp, pszCmd);
-    fflush(Logfile);
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::fillRxBuffer] readFile error.\n", timestamp);
+        fflush(Logfile);
 #endif
-
-    nErr = m_pSerx->writeFile((void *)pszCmd, strlen(pszCmd), ulBytesWrite);
-    m_pSerx->flushTx();
-    if(nErr)
         return nErr;
+    }
 
-    // read response
-    nErr = readResponse(szResp, SERIAL_BUFFER_SIZE);
+    if (!ulBytesRead) {// timeout
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] [CRigelDome::domeCommand] response  code is %d with data : %s\n", timestamp, nErr, szResp);
-    fflush(Logfile);
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::fillRxBuffer] readFile Timeout.\n", timestamp);
+        fflush(Logfile);
 #endif
+        return RD_TIMEOUT;
+    }
 
-    if(nErr)
-        return nErr;
+    m_nRxHead += (unsigned int)ulBytesRead;
+    return nErr;
+}
 
-    if(pszResult)
-        strncpy(pszResult, szResp, nResultMaxLen);
+bool CRigelDome::extractRxLine(char *pszRespBuffer, int nBufferLen)
+{
+    unsigned int nIndex;
+    int nLen = 0;
+    char cByte;
 
-    return nErr;
+    for(nIndex = m_nRxTail; nIndex != m_nRxHead; nIndex++) {
+        if(m_cRxBuffer[nIndex & (RX_BUFFER_SIZE - 1)] == 0x0D)
+            break;
+    }
+    if(nIndex == m_nRxHead)
+        return false;
+
+    // copy the line without the \r, anything that doesn't fit is dropped.
+    while(m_nRxTail != nIndex) {
+        cByte = m_cRxBuffer[m_nRxTail & (RX_BUFFER_SIZE - 1)];
+        if(nLen < nBufferLen - 1)
+            pszRespBuffer[nLen++] = cByte;
+        m_nRxTail++;
+    }
+    pszRespBuffer[nLen] = 0;
+    m_nRxTail++; // skip the \r
 
+    return true;
 }
 
-int CRigelDome::getDomeAz(double &dDomeAz)
+void CRigelDome::clearRxBuffer()
 {
-    int nErr = RD_OK;
-    char szResp[SERIAL_BUFFER_SIZE];
-
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
+    m_nRxHead = 0;
+    m_nRxTail = 0;
+}
 
-    if(m_bCalibrating)
-        return nErr;
 
-    nErr = domeCommand("ANGLE\r", szResp, SERIAL_BUFFER_SIZE);
-    if(nErr)
-        return nErr;
-    
-    // convert Az string to double
-    dDomeAz = atof(szResp);
-    m_dCurrentAzPosition = dDomeAz;
+int CRigelDome::domeCommand(const char *pszCmd, char *pszResult, int nResultMaxLen)
+{
+    RigelCommand Cmd;
 
-	// Check Shutter state from time to time and if it changed, log the change.
-	if(m_cmdDelayCheckTimer.GetElapsedSeconds()>SHUTTER_CHECK_WAIT) {
-		m_cmdDelayCheckTimer.Reset();
-		nErr = getShutterState(m_nShutterState);
-		if(nErr)
-			return nErr;
-		if(m_nPreviousShutterState != m_nShutterState) {
-			m_nPreviousShutterState = m_nShutterState;
-			switch(m_nShutterState) {
-				case OPEN :
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-                    ltime = time(NULL);
-                    timestamp = asctime(localtime(&ltime));
-                    timestamp[strlen(timestamp) - 1] = 0;
-                    fprintf(Logfile, "[%s] [CRigelDome::getDomeAz] Shutter Opened\n", timestamp);
-                    fflush(Logfile);
-#endif
-					if(m_bDebugLog && m_pLogger) {
-						char szEventLogMsg[256];
-						ltime = time(NULL);
-						timestamp = asctime(localtime(&ltime));
-						timestamp[strlen(timestamp) - 1] = 0;
-						snprintf(szEventLogMsg, 256, "[%s] [CRigelDome::getDomeAz] Shutter Opened", timestamp);
-						m_pLogger->out(szEventLogMsg);
-					}
-					break;
-				case CLOSED :
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-                    ltime = time(NULL);
-                    timestamp = asctime(localtime(&ltime));
-                    timestamp[strlen(timestamp) - 1] = 0;
-                    fprintf(Logfile, "[%s] [CRigelDome::getDomeAz] Shutter Closed\n", timestamp);
-                    fflush(Logfile);
-#endif
-					if(m_bDebugLog && m_pLogger) {
-						char szEventLogMsg[256];
-						ltime = time(NULL);
-						timestamp = asctime(localtime(&ltime));
-						timestamp[strlen(timestamp) - 1] = 0;
-						snprintf(szEventLogMsg, 256, "[%s] [CRigelDome::getDomeAz] Shutter Closed", timestamp);
-						m_pLogger->out(szEventLogMsg);
-					}
-					break;
-				default:
-					break;
-			}
-		}
-	}
+    Cmd.pszCmd = pszCmd;
+    Cmd.pszResult = pszResult;
+    Cmd.nResultMaxLen = nResultMaxLen;
+    Cmd.nErr = RD_OK;
 
-    return nErr;
+    return domeCommandBatch(&Cmd, 1);
 }
 
-int CRigelDome::getDomeEl(double &dDomeEl)
+// Send several commands back to back and match the replies in order, the Rigel answers
+// each command in the order it got them. A batch costs about one link round trip instead of one per command.
+// Queries that lost their reply are sent again, commands are never repeated as we can't tell if the dome got them.
+int CRigelDome::domeCommandBatch(RigelCommand *pCmds, int nNbCmds)
 {
     int nErr = RD_OK;
-    int nShutterState;
+    char szScratch[MAX_BATCH_SIZE][SERIAL_BUFFER_SIZE];
+    bool bNoResult[MAX_BATCH_SIZE];
+    RigelCommand Retry[MAX_BATCH_SIZE];
+    int nRetryIndex[MAX_BATCH_SIZE];
+    int nNbRetry;
+    int nAttempt;
+    int nCmd;
+    CRigelTimer RetryBudget(m_pClock);
+
+    if(nNbCmds <= 0 || nNbCmds > MAX_BATCH_SIZE)
+        return ERR_CMDFAILED;
 
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
+    for(nCmd = 0; nCmd < nNbCmds; nCmd++) {
+        bNoResult[nCmd] = !pCmds[nCmd].pszResult;
+        if(bNoResult[nCmd]) {
+            pCmds[nCmd].pszResult = szScratch[nCmd];
+            pCmds[nCmd].nResultMaxLen = SERIAL_BUFFER_SIZE;
+        }
+    }
 
-    getShutterState(nShutterState);
+    nErr = sendBatch(pCmds, nNbCmds, false);
 
-    if(!m_bShutterOpened || !m_bHasShutter)
-    {
-        dDomeEl = 0.0;
+    for(nAttempt = 0; nAttempt < MAX_QUERY_RETRIES; nAttempt++) {
+        // a write error or a reply we didn't like won't get better by asking again
+        if(nErr != RD_TIMEOUT && nErr != RD_PREEMPTED)
+            break;
+        if(RetryBudget.GetElapsedSeconds() * 1000.0 >= QUERY_RETRY_BUDGET)
+            break;
+
+        nNbRetry = 0;
+        for(nCmd = 0; nCmd < nNbCmds; nCmd++) {
+            if(!pCmds[nCmd].nErr)
+                continue;
+            if(findQuery(pCmds[nCmd].pszCmd) < 0)
+                break;
+            Retry[nNbRetry] = pCmds[nCmd];
+            nRetryIndex[nNbRetry++] = nCmd;
+        }
+        if(nCmd < nNbCmds || !nNbRetry)
+            break;
+
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::domeCommandBatch] no reply to %d queries, sending them again, starting with %s\n", timestamp, nNbRetry, Retry[0].pszCmd);
+        fflush(Logfile);
+#endif
+        m_nRetries++;
+        nErr = sendBatch(Retry, nNbRetry, true);
+        for(nCmd = 0; nCmd < nNbRetry; nCmd++)
+            pCmds[nRetryIndex[nCmd]].nErr = Retry[nCmd].nErr;
+        if(!nErr)
+            m_nRetriesOk++;
     }
-    else {
-        dDomeEl = 90.0;
+
+    for(nCmd = 0; nCmd < nNbCmds; nCmd++) {
+        if(bNoResult[nCmd])
+            pCmds[nCmd].pszResult = NULL;
     }
 
-    m_dCurrentElPosition = dDomeEl;
-    
     return nErr;
 }
 
-
-int CRigelDome::getDomeHomeAz(double &dAz)
+// one attempt at a batch, bRetry means the replies can't be used as RTT samples as they might be for an earlier attempt.
+int CRigelDome::sendBatch(RigelCommand *pCmds, int nNbCmds, bool bRetry)
 {
     int nErr = RD_OK;
-    char szResp[SERIAL_BUFFER_SIZE];
+    char szBatch[BATCH_BUFFER_SIZE];
+    bool bSent[MAX_BATCH_SIZE];
+    size_t nBatchLen = 0;
+    size_t nCmdLen;
+    int nCmd;
+    int nQuery;
+    int nPriority = PRIO_POLL;
+
+    // the batch is as urgent as its most urgent command
+    for(nCmd = 0; nCmd < nNbCmds; nCmd++) {
+        if(findPriority(pCmds[nCmd].pszCmd) < nPriority)
+            nPriority = findPriority(pCmds[nCmd].pszCmd);
+    }
 
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
+    // callers asking the same query while one is in flight wait here, then get its reply from the cache
+    CLinkLock link(this, nPriority);
 
-    if(m_bCalibrating)
-        return nErr;
+    // abortCurrentCommand came after this command was submitted, its STOP stays the last thing sent
+    if(nPriority != PRIO_SAFETY && isCommandAborted())
+        return RD_ABORTED;
 
-    nErr = domeCommand("HOME\r", szResp, SERIAL_BUFFER_SIZE);
-    if(nErr)
-        return nErr;
+    for(nCmd = 0; nCmd < nNbCmds; nCmd++) {
+        RigelCommand &Cmd = pCmds[nCmd];
 
-    // convert Az string to double
-    dAz = atof(szResp);
-    m_dHomeAz = dAz;
+        Cmd.nErr = RD_OK;
+        bSent[nCmd] = false;
 
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-    ltime = time(NULL);
-    timestamp = asctime(localtime(&ltime));
-    timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] [CRigelDome::getDomeHomeAz] Home Az = %3.1f\n", timestamp,m_dHomeAz);
-    fflush(Logfile);
+        nQuery = findQuery(Cmd.pszCmd);
+        if(nQuery < 0) {
+            // this might change what any query after it returns
+            clearQueryCache();
+        }
+        else if(m_QueryCache[nQuery].bValid && (getTimeStamp() - m_QueryCache[nQuery].dTimeStamp) <= m_dCoalesceWindow) {
+            strncpy(Cmd.pszResult, m_QueryCache[nQuery].szReply, (size_t)Cmd.nResultMaxLen);
+            Cmd.pszResult[Cmd.nResultMaxLen - 1] = 0;
+            m_nCoalesced++;
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
+            ltime = time(NULL);
+            timestamp = asctime(localtime(&ltime));
+            timestamp[strlen(timestamp) - 1] = 0;
+            fprintf(Logfile, "[%s] [CRigelDome::sendBatch] %s coalesced, data : %s\n", timestamp, Cmd.pszCmd, Cmd.pszResult);
+            fflush(Logfile);
 #endif
+            continue;
+        }
 
-    return nErr;
+        nCmdLen = strlen(Cmd.pszCmd);
+        if(nBatchLen + nCmdLen > BATCH_BUFFER_SIZE)
+            return ERR_CMDFAILED;
+        memcpy(szBatch + nBatchLen, Cmd.pszCmd, nCmdLen);
+        nBatchLen += nCmdLen;
+        bSent[nCmd] = true;
+    }
+
+    // everything came from the cache
+    if(!nBatchLen)
+        return nErr;
+
+    if(m_bIoRunning)
+        return runOnIoThread(pCmds, nNbCmds, bSent, szBatch, nBatchLen, bRetry);
+    return exchangeBatch(pCmds, nNbCmds, bSent, szBatch, nBatchLen, bRetry);
 }
 
-int CRigelDome::getDomeParkAz(double &dAz)
+// write a batch and read the replies to the commands that were sent.
+// Runs on the link owner's thread, or on the I/O thread on its behalf.
+int CRigelDome::exchangeBatch(RigelCommand *pCmds, int nNbCmds, const bool *pbSent, const char *pszBatch, size_t nBatchLen, bool bRetry)
 {
     int nErr = RD_OK;
-    char szResp[SERIAL_BUFFER_SIZE];
-
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
-
-    if(m_bCalibrating)
-        return nErr;
-
-    nErr = domeCommand("PARK\r", szResp, SERIAL_BUFFER_SIZE);
-    if(nErr)
-        return nErr;
+    int nCmd;
+    int nQuery;
+    int nTimingClass;
+    bool bFirstReply = !bRetry;
+    CRigelTimer ReplyTimer(m_pClock);
+
+    // only throw away what the port has if we lost track of the replies, otherwise the framing check deals with late lines.
+    if(m_bLinkResync) {
+        m_pTransport->purge();
+        clearRxBuffer();
+        m_bLinkResync = false;
+        m_nResyncs++;
+    }
+    else
+        dropStaleRxLines();
 
-    // convert Az string to double
-    dAz = atof(szResp);
-    m_dParkAz = dAz;
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
     ltime = time(NULL);
     timestamp = asctime(localtime(&ltime));
     timestamp[strlen(timestamp) - 1] = 0;
-    fprintf(Logfile, "[%s] [CRigelDome::getDomeParkAz] Park Az = %3.1f\n", timestamp,m_dHomeAz);
+    fprintf(Logfile, "[%s] [CRigelDome::exchangeBatch] Sending %.*s\n", timestamp, (int)nBatchLen, pszBatch);
     fflush(Logfile);
 #endif
-    return nErr;
-}
-
-
-int CRigelDome::getShutterState(int &nState)
-{
-    int nErr = RD_OK;
-    char szResp[SERIAL_BUFFER_SIZE];
-	bool bShutterConnected;
-
-    if(!m_bIsConnected)
-        return NOT_CONNECTED;
 
-    if(m_bCalibrating)
+    ReplyTimer.Reset();
+    nErr = m_pTransport->write(pszBatch, (unsigned long)nBatchLen);
+    if(nErr) {
+        m_bLinkResync = true;
         return nErr;
+    }
+    m_nRoundTrips++;
 
-    nErr = isConnectedToShutter(bShutterConnected);
-    if(nErr)
-        return nErr;
+    // read responses, in the order the commands were sent
+    for(nCmd = 0; nCmd < nNbCmds; nCmd++) {
+        RigelCommand &Cmd = pCmds[nCmd];
 
-    if(!bShutterConnected)
-        return NOT_CONNECTED;
+        if(!pbSent[nCmd])
+            continue;
 
-    nErr = domeCommand("SHUTTER\r", szResp, SERIAL_BUFFER_SIZE);
+        // once a reply is missing we can't tell which command the next line belongs to
+        if(nErr) {
+            Cmd.nErr = nErr;
+            continue;
+        }
+
+        // each reply gets the full timeout of its class from the time the previous one came in
+        nTimingClass = findTimingClass(Cmd.pszCmd);
+        nErr = readResponse(Cmd.pszResult, Cmd.nResultMaxLen, findReplyType(Cmd.pszCmd), m_Rtt[nTimingClass].nTimeout);
+        Cmd.nErr = nErr;
+        if(nErr == RD_TIMEOUT)
+            addRttTimeout(nTimingClass);
+        else if(nErr == RD_PREEMPTED)
+            m_nPreempted++;
+        else if(!nErr && bFirstReply) {
+            // later replies in a batch queue behind the first one and would skew the estimate
+            addRttSample(nTimingClass, ReplyTimer.GetElapsedSeconds() * 1000.0);
+        }
+        bFirstReply = false;
+        if(nErr)
+            m_bLinkResync = true;
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 3
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::exchangeBatch] %s response code is %d with data : %s\n", timestamp, Cmd.pszCmd, nErr, Cmd.pszResult);
+        fflush(Logfile);
+#endif
+        nQuery = findQuery(Cmd.pszCmd);
+        if(!nErr && nQuery >= 0) {
+            strncpy(m_QueryCache[nQuery].szReply, Cmd.pszResult, V_RESPONSE_SIZE);
+            m_QueryCache[nQuery].szReply[V_RESPONSE_SIZE - 1] = 0;
+            m_QueryCache[nQuery].dTimeStamp = getTimeStamp();
+            m_QueryCache[nQuery].bValid = m_dCoalesceWindow > 0;
+        }
+    }
+
+    return nErr;
+}
+
+void CRigelDome::clearQueryCache()
+{
+    int nQuery;
+
+    for(nQuery = 0; nQuery < NB_QUERIES; nQuery++)
+        m_QueryCache[nQuery].bValid = false;
+}
+
+void CRigelDome::setCoalesceWindow(int nWindowMs)
+{
+    CLinkLock link(this, PRIO_CONFIG);
+
+    // 0 turns coalescing off
+    m_dCoalesceWindow = (nWindowMs > 0 ? nWindowMs : 0) / 1000.0;
+    clearQueryCache();
+}
+
+int CRigelDome::setTransport(int nTransport)
+{
+    if(m_bIsConnected)
+        return ERR_CMDFAILED;
+
+    switch(nTransport) {
+        case TRANSPORT_SERX:
+            m_pTransport = &m_SerXTransport;
+            break;
+#ifdef SB_LINUX_BUILD
+        case TRANSPORT_NATIVE_SERIAL:
+            m_pTransport = &m_PosixSerialTransport;
+            break;
+#endif
+#if defined(SB_LINUX_BUILD) || defined(SB_MAC_BUILD)
+        case TRANSPORT_TCP:
+            m_pTransport = &m_TcpTransport;
+            break;
+#endif
+        default:
+            return ERR_CMDFAILED;
+    }
+    m_nTransport = nTransport;
+    return SB_OK;
+}
+
+// transport provided by the caller, a simulation for instance
+int CRigelDome::setTransport(CRigelTransport *pTransport)
+{
+    if(m_bIsConnected || !pTransport)
+        return ERR_CMDFAILED;
+
+    m_pTransport = pTransport;
+    m_nTransport = TRANSPORT_EXTERNAL;
+    return SB_OK;
+}
+
+int CRigelDome::setClock(CRigelClock *pClock)
+{
+    if(m_bIsConnected || !pClock)
+        return ERR_CMDFAILED;
+
+    m_pClock = pClock;
+    m_cmdDelayCheckTimer.setClock(pClock);
+    m_BondCheckTimer.setClock(pClock);
+    m_StatusClock.setClock(pClock);
+    return SB_OK;
+}
+
+int CRigelDome::setIoThread(bool bEnable, int nPriority, int nCpu)
+{
+    if(m_bIsConnected)
+        return ERR_CMDFAILED;
+
+    m_bIoEnabled = bEnable;
+    m_nIoPriority = nPriority;
+    m_nIoCpu = nCpu;
+    return SB_OK;
+}
+
+void CRigelDome::resetRttStats()
+{
+    int nClass;
+
+    // no measurement yet, use the conservative timeout until we have one
+    for(nClass = 0; nClass < NB_TIMING_CLASSES; nClass++) {
+        memset(&m_Rtt[nClass], 0, sizeof(RttStats));
+        m_Rtt[nClass].nTimeout = MAX_TIMEOUT;
+    }
+}
+
+void CRigelDome::addRttSample(int nTimingClass, double dRttMs)
+{
+    RttStats &Rtt = m_Rtt[nTimingClass];
+
+    if(!Rtt.nSamples) {
+        Rtt.dSrtt = dRttMs;
+        Rtt.dRttVar = dRttMs / 2.0;
+    }
+    else {
+        Rtt.dRttVar = 0.75 * Rtt.dRttVar + 0.25 * fabs(Rtt.dSrtt - dRttMs);
+        Rtt.dSrtt = 0.875 * Rtt.dSrtt + 0.125 * dRttMs;
+    }
+    Rtt.nSamples++;
+    Rtt.nBackoff = 0;
+    updateReplyTimeout(nTimingClass);
+}
+
+void CRigelDome::addRttTimeout(int nTimingClass)
+{
+    RttStats &Rtt = m_Rtt[nTimingClass];
+
+    Rtt.nTimeouts++;
+    if(Rtt.nBackoff < 16)
+        Rtt.nBackoff++;
+    updateReplyTimeout(nTimingClass);
+}
+
+void CRigelDome::updateReplyTimeout(int nTimingClass)
+{
+    RttStats &Rtt = m_Rtt[nTimingClass];
+    double dTimeout;
+
+    if(!Rtt.nSamples) {
+        Rtt.nTimeout = MAX_TIMEOUT;
+        return;
+    }
+
+    dTimeout = Rtt.dSrtt + 4.0 * Rtt.dRttVar;
+    if(dTimeout < MIN_TIMEOUT)
+        dTimeout = MIN_TIMEOUT;
+    dTimeout *= (double)(1 << Rtt.nBackoff);
+    if(dTimeout > MAX_TIMEOUT)
+        dTimeout = MAX_TIMEOUT;
+    Rtt.nTimeout = (int)ceil(dTimeout);
+}
+
+void CRigelDome::getRttStats(int nTimingClass, RttStats &Stats)
+{
+    CLinkLock link(this, PRIO_CONFIG);
+
+    if(nTimingClass < 0 || nTimingClass >= NB_TIMING_CLASSES) {
+        memset(&Stats, 0, sizeof(RttStats));
+        return;
+    }
+    Stats = m_Rtt[nTimingClass];
+}
+
+void CRigelDome::getLinkStats(LinkStats &Stats)
+{
+    Stats.nRoundTrips = m_nRoundTrips;
+    Stats.nCoalesced = m_nCoalesced;
+    Stats.nStaleLines = m_nStaleLines;
+    Stats.nResyncs = m_nResyncs;
+    Stats.nRetries = m_nRetries;
+    Stats.nRetriesOk = m_nRetriesOk;
+    Stats.nPreempted = m_nPreempted;
+    Stats.nSnapshotReads = m_nSnapshotReads;
+    Stats.nStateWaits = m_nStateWaits;
+    Stats.dStateWaitMs = m_dStateWaitMs;
+    Stats.dStateWaitMaxMs = m_dStateWaitMaxMs;
+
+    std::lock_guard<std::mutex> lock(m_LinkMutex);
+    Stats.nLinkWaits = m_nLinkWaits;
+    Stats.dLinkWaitMs = m_dLinkWaitMs;
+    Stats.dLinkWaitMaxMs = m_dLinkWaitMaxMs;
+}
+
+void CRigelDome::resetLockStats()
+{
+    m_nSnapshotReads = 0;
+    m_nStateWaits = 0;
+    m_dStateWaitMs = 0;
+    m_dStateWaitMaxMs = 0;
+
+    std::lock_guard<std::mutex> lock(m_LinkMutex);
+    m_nLinkWaits = 0;
+    m_dLinkWaitMs = 0;
+    m_dLinkWaitMaxMs = 0;
+}
+
+int CRigelDome::getDomeAz(double &dDomeAz)
+{
+    int nErr = RD_OK;
+    char szResp[SERIAL_BUFFER_SIZE];
+
+    if(!m_bIsConnected)
+        return NOT_CONNECTED;
+
+    if(m_bCalibrating)
+        return nErr;
+
+    nErr = domeCommand("ANGLE\r", szResp, SERIAL_BUFFER_SIZE);
+    if(nErr)
+        return nErr;
+    
+    // convert Az string to double
+    dDomeAz = atof(szResp);
+    m_dCurrentAzPosition = dDomeAz;
+
+    return nErr;
+}
+
+int CRigelDome::getDomeHomeAz(double &dAz)
+{
+    int nErr = RD_OK;
+    char szResp[SERIAL_BUFFER_SIZE];
+
+    if(!m_bIsConnected)
+        return NOT_CONNECTED;
+
+    if(m_bCalibrating)
+        return nErr;
+
+    nErr = domeCommand("HOME\r", szResp, SERIAL_BUFFER_SIZE);
+    if(nErr)
+        return nErr;
+
+    // convert Az string to double
+    dAz = atof(szResp);
+    m_dHomeAz = dAz;
+
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+    ltime = time(NULL);
+    timestamp = asctime(localtime(&ltime));
+    timestamp[strlen(timestamp) - 1] = 0;
+    fprintf(Logfile, "[%s] [CRigelDome::getDomeHomeAz] Home Az = %3.1f\n", timestamp, dAz);
+    fflush(Logfile);
+#endif
+
+    return nErr;
+}
+
+int CRigelDome::getDomeParkAz(double &dAz)
+{
+    int nErr = RD_OK;
+    char szResp[SERIAL_BUFFER_SIZE];
+
+    if(!m_bIsConnected)
+        return NOT_CONNECTED;
+
+    if(m_bCalibrating)
+        return nErr;
+
+    nErr = domeCommand("PARK\r", szResp, SERIAL_BUFFER_SIZE);
+    if(nErr)
+        return nErr;
+
+    // convert Az string to double
+    dAz = atof(szResp);
+    m_dParkAz = dAz;
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+    ltime = time(NULL);
+    timestamp = asctime(localtime(&ltime));
+    timestamp[strlen(timestamp) - 1] = 0;
+    fprintf(Logfile, "[%s] [CRigelDome::getDomeParkAz] Park Az = %3.1f\n", timestamp, dAz);
+    fflush(Logfile);
+#endif
+    return nErr;
+}
+
+
+int CRigelDome::getShutterState(int &nState)
+{
+    int nErr = RD_OK;
+    char szResp[SERIAL_BUFFER_SIZE];
+	bool bShutterConnected;
+
+    if(!m_bIsConnected)
+        return NOT_CONNECTED;
+
+    if(m_bCalibrating)
+        return nErr;
+
+    nErr = getShutterBond(bShutterConnected);
     if(nErr)
         return nErr;
 
-	nState = atoi(szResp);
+    if(!bShutterConnected)
+        return NOT_CONNECTED;
+
+    nErr = domeCommand("SHUTTER\r", szResp, SERIAL_BUFFER_SIZE);
+    if(nErr) {
+        // might be the BT link, check the bond on the next read
+        invalidateShutterBond();
+        return nErr;
+    }
+
+    parseShutterState(szResp, nState);
+    return nErr;
+}
+
+void CRigelDome::parseShutterState(const char *pszResp, int &nState)
+{
+	nState = atoi(pszResp);
     m_bHasShutter = true;
 
     switch(nState) {
@@ -469,8 +1200,6 @@ int CRigelDome::getShutterState(int &nState)
         default:
             m_bShutterOpened = false;
     }
-
-    return nErr;
 }
 
 
@@ -491,11 +1220,12 @@ int CRigelDome::getDomeStepPerRev(int &nStepPerRev)
     return nErr;
 }
 
-int CRigelDome::getBatteryLevels(double &dShutterVolts, int &nPercent)
+int CRigelDome::doGetBatteryLevels(double &dShutterVolts, int &nPercent)
 {
     int nErr = RD_OK;
     int rc = 0;
     char szResp[SERIAL_BUFFER_SIZE];
+    ObservedState Observed;
     
     if(!m_bIsConnected)
         return NOT_CONNECTED;
@@ -513,6 +1243,15 @@ int CRigelDome::getBatteryLevels(double &dShutterVolts, int &nPercent)
     }
 
     dShutterVolts = dShutterVolts / 1000.0;
+    m_dShutterBatteryVolts = dShutterVolts;
+    m_dShutterBatteryPercent = nPercent;
+
+    Observed.dBatteryVolts = dShutterVolts;
+    Observed.nBatteryPercent = nPercent;
+    {
+        CStateLock lock(this);
+        observeState(EVENT_BATTERY, Observed);
+    }
     return nErr;
 }
 
@@ -559,9 +1298,8 @@ void CRigelDome::logString(const char *message)
 }
 
 
-int CRigelDome::isDomeMoving(bool &bIsMoving)
+int CRigelDome::getMotorState(int &nState)
 {
-    int tmp;
     int nErr = RD_OK;
     char szResp[SERIAL_BUFFER_SIZE];
 
@@ -572,10 +1310,28 @@ int CRigelDome::isDomeMoving(bool &bIsMoving)
     if(nErr)
         return nErr;
 
-    bIsMoving = false;
-    tmp = atoi(szResp);
-    if(tmp != 0 && tmp != 3)
-        bIsMoving = true;
+    nState = atoi(szResp);
+    return nErr;
+}
+
+static bool isMotorMoving(int nMotorState)
+{
+    return nMotorState != IDLE && nMotorState != MOVING_AT_SIDEREAL;
+}
+
+int CRigelDome::isDomeMoving(bool &bIsMoving)
+{
+    int nErr = RD_OK;
+    DomeStatus Status;
+
+    if(!m_bIsConnected)
+        return NOT_CONNECTED;
+
+    nErr = getStatus(Status);
+    if(nErr)
+        return nErr;
+
+    bIsMoving = isMotorMoving(Status.nMotorState);
 
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
     ltime = time(NULL);
@@ -628,6 +1384,7 @@ int CRigelDome::connectToShutter()
         return NOT_CONNECTED;
 
     nErr = domeCommand("BBOND 1\r", resp, SERIAL_BUFFER_SIZE);
+    invalidateShutterBond();
     return nErr;
 }
 
@@ -649,10 +1406,52 @@ int CRigelDome::isConnectedToShutter(bool &bConnected)
     if(tmp)
         bConnected = true;
 
+    setShutterBond(bConnected);
     return nErr;
 }
 
-int CRigelDome::btForce()
+// cached version of isConnectedToShutter, the bond doesn't change on its own very often
+int CRigelDome::getShutterBond(bool &bConnected)
+{
+    CStateLock lock(this);
+
+    if(isShutterBondFresh()) {
+        bConnected = true;
+        return RD_OK;
+    }
+
+    return isConnectedToShutter(bConnected);
+}
+
+bool CRigelDome::isShutterBondFresh()
+{
+    CStateLock lock(this);
+
+    // an unbonded shutter is checked on every read so we see it come back
+    return m_bShutterBondValid && m_bShutterBonded && m_BondCheckTimer.GetElapsedSeconds() < BOND_CHECK_WAIT;
+}
+
+void CRigelDome::invalidateShutterBond()
+{
+    CStateLock lock(this);
+    m_bShutterBondValid = false;
+}
+
+void CRigelDome::setShutterBond(bool bConnected)
+{
+    ObservedState Observed;
+
+    CStateLock lock(this);
+
+    m_bShutterBonded = bConnected;
+    m_bShutterBondValid = true;
+    m_BondCheckTimer.Reset();
+
+    Observed.nBond = bConnected ? 1 : 0;
+    observeState(EVENT_BOND, Observed);
+}
+
+int CRigelDome::doBtForce()
 {
     int nErr = RD_OK;
     char resp[SERIAL_BUFFER_SIZE];
@@ -661,10 +1460,11 @@ int CRigelDome::btForce()
         return NOT_CONNECTED;
 
     nErr = domeCommand("BTFORCE\r", resp, SERIAL_BUFFER_SIZE);
+    invalidateShutterBond();
     return nErr;
 }
 
-int CRigelDome::syncDome(double dAz, double dEl)
+int CRigelDome::doSyncDome(double dAz, double dEl)
 {
     int nErr = RD_OK;
     char szBuf[SERIAL_BUFFER_SIZE];
@@ -676,6 +1476,7 @@ int CRigelDome::syncDome(double dAz, double dEl)
     m_dCurrentAzPosition = dAz;
     snprintf(szBuf, SERIAL_BUFFER_SIZE, "ANGLE K %3.1f\r", dAz);
     nErr = domeCommand(szBuf, szResp, SERIAL_BUFFER_SIZE);
+    invalidateState();
     if(nErr)
         return nErr;
     if(strncmp(szResp,"A",1) == 0) {
@@ -687,7 +1488,7 @@ int CRigelDome::syncDome(double dAz, double dEl)
     return nErr;
 }
 
-int CRigelDome::parkDome()
+int CRigelDome::doParkDome()
 {
     int nErr = RD_OK;
     char szResp[SERIAL_BUFFER_SIZE];
@@ -699,6 +1500,7 @@ int CRigelDome::parkDome()
         return SB_OK;
 
     nErr = domeCommand("GO P\r", szResp, SERIAL_BUFFER_SIZE);
+    invalidateState();
     if(nErr)
         return nErr;
 
@@ -711,15 +1513,15 @@ int CRigelDome::parkDome()
     return nErr;
 }
 
-int CRigelDome::unparkDome()
+int CRigelDome::doUnparkDome()
 {
     m_bParked = false;
-    m_dCurrentAzPosition = m_dParkAz;
-    syncDome(m_dCurrentAzPosition,m_dCurrentElPosition);
+    m_dCurrentAzPosition = m_dParkAz.load();
+    doSyncDome(m_dCurrentAzPosition,m_dCurrentElPosition);
     return 0;
 }
 
-int CRigelDome::gotoAzimuth(double dNewAz)
+int CRigelDome::doGotoAzimuth(double dNewAz)
 {
 
     int nErr = RD_OK;
@@ -739,6 +1541,7 @@ int CRigelDome::gotoAzimuth(double dNewAz)
 
     snprintf(szBuf, SERIAL_BUFFER_SIZE, "GO %3.1f\r", dNewAz);
     nErr = domeCommand(szBuf, szResp, SERIAL_BUFFER_SIZE);
+    invalidateState();
     if(nErr)
         return nErr;
 
@@ -754,7 +1557,7 @@ int CRigelDome::gotoAzimuth(double dNewAz)
     return nErr;
 }
 
-int CRigelDome::openShutter()
+int CRigelDome::doOpenShutter()
 {
     int nErr = RD_OK;
     char szResp[SERIAL_BUFFER_SIZE];
@@ -783,6 +1586,7 @@ int CRigelDome::openShutter()
     }
     
     nErr = domeCommand("OPEN\r", szResp, SERIAL_BUFFER_SIZE);
+    invalidateState(true);
     if(nErr)
         return nErr;
 
@@ -795,7 +1599,7 @@ int CRigelDome::openShutter()
     return nErr;
 }
 
-int CRigelDome::closeShutter()
+int CRigelDome::doCloseShutter()
 {
     int nErr = RD_OK;
     char szResp[SERIAL_BUFFER_SIZE];
@@ -824,6 +1628,7 @@ int CRigelDome::closeShutter()
     }
 
     nErr = domeCommand("CLOSE\r", szResp, SERIAL_BUFFER_SIZE);
+    invalidateState(true);
     if(nErr)
         return nErr;
 
@@ -876,7 +1681,7 @@ int CRigelDome::getModel(char *pszModel, int nStrMaxLen)
     return nErr;
 }
 
-int CRigelDome::goHome()
+int CRigelDome::doGoHome()
 {
     int nErr = RD_OK;
     char szResp[SERIAL_BUFFER_SIZE];
@@ -897,6 +1702,7 @@ int CRigelDome::goHome()
 
     
     nErr = domeCommand("GO H\r", szResp, SERIAL_BUFFER_SIZE);
+    invalidateState();
     if(nErr)
         return nErr;
 
@@ -909,7 +1715,7 @@ int CRigelDome::goHome()
     return nErr;
 }
 
-int CRigelDome::calibrate()
+int CRigelDome::doCalibrate()
 {
     int nErr = RD_OK;
     char resp[SERIAL_BUFFER_SIZE];
@@ -921,6 +1727,7 @@ int CRigelDome::calibrate()
         return SB_OK;
 
     nErr = domeCommand("CALIBRATE\r", resp, SERIAL_BUFFER_SIZE);
+    invalidateState();
     if(nErr)
         return nErr;
 
@@ -950,16 +1757,19 @@ int CRigelDome::isGoToComplete(bool &bComplete)
     int nErr = 0;
     double dDomeAz = 0;
     bool bIsMoving = false;
+    DomeStatus Status;
 
     if(!m_bIsConnected)
         return NOT_CONNECTED;
 
-    nErr = isDomeMoving(bIsMoving);
+    // motor state and az come from the same snapshot
+    nErr = getStatus(Status);
     if(nErr) {
         return nErr;
         }
 
-    getDomeAz(dDomeAz);
+    bIsMoving = isMotorMoving(Status.nMotorState);
+    dDomeAz = Status.dAz;
 
     if(bIsMoving) {
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
@@ -1010,42 +1820,24 @@ int CRigelDome::isGoToComplete(bool &bComplete)
 int CRigelDome::isOpenComplete(bool &bComplete)
 {
     int nErr = 0;
+    DomeStatus Status;
 
     if(!m_bIsConnected)
         return NOT_CONNECTED;
 
-    nErr = getShutterState(m_nShutterState);
+    nErr = getStatus(Status);
+    if(nErr == RD_STATUS_PENDING)
+        return nErr;
+    if(!nErr)
+        nErr = Status.nShutterErr;
     if(nErr)
         return ERR_CMDFAILED;
 
-    if(m_nShutterState == OPEN){
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-        ltime = time(NULL);
-        timestamp = asctime(localtime(&ltime));
-        timestamp[strlen(timestamp) - 1] = 0;
-        fprintf(Logfile, "[%s] [CRigelDome::isOpenComplete] Shutter Opened\n", timestamp);
-        fflush(Logfile);
-#endif
-        m_bShutterOpened = true;
+    if(Status.nShutterState == OPEN){
         bComplete = true;
-        m_dCurrentElPosition = 90.0;
-
-        if(m_bDebugLog && m_pLogger) {
-			if(m_nPreviousShutterState != m_nShutterState) {
-				m_nPreviousShutterState = m_nShutterState;
-				char szEventLogMsg[256];
-				ltime = time(NULL);
-				timestamp = asctime(localtime(&ltime));
-				timestamp[strlen(timestamp) - 1] = 0;
-				snprintf(szEventLogMsg, 256, "[%s] Shutter Opened", timestamp);
-				m_pLogger->out(szEventLogMsg);
-			}
-        }
     }
     else {
-        m_bShutterOpened = false;
         bComplete = false;
-        m_dCurrentElPosition = 0.0;
     }
 
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
@@ -1062,41 +1854,24 @@ int CRigelDome::isOpenComplete(bool &bComplete)
 int CRigelDome::isCloseComplete(bool &bComplete)
 {
     int err=0;
+    DomeStatus Status;
 
 	if(!m_bIsConnected)
         return NOT_CONNECTED;
 
-    err = getShutterState(m_nShutterState);
+    err = getStatus(Status);
+    if(err == RD_STATUS_PENDING)
+        return err;
+    if(!err)
+        err = Status.nShutterErr;
     if(err)
         return ERR_CMDFAILED;
 
-    if(m_nShutterState == CLOSED){
-#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
-        ltime = time(NULL);
-        timestamp = asctime(localtime(&ltime));
-        timestamp[strlen(timestamp) - 1] = 0;
-        fprintf(Logfile, "[%s] [CRigelDome::isCloseComplete] Shutter Closed\n", timestamp);
-        fflush(Logfile);
-#endif
-        m_bShutterOpened = false;
+    if(Status.nShutterState == CLOSED){
         bComplete = true;
-        m_dCurrentElPosition = 0.0;
-        if(m_bDebugLog && m_pLogger) {
-			if(m_nPreviousShutterState != m_nShutterState) {
-				m_nPreviousShutterState = m_nShutterState;
-				char szEventLogMsg[256];
-				ltime = time(NULL);
-				timestamp = asctime(localtime(&ltime));
-				timestamp[strlen(timestamp) - 1] = 0;
-				snprintf(szEventLogMsg, 256, "[%s] Shutter Closed", timestamp);
-				m_pLogger->out(szEventLogMsg);
-			}
-        }
     }
     else {
-        m_bShutterOpened = true;
         bComplete = false;
-        m_dCurrentElPosition = 90.0;
     }
 
 #if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
@@ -1116,21 +1891,23 @@ int CRigelDome::isParkComplete(bool &bComplete)
     int nErr = 0;
     double dDomeAz=0;
     bool bIsMoving = false;
+    DomeStatus Status;
 
     if(!m_bIsConnected)
         return NOT_CONNECTED;
 
-    getDomeAz(dDomeAz);
-    nErr = isDomeMoving(bIsMoving);
+    nErr = getStatus(Status);
     if(nErr)
         return nErr;
+    bIsMoving = isMotorMoving(Status.nMotorState);
+    dDomeAz = Status.dAz;
 
     if(bIsMoving) {
         bComplete = false;
         return nErr;
     }
 
-    if ((floor(m_dParkAz) <= floor(dDomeAz)+1) && (floor(m_dGotoAz) >= floor(dDomeAz)-1)) {
+    if ((floor(m_dParkAz) <= floor(dDomeAz)+1) && (floor(m_dParkAz) >= floor(dDomeAz)-1)) {
         m_bParked = true;
         bComplete = true;
     }
@@ -1220,6 +1997,7 @@ int CRigelDome::isFindHomeComplete(bool &bComplete)
 int CRigelDome::isCalibratingComplete(bool &bComplete)
 {
     int nErr = 0;
+    DomeStatus Status;
 
     bComplete = false;
 
@@ -1227,14 +2005,14 @@ int CRigelDome::isCalibratingComplete(bool &bComplete)
         return NOT_CONNECTED;
 
     // new version of the test
-    nErr = getExtendedState();
+    nErr = getStatus(Status);
     if(nErr)
         return nErr;
 
-    if(m_nMotorState == CALIBRATIG) {
+    if(Status.nMotorState == CALIBRATIG) {
         bComplete = false;
     }
-    else if (m_nMotorState == IDLE){
+    else if (Status.nMotorState == IDLE){
         bComplete = true;
     }
     else {
@@ -1254,16 +2032,187 @@ int CRigelDome::isCalibratingComplete(bool &bComplete)
 }
 
 
-int CRigelDome::abortCurrentCommand()
+int CRigelDome::doAbortCurrentCommand()
 {
     if(!m_bIsConnected)
         return NOT_CONNECTED;
 
     m_bCalibrating = false;
+    invalidateState(true);
 
     return (domeCommand("STOP\r", NULL, SERIAL_BUFFER_SIZE));
 }
 
+#pragma mark - async commands
+
+// the synchronous calls wait on their own async version, run inline when nothing is queued
+int CRigelDome::syncDome(double dAz, double dEl)
+{
+    return syncDomeAsync(dAz, dEl, LAUNCH_INLINE).get();
+}
+
+int CRigelDome::parkDome()
+{
+    return parkDomeAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::unparkDome()
+{
+    return unparkDomeAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::gotoAzimuth(double dNewAz)
+{
+    return gotoAzimuthAsync(dNewAz, LAUNCH_INLINE).get();
+}
+
+int CRigelDome::openShutter()
+{
+    return openShutterAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::closeShutter()
+{
+    return closeShutterAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::goHome()
+{
+    return goHomeAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::calibrate()
+{
+    return calibrateAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::setHomeAz(double dAz)
+{
+    return setHomeAzAsync(dAz, LAUNCH_INLINE).get();
+}
+
+int CRigelDome::setParkAz(double dAz)
+{
+    return setParkAzAsync(dAz, LAUNCH_INLINE).get();
+}
+
+int CRigelDome::btForce()
+{
+    return btForceAsync(LAUNCH_INLINE).get();
+}
+
+int CRigelDome::getBatteryLevels(double &dShutterVolts, int &nPercent)
+{
+    BatteryLevels Levels = getBatteryLevelsAsync(LAUNCH_INLINE).get();
+
+    if(Levels.nErr == RD_OK) {
+        dShutterVolts = Levels.dShutterVolts;
+        nPercent = Levels.nPercent;
+    }
+    return Levels.nErr;
+}
+
+int CRigelDome::abortCurrentCommand()
+{
+    return abortCurrentCommandAsync(LAUNCH_INLINE).get();
+}
+
+std::future<int> CRigelDome::syncDomeAsync(double dAz, double dEl, int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this, dAz, dEl] { return doSyncDome(dAz, dEl); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::parkDomeAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doParkDome(); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::unparkDomeAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doUnparkDome(); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::gotoAzimuthAsync(double dNewAz, int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this, dNewAz] { return doGotoAzimuth(dNewAz); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::openShutterAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doOpenShutter(); }, RD_ABORTED, nLaunch);
+}
+
+// stays in order with the rest, an open queued before it must not run after it
+std::future<int> CRigelDome::closeShutterAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doCloseShutter(); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::goHomeAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doGoHome(); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::calibrateAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doCalibrate(); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::setHomeAzAsync(double dAz, int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this, dAz] { return doSetHomeAz(dAz); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::setParkAzAsync(double dAz, int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this, dAz] { return doSetParkAz(dAz); }, RD_ABORTED, nLaunch);
+}
+
+std::future<int> CRigelDome::btForceAsync(int nLaunch)
+{
+    return submitCommand<int>(m_CmdLane, [this] { return doBtForce(); }, RD_ABORTED, nLaunch);
+}
+
+std::future<BatteryLevels> CRigelDome::getBatteryLevelsAsync(int nLaunch)
+{
+    BatteryLevels Aborted = {RD_ABORTED, 0, 0};
+
+    return submitCommand<BatteryLevels>(m_CmdLane, [this] {
+        BatteryLevels Levels = {RD_OK, 0, 0};
+        Levels.nErr = doGetBatteryLevels(Levels.dShutterVolts, Levels.nPercent);
+        return Levels;
+    }, Aborted, nLaunch);
+}
+
+// drops the queued commands first and stops the running one from writing again,
+// so nothing we cancelled moves the dome after the STOP
+std::future<int> CRigelDome::abortCurrentCommandAsync(int nLaunch)
+{
+    m_nAbortGeneration++;
+    m_CmdLane.cancel();
+    return submitCommand<int>(m_SafetyLane, [this] { return doAbortCurrentCommand(); }, RD_ABORTED, nLaunch);
+}
+
+// -1 outside of a command
+static thread_local long long g_nCmdAbortGeneration = -1;
+
+CRigelDome::CCommandScope::CCommandScope(unsigned int nAbortGeneration)
+{
+    m_nOuter = g_nCmdAbortGeneration;
+    g_nCmdAbortGeneration = nAbortGeneration;
+}
+
+CRigelDome::CCommandScope::~CCommandScope()
+{
+    g_nCmdAbortGeneration = m_nOuter;
+}
+
+// the poller and the state refreshes outside of a command are never aborted
+bool CRigelDome::isCommandAborted()
+{
+    return g_nCmdAbortGeneration >= 0 && (unsigned int)g_nCmdAbortGeneration != m_nAbortGeneration;
+}
+
 #pragma mark - Getter / Setter
 
 int CRigelDome::getNbTicksPerRev()
@@ -1276,13 +2225,16 @@ int CRigelDome::getNbTicksPerRev()
 
 double CRigelDome::getHomeAz()
 {
+    double dAz;
+
+    // getDomeHomeAz updates m_dHomeAz
     if(m_bIsConnected)
-        getDomeHomeAz(m_dHomeAz);
+        getDomeHomeAz(dAz);
 
     return m_dHomeAz;
 }
 
-int CRigelDome::setHomeAz(double dAz)
+int CRigelDome::doSetHomeAz(double dAz)
 {
     int nErr = RD_OK;
     char szBuf[SERIAL_BUFFER_SIZE];
@@ -1309,14 +2261,17 @@ int CRigelDome::setHomeAz(double dAz)
 
 double CRigelDome::getParkAz()
 {
+    double dAz;
+
+    // getDomeParkAz updates m_dParkAz
     if(m_bIsConnected)
-        getDomeParkAz(m_dParkAz);
+        getDomeParkAz(dAz);
 
     return m_dParkAz;
 
 }
 
-int CRigelDome::setParkAz(double dAz)
+int CRigelDome::doSetParkAz(double dAz)
 {
     int nErr = RD_OK;
     char szBuf[SERIAL_BUFFER_SIZE];
@@ -1344,84 +2299,900 @@ int CRigelDome::setParkAz(double dAz)
 
 double CRigelDome::getCurrentAz()
 {
-    if(m_bIsConnected)
-        getDomeAz(m_dCurrentAzPosition);
-    
-    return m_dCurrentAzPosition;
+    DomeStatus Status;
+
+    getStatus(Status);
+    return Status.dAz;
 }
 
 double CRigelDome::getCurrentEl()
 {
-    if(m_bIsConnected)
-        getDomeEl(m_dCurrentElPosition);
-    
-    return m_dCurrentElPosition;
+    DomeStatus Status;
+
+    getStatus(Status);
+    return Status.dEl;
+}
+
+int CRigelDome::getCurrentAzEl(double &dAz, double &dEl)
+{
+    int nErr = RD_OK;
+    DomeStatus Status;
+
+    nErr = getStatus(Status);
+    dAz = Status.dAz;
+    dEl = Status.dEl;
+    return nErr;
 }
 
 int CRigelDome::getCurrentShutterState()
 {
-    if(m_bIsConnected)
-        getShutterState(m_nShutterState);
+    DomeStatus Status;
 
-    return m_nShutterState;
+    getStatus(Status);
+    return Status.nShutterState;
 }
 
 int CRigelDome::getExtendedState()
 {
     int nErr = RD_OK;
-    char szResp[SERIAL_BUFFER_SIZE];
-    std::vector<std::string> vFields;
+    char szResp[V_RESPONSE_SIZE];
+    DomeStatus Status;
 
     if(!m_bIsConnected)
         return NOT_CONNECTED;
 
-    nErr = domeCommand("V\r", szResp, SERIAL_BUFFER_SIZE);
+    nErr = domeCommand("V\r", szResp, V_RESPONSE_SIZE);
     if(nErr)
         return nErr;
+
     // szResp contains the 13 state fields.
-    nErr = parseFields(szResp, vFields, '\t');
-    if(vFields.size()>=13) {
-        m_dCurrentAzPosition = atof(vFields[0].c_str());
-        m_nMotorState = atoi(vFields[1].c_str());
-		m_nPreviousShutterState = m_nShutterState;
-        m_nShutterState = atoi(vFields[5].c_str());
-        switch(m_nShutterState) {
-            case OPEN:
-                m_bShutterOpened = true;
-                break;
+    m_bExtendedStateOk = false;
+    if(parseExtendedState(szResp, Status) != RD_OK) {
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        fprintf(Logfile, "[%s] [CRigelDome::getExtendedState] Can't parse V response : %s\n", timestamp, szResp);
+        fflush(Logfile);
+#endif
+        return nErr;
+    }
 
-            case CLOSED:
-                m_bShutterOpened = false;
-                break;
+    m_bExtendedStateOk = true;
+    m_DomeStatus = Status;
+    m_dCurrentAzPosition = Status.dAz;
+    m_nMotorState = Status.nMotorState;
+    m_nShutterState = Status.nShutterState;
+    switch(m_nShutterState) {
+        case OPEN:
+            m_bShutterOpened = true;
+            break;
 
-            case NOT_FITTED:
-                m_bShutterOpened = false;
-                m_bHasShutter = false;
-                break;
-            default:
-                m_bShutterOpened = false;
+        case CLOSED:
+            m_bShutterOpened = false;
+            break;
 
+        case NOT_FITTED:
+            m_bShutterOpened = false;
+            m_bHasShutter = false;
+            break;
+        default:
+            m_bShutterOpened = false;
+
+    }
+    return nErr;
+}
+
+// skip leading blanks, from_chars doesn't
+static const char *skipBlanks(const char *pszStart, const char *pszEnd)
+{
+    while(pszStart < pszEnd && (*pszStart == ' ' || *pszStart == '\n'))
+        pszStart++;
+    return pszStart;
+}
+
+static bool parseIntField(const char *pszStart, const char *pszEnd, int &nValue)
+{
+    pszStart = skipBlanks(pszStart, pszEnd);
+    std::from_chars_result Res = std::from_chars(pszStart, pszEnd, nValue);
+    return Res.ec == std::errc() && Res.ptr != pszStart;
+}
+
+static bool parseDoubleField(const char *pszStart, const char *pszEnd, double &dValue)
+{
+    pszStart = skipBlanks(pszStart, pszEnd);
+#if defined(__cpp_lib_to_chars)
+    std::from_chars_result Res = std::from_chars(pszStart, pszEnd, dValue);
+    return Res.ec == std::errc() && Res.ptr != pszStart;
+#else
+    // no floating point from_chars in this standard library, strtod stops on the separator anyway
+    char *pszParsed;
+    dValue = strtod(pszStart, &pszParsed);
+    return pszParsed != pszStart && pszParsed <= pszEnd;
+#endif
+}
+
+int CRigelDome::parseExtendedState(const char *pszResp, DomeStatus &Status)
+{
+    const char *pszFieldStart[V_RESPONSE_FIELDS];
+    const char *pszFieldEnd[V_RESPONSE_FIELDS];
+    const char *pszEnd = pszResp + strlen(pszResp);
+    const char *pszCur = pszResp;
+    const char *pszSep;
+    int nField;
+    int nNbFields = 0;
+
+    memset(&Status, 0, sizeof(DomeStatus));
+
+    // find the fields boundaries, no copy
+    while(nNbFields < V_RESPONSE_FIELDS) {
+        pszSep = (const char *)memchr(pszCur, '\t', (size_t)(pszEnd - pszCur));
+        if(!pszSep)
+            pszSep = pszEnd;
+        pszFieldStart[nNbFields] = pszCur;
+        pszFieldEnd[nNbFields] = pszSep;
+        nNbFields++;
+        if(pszSep == pszEnd)
+            break;
+        pszCur = pszSep + 1;
+    }
+
+    Status.nNbFields = nNbFields;
+    if(nNbFields < V_RESPONSE_FIELDS)
+        return RD_BAD_CMD_RESPONSE;
+
+    if(!parseDoubleField(pszFieldStart[V_AZ], pszFieldEnd[V_AZ], Status.dAz))
+        return RD_BAD_CMD_RESPONSE;
+    if(!parseIntField(pszFieldStart[V_MOTOR_STATE], pszFieldEnd[V_MOTOR_STATE], Status.nMotorState))
+        return RD_BAD_CMD_RESPONSE;
+    if(!parseIntField(pszFieldStart[V_SHUTTER_STATE], pszFieldEnd[V_SHUTTER_STATE], Status.nShutterState))
+        return RD_BAD_CMD_RESPONSE;
+
+    // fields we don't interpret yet are kept as numbers, anything non numeric reads as 0
+    for(nField = 0; nField < V_RESPONSE_FIELDS; nField++) {
+        if(!parseDoubleField(pszFieldStart[nField], pszFieldEnd[nField], Status.dFields[nField]))
+            Status.dFields[nField] = 0.0;
+    }
+
+    return RD_OK;
+}
+
+int CRigelDome::refreshState(bool bForce)
+{
+    int nErr = RD_OK;
+    bool bCheckShutter;
+    unsigned int nGeneration;
+    DomeStatus Status;
+    RigelCommand Cmds[4];
+    int nNbCmds;
+    int nAzCmd, nMotorCmd, nBondCmd, nShutterCmd;
+    int nShutterState;
+    char szAz[SERIAL_BUFFER_SIZE];
+    char szMotor[SERIAL_BUFFER_SIZE];
+    char szBond[SERIAL_BUFFER_SIZE];
+    char szShutter[SERIAL_BUFFER_SIZE];
+
+    if(!m_bIsConnected)
+        return NOT_CONNECTED;
+
+    // TheSkyX asks for az, el and motion state back to back, serve them all from one reply.
+    // The snapshot is a seqlock, a fresh one needs neither the state lock nor the link.
+    if(!bForce && m_StatusSnapshot.load(Status) && isStatusFresh(Status, STATE_MAX_AGE)) {
+        m_nSnapshotReads++;
+        return nErr;
+    }
+
+    CStateLock lock(this, true);
+
+    // another thread may have refreshed while we were waiting for the lock
+    if(!bForce && m_StatusSnapshot.load(Status) && isStatusFresh(Status, STATE_MAX_AGE)) {
+        m_nSnapshotReads++;
+        return nErr;
+    }
+
+    // commands don't take this lock, one sent while we query bumps the generation and
+    // the snapshot we publish with the old one is never taken as fresh
+    nGeneration = m_nCmdGeneration;
+
+    // try V again from time to time, the fallback may have come from a noisy link
+    if(!m_bUseExtendedState && m_ExtendedStateTimer.GetElapsedSeconds() > V_REPROBE_INTERVAL) {
+        m_bUseExtendedState = true;
+        m_nExtendedStateFailures = V_MAX_FAILURES - 1;
+    }
+
+    if(m_bUseExtendedState) {
+        nErr = getExtendedState();
+        if(nErr && nErr != RD_TIMEOUT)
+            return nErr;
+
+        if(!nErr && m_bExtendedStateOk) {
+            m_nExtendedStateFailures = 0;
+            m_nShutterStateErr = RD_OK;
+            m_bShutterStateValid = true;
+            publishState(nGeneration);
+            return nErr;
+        }
+        // line noise can spoil one V reply, only give up on V after a few in a row.
+        // Either way this refresh uses the individual queries.
+        nErr = RD_OK;
+        m_nExtendedStateFailures++;
+        if(m_nExtendedStateFailures >= V_MAX_FAILURES) {
+            m_bUseExtendedState = false;
+            m_ExtendedStateTimer.Reset();
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+            ltime = time(NULL);
+            timestamp = asctime(localtime(&ltime));
+            timestamp[strlen(timestamp) - 1] = 0;
+            fprintf(Logfile, "[%s] [CRigelDome::refreshState] V response unusable, falling back to ANGLE/MSTATE/SHUTTER\n", timestamp);
+            fflush(Logfile);
+#endif
         }
     }
+
+    // the shutter is behind a BT link, only ask from time to time unless it's moving.
+    bCheckShutter = !m_bCalibrating &&
+                    (!m_bShutterStateValid || m_nShutterState == OPENING || m_nShutterState == CLOSING ||
+                     m_cmdDelayCheckTimer.GetElapsedSeconds() > SHUTTER_CHECK_WAIT);
+
+    // send all the queries in one go, the replies come back in the same order.
+    nNbCmds = 0;
+    nAzCmd = nBondCmd = nShutterCmd = -1;
+    if(!m_bCalibrating) {
+        nAzCmd = nNbCmds++;
+        Cmds[nAzCmd] = {"ANGLE\r", szAz, SERIAL_BUFFER_SIZE, RD_OK};
+    }
+    nMotorCmd = nNbCmds++;
+    Cmds[nMotorCmd] = {"MSTATE\r", szMotor, SERIAL_BUFFER_SIZE, RD_OK};
+    if(bCheckShutter) {
+        m_cmdDelayCheckTimer.Reset();
+        if(!isShutterBondFresh()) {
+            nBondCmd = nNbCmds++;
+            Cmds[nBondCmd] = {"BBOND\r", szBond, SERIAL_BUFFER_SIZE, RD_OK};
+        }
+        nShutterCmd = nNbCmds++;
+        Cmds[nShutterCmd] = {"SHUTTER\r", szShutter, SERIAL_BUFFER_SIZE, RD_OK};
+    }
+
+    domeCommandBatch(Cmds, nNbCmds);
+
+    if(nAzCmd >= 0) {
+        if(Cmds[nAzCmd].nErr)
+            return Cmds[nAzCmd].nErr;
+        m_dCurrentAzPosition = atof(szAz);
+    }
+
+    if(Cmds[nMotorCmd].nErr)
+        return Cmds[nMotorCmd].nErr;
+    m_nMotorState = atoi(szMotor);
+
+    if(bCheckShutter) {
+        // a shutter error doesn't make az or motion state stale, keep it for the shutter getters.
+        m_nShutterStateErr = RD_OK;
+        if(nBondCmd >= 0) {
+            m_nShutterStateErr = Cmds[nBondCmd].nErr;
+            if(!m_nShutterStateErr) {
+                setShutterBond(atoi(szBond) != 0);
+                if(!m_bShutterBonded)
+                    m_nShutterStateErr = NOT_CONNECTED;
+            }
+        }
+        if(!m_nShutterStateErr) {
+            m_nShutterStateErr = Cmds[nShutterCmd].nErr;
+            if(m_nShutterStateErr)
+                invalidateShutterBond();
+        }
+        if(!m_nShutterStateErr) {
+            parseShutterState(szShutter, nShutterState);
+            m_nShutterState = nShutterState;
+            m_bShutterStateValid = true;
+        }
+    }
+
+    publishState(nGeneration);
     return nErr;
 }
 
+void CRigelDome::publishState(unsigned int nGeneration)
+{
+    DomeStatus Status;
+    ObservedState Observed;
+    unsigned int nFields;
+
+    if(m_bExtendedStateOk)
+        Status = m_DomeStatus;
+    else
+        memset(&Status, 0, sizeof(DomeStatus));
+
+    m_dCurrentElPosition = (m_bShutterOpened && m_bHasShutter) ? 90.0 : 0.0;
+
+    Status.dAz = m_dCurrentAzPosition;
+    Status.nMotorState = m_nMotorState;
+    Status.nShutterState = m_nShutterState;
+    Status.dEl = m_dCurrentElPosition;
+    Status.nShutterErr = m_nShutterStateErr;
+    Status.nGeneration = nGeneration;
+    Status.dTimeStamp = getTimeStamp();
+    m_StatusSnapshot.store(Status);
+
+    {
+        std::lock_guard<std::mutex> lock(m_PollMutex);
+    }
+    m_PublishCond.notify_all();
+
+    // az isn't asked while calibrating, the shutter only when it's due
+    nFields = EVENT_MOTOR;
+    if(!m_bCalibrating)
+        nFields |= EVENT_AZ;
+    if(m_bShutterStateValid && !m_nShutterStateErr)
+        nFields |= EVENT_SHUTTER;
+    Observed.dAz = Status.dAz;
+    Observed.nMotorState = Status.nMotorState;
+    Observed.nShutterState = Status.nShutterState;
+    observeState(nFields, Observed);
+}
+
+static thread_local bool g_bStatusNoWait = false;
 
-int CRigelDome::parseFields(const char *pszResp, std::vector<std::string> &svFields, char cSeparator)
+CRigelDome::CStatusNoWait::CStatusNoWait()
+{
+    m_bOuter = g_bStatusNoWait;
+    g_bStatusNoWait = true;
+}
+
+CRigelDome::CStatusNoWait::~CStatusNoWait()
+{
+    g_bStatusNoWait = m_bOuter;
+}
+
+int CRigelDome::getStatus(DomeStatus &Status)
 {
     int nErr = RD_OK;
-    std::string sSegment;
-    std::stringstream ssTmp(pszResp);
+    double dMaxAge;
+
+    if(!m_bIsConnected) {
+        getLastStatus(Status);
+        return NOT_CONNECTED;
+    }
+
+    if(!m_bPollerRunning) {
+        nErr = refreshState();
+        getLastStatus(Status);
+        return nErr;
+    }
+
+    // the poller owns the link, never wait on serial I/O here, at most on its next snapshot.
+    // A still dome with no command since the snapshot doesn't change by itself, the poller backs off
+    // on it and we serve that snapshot until its next idle poll is due, not just for the max age.
+    dMaxAge = m_dMaxStatusAge;
+    if(m_StatusSnapshot.load(Status)) {
+        if(!isStatusMoving(Status))
+            dMaxAge += m_nPollWaitMs / 1000.0;
+        if(isStatusFresh(Status, dMaxAge)) {
+            m_nSnapshotReads++;
+            return nErr;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(m_PollMutex);
+    m_bPollNow = true;
+    m_PollCond.notify_all();
+    if(g_bStatusNoWait) {
+        getLastStatus(Status);
+        return RD_STATUS_PENDING;
+    }
+    if(m_PublishCond.wait_for(lock, std::chrono::duration<double>(dMaxAge),
+                              [&] { return m_StatusSnapshot.load(Status) && isStatusFresh(Status, dMaxAge); }))
+        return nErr;
+
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+    ltime = time(NULL);
+    timestamp = asctime(localtime(&ltime));
+    timestamp[strlen(timestamp) - 1] = 0;
+    fprintf(Logfile, "[%s] [CRigelDome::getStatus] No status newer than %3.2f seconds\n", timestamp, dMaxAge);
+    fflush(Logfile);
+#endif
+    getLastStatus(Status);
+    return RD_BAD_CMD_RESPONSE;
+}
+
+// m_DomeMutex held
+void CRigelDome::recordStateWait(double dWaitMs)
+{
+    m_nStateWaits++;
+    m_dStateWaitMs = m_dStateWaitMs + dWaitMs;
+    if(dWaitMs > m_dStateWaitMaxMs)
+        m_dStateWaitMaxMs = dWaitMs;
+}
+
+void CRigelDome::getLastStatus(DomeStatus &Status)
+{
+    if(m_StatusSnapshot.load(Status))
+        return;
+
+    // nothing was ever published
+    memset(&Status, 0, sizeof(DomeStatus));
+    Status.dAz = m_dCurrentAzPosition;
+    Status.dEl = m_dCurrentElPosition;
+    Status.nMotorState = IDLE;
+    Status.nShutterState = UNKNOWN;
+}
+
+bool CRigelDome::isStatusMoving(const DomeStatus &Status)
+{
+    switch(Status.nMotorState) {
+        case MOVING_TO_TARGET:
+        case MOVING_TO_VELOCITY:
+        case MOVING_ANTICLOCKWISE:
+        case MOVING_CLOCKWISE:
+        case CALIBRATIG:
+        case GOING_HOME:
+            return true;
+        default:
+            break;
+    }
+    return Status.nShutterState == OPENING || Status.nShutterState == CLOSING;
+}
+
+bool CRigelDome::isStatusFresh(const DomeStatus &Status, double dMaxAge)
+{
+    if(Status.nGeneration != m_nCmdGeneration)
+        return false;
+
+    return (getTimeStamp() - Status.dTimeStamp) <= dMaxAge;
+}
+
+void CRigelDome::invalidateState(bool bShutterToo)
+{
+    // anything queried before this point doesn't reflect the last command
+    m_nCmdGeneration++;
+    if(bShutterToo)
+        m_bShutterStateValid = false;
+
+    if(m_bPollerRunning) {
+        // something was just asked of the dome, go back to the fast rate
+        m_bPollResetBackoff = true;
+        std::lock_guard<std::mutex> lock(m_PollMutex);
+        m_bPollNow = true;
+        m_PollCond.notify_all();
+    }
+}
+
+double CRigelDome::getTimeStamp()
+{
+    return m_StatusClock.GetElapsedSeconds();
+}
+
+#pragma mark - I/O thread
+
+void CRigelDome::startIoThread()
+{
+    if(m_bIoRunning)
+        return;
+
+    m_bIoRealTime = false;
+    m_bIoPinned = false;
+    m_bIoRunning = true;
+    m_IoThread = std::thread(&CRigelDome::ioThread, this);
+}
+
+// callers own the link or are disconnecting, nothing is in flight
+void CRigelDome::stopIoThread()
+{
+    if(!m_IoThread.joinable())
+        return;
 
-    svFields.clear();
-    // split the string into vector elements
-    while(std::getline(ssTmp, sSegment, cSeparator))
     {
-        svFields.push_back(sSegment);
+        std::lock_guard<std::mutex> lock(m_IoMutex);
+        m_bIoRunning = false;
     }
+    m_IoCond.notify_all();
+    m_IoThread.join();
+}
 
-    if(svFields.size()==0) {
-        nErr = ERR_CMDFAILED;
+// real time priority and CPU pinning, both need privileges or a capable user (rtprio in limits.conf),
+// without them the thread still runs, just with normal scheduling.
+void CRigelDome::setIoThreadSched()
+{
+#ifdef SB_LINUX_BUILD
+    struct sched_param Param;
+    cpu_set_t CpuSet;
+    int nErr;
+
+    if(m_nIoPriority > 0) {
+        memset(&Param, 0, sizeof(Param));
+        Param.sched_priority = m_nIoPriority;
+        nErr = pthread_setschedparam(pthread_self(), SCHED_FIFO, &Param);
+        m_bIoRealTime = (nErr == 0);
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+        if(nErr) {
+            ltime = time(NULL);
+            timestamp = asctime(localtime(&ltime));
+            timestamp[strlen(timestamp) - 1] = 0;
+            fprintf(Logfile, "[%s] [CRigelDome::setIoThreadSched] can't set SCHED_FIFO %d : %s\n", timestamp, m_nIoPriority, strerror(nErr));
+            fflush(Logfile);
+        }
+#endif
     }
-    return nErr;
+
+    if(m_nIoCpu >= 0 && m_nIoCpu < CPU_SETSIZE) {
+        CPU_ZERO(&CpuSet);
+        CPU_SET(m_nIoCpu, &CpuSet);
+        nErr = pthread_setaffinity_np(pthread_self(), sizeof(CpuSet), &CpuSet);
+        m_bIoPinned = (nErr == 0);
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+        if(nErr) {
+            ltime = time(NULL);
+            timestamp = asctime(localtime(&ltime));
+            timestamp[strlen(timestamp) - 1] = 0;
+            fprintf(Logfile, "[%s] [CRigelDome::setIoThreadSched] can't pin the I/O thread to cpu %d : %s\n", timestamp, m_nIoCpu, strerror(nErr));
+            fflush(Logfile);
+        }
+#endif
+    }
+#endif
+}
+
+void CRigelDome::ioThread()
+{
+    IoRequest Request;
+    int nErr;
+
+    setIoThreadSched();
+
+    while(true) {
+        if(!m_IoQueue.pop(Request)) {
+            std::unique_lock<std::mutex> lock(m_IoMutex);
+            m_IoCond.wait(lock, [&] { return !m_IoQueue.empty() || !m_bIoRunning; });
+            if(!m_bIoRunning)
+                break;
+            continue;
+        }
+
+        nErr = exchangeBatch(Request.pCmds, Request.nNbCmds, Request.pbSent, Request.pszBatch, Request.nBatchLen, Request.bRetry);
+
+        m_IoSlots[Request.nSlot].nErr = nErr;
+        {
+            std::lock_guard<std::mutex> lock(m_IoMutex);
+            m_IoSlots[Request.nSlot].bDone.store(true, std::memory_order_release);
+        }
+        m_IoDoneCond.notify_all();
+    }
+}
+
+// called by the link owner, the exchange runs on the I/O thread and we wait for its slot.
+// Everything the I/O thread writes (replies, rx buffer, RTT) is visible once bDone is.
+int CRigelDome::runOnIoThread(RigelCommand *pCmds, int nNbCmds, const bool *pbSent, const char *pszBatch, size_t nBatchLen, bool bRetry)
+{
+    IoRequest Request = {pCmds, nNbCmds, pbSent, pszBatch, nBatchLen, bRetry, m_nIoSeq++ & (IO_QUEUE_SIZE - 1)};
+    IoCompletion &Slot = m_IoSlots[Request.nSlot];
+
+    Slot.bDone.store(false, std::memory_order_relaxed);
+    // can't be full, the link owner never has more than one exchange in flight
+    if(!m_IoQueue.push(Request))
+        return ERR_CMDFAILED;
+
+    std::unique_lock<std::mutex> lock(m_IoMutex);
+    m_IoCond.notify_one();
+    m_IoDoneCond.wait(lock, [&] { return Slot.bDone.load(std::memory_order_acquire); });
+    return Slot.nErr;
+}
+
+#pragma mark - background poller
+
+void CRigelDome::setPolling(bool bEnable, int nIntervalMs, int nIdleIntervalMs, int nIdleMaxMs, int nMaxAgeMs)
+{
+    std::lock_guard<std::mutex> lock(m_PollerCtlMutex);
+
+    stopPoller();
+
+    m_bPollingEnabled = bEnable;
+    m_nPollInterval = nIntervalMs > 0 ? nIntervalMs : DEFAULT_POLL_INTERVAL;
+    m_nPollIdleInterval = nIdleIntervalMs > 0 ? nIdleIntervalMs : DEFAULT_POLL_IDLE_INTERVAL;
+    m_nPollIdleMax = nIdleMaxMs > 0 ? nIdleMaxMs : DEFAULT_POLL_IDLE_MAX;
+    if(m_nPollIdleMax < m_nPollIdleInterval)
+        m_nPollIdleMax = m_nPollIdleInterval;
+    m_dMaxStatusAge = (nMaxAgeMs > 0 ? nMaxAgeMs : DEFAULT_MAX_STATUS_AGE) / 1000.0;
+
+    if((m_bPollingEnabled || m_nPollingRequests) && m_bIsConnected)
+        startPoller();
+}
+
+// the host's setting stays as it is, we only add to it
+void CRigelDome::requirePolling(bool bRequire)
+{
+    std::lock_guard<std::mutex> lock(m_PollerCtlMutex);
+
+    if(bRequire)
+        m_nPollingRequests++;
+    else if(m_nPollingRequests > 0)
+        m_nPollingRequests--;
+
+    if((m_bPollingEnabled || m_nPollingRequests) && m_bIsConnected)
+        startPoller();
+    else
+        stopPoller();
+}
+
+void CRigelDome::startPoller()
+{
+    if(m_bPollerRunning)
+        return;
+
+    m_bPollNow = false;
+    m_nPollIdleCurrent = m_nPollIdleInterval;
+    m_bPollerRunning = true;
+    m_PollThread = std::thread(&CRigelDome::pollerThread, this);
+}
+
+void CRigelDome::stopPoller()
+{
+    if(!m_PollThread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_PollMutex);
+        m_bPollerRunning = false;
+    }
+    m_PollCond.notify_all();
+    m_PollThread.join();
 }
+
+void CRigelDome::pollerThread()
+{
+    int nErr;
+    int nInterval;
+
+    while(m_bPollerRunning) {
+        nErr = refreshState(true);
+        if(nErr) {
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+            ltime = time(NULL);
+            timestamp = asctime(localtime(&ltime));
+            timestamp[strlen(timestamp) - 1] = 0;
+            fprintf(Logfile, "[%s] [CRigelDome::pollerThread] refresh error %d\n", timestamp, nErr);
+            fflush(Logfile);
+#endif
+        }
+
+        nInterval = nextPollInterval();
+        m_nPollWaitMs = nInterval;
+
+        std::unique_lock<std::mutex> lock(m_PollMutex);
+        m_PollCond.wait_for(lock, std::chrono::milliseconds(nInterval), [this] { return m_bPollNow || !m_bPollerRunning; });
+        m_bPollNow = false;
+    }
+}
+
+// Poll fast while the dome or the shutter is moving, back off exponentially when everything is still
+// so a parked dome doesn't keep the serial and shutter BT links busy all night.
+int CRigelDome::nextPollInterval()
+{
+    int nInterval;
+    DomeStatus Status;
+
+    if(m_bPollResetBackoff.exchange(false))
+        m_nPollIdleCurrent = m_nPollIdleInterval;
+
+    if(!m_StatusSnapshot.load(Status))
+        return m_nPollInterval;
+
+    if(isStatusMoving(Status)) {
+        m_nPollIdleCurrent = m_nPollIdleInterval;
+        return m_nPollInterval;
+    }
+
+    nInterval = m_nPollIdleCurrent;
+    if(m_nPollIdleCurrent < m_nPollIdleMax) {
+        m_nPollIdleCurrent *= 2;
+        if(m_nPollIdleCurrent > m_nPollIdleMax)
+            m_nPollIdleCurrent = m_nPollIdleMax;
+    }
+    return nInterval;
+}
+
+#pragma mark - state change events
+
+// shortest way around, az wraps at 360
+static double azDistance(double dAz1, double dAz2)
+{
+    double dDiff = fabs(fmod(dAz1 - dAz2, 360.0));
+
+    return dDiff > 180.0 ? 360.0 - dDiff : dDiff;
+}
+
+// the first shutter state we read is a change from UNKNOWN, the other fields have no value yet
+void CRigelDome::resetObserved()
+{
+    std::lock_guard<std::mutex> lock(m_ObserverMutex);
+
+    memset(&m_Observed, 0, sizeof(ObservedState));
+    m_Observed.nShutterState = UNKNOWN;
+    m_Observed.nKnown = EVENT_SHUTTER;
+    for(Subscription &Sub : m_Subscriptions)
+        Sub.bAzRefValid = false;
+}
+
+int CRigelDome::subscribe(int nEventMask, DomeEventCallback fnCallback, double dThreshold)
+{
+    Subscription Sub;
+
+    std::lock_guard<std::mutex> lock(m_ObserverMutex);
+    Sub.nId = m_nNextSubscription++;
+    Sub.nEventMask = nEventMask;
+    Sub.dThreshold = dThreshold;
+    Sub.dAzRef = m_Observed.dAz;
+    Sub.bAzRefValid = (m_Observed.nKnown & EVENT_AZ) != 0;
+    Sub.fnCallback = fnCallback;
+    m_Subscriptions.push_back(Sub);
+    return Sub.nId;
+}
+
+// a call to it may be on its way on another thread, wait for it
+void CRigelDome::unsubscribe(int nId)
+{
+    std::vector<Subscription>::iterator it;
+
+    std::unique_lock<std::mutex> lock(m_ObserverMutex);
+    for(it = m_Subscriptions.begin(); it != m_Subscriptions.end(); ++it) {
+        if(it->nId == nId) {
+            m_Subscriptions.erase(it);
+            break;
+        }
+    }
+    if(m_DispatchThread != std::this_thread::get_id())
+        m_ObserverCond.wait(lock, [&] { return m_nDispatchingId != nId; });
+}
+
+// The status engine, called with m_DomeMutex held. Compares the fields in nFields with what we saw
+// last and queues an event for the subscribers of each change. Motor, shutter and bond changes go
+// to everyone that asked for them, az and battery changes depend on each subscriber's threshold.
+// The events go out when m_DomeMutex is released, see dispatchEvents.
+void CRigelDome::observeState(unsigned int nFields, const ObservedState &New)
+{
+    DomeEvent Event;
+    bool bCrossed;
+    double dTimeStamp = getTimeStamp();
+
+    {
+        std::lock_guard<std::mutex> lock(m_ObserverMutex);
+        ObservedState &Old = m_Observed;
+
+        memset(&Event, 0, sizeof(DomeEvent));
+        Event.dTimeStamp = dTimeStamp;
+        for(Subscription &Sub : m_Subscriptions) {
+            if((nFields & EVENT_AZ) && (Sub.nEventMask & EVENT_AZ)) {
+                if(!Sub.bAzRefValid) {
+                    Sub.dAzRef = New.dAz;
+                    Sub.bAzRefValid = true;
+                }
+                else if(azDistance(Sub.dAzRef, New.dAz) > 0 && azDistance(Sub.dAzRef, New.dAz) >= Sub.dThreshold) {
+                    Event.nEvent = EVENT_AZ;
+                    Event.dOld = Sub.dAzRef;
+                    Event.dNew = New.dAz;
+                    m_PendingEvents.push_back({Sub.nId, Sub.fnCallback, Event});
+                    Sub.dAzRef = New.dAz;
+                }
+            }
+            if((nFields & EVENT_MOTOR) && (Sub.nEventMask & EVENT_MOTOR) && (Old.nKnown & EVENT_MOTOR) &&
+               Old.nMotorState != New.nMotorState) {
+                Event.nEvent = EVENT_MOTOR;
+                Event.dOld = Old.nMotorState;
+                Event.dNew = New.nMotorState;
+                m_PendingEvents.push_back({Sub.nId, Sub.fnCallback, Event});
+            }
+            if((nFields & EVENT_SHUTTER) && (Sub.nEventMask & EVENT_SHUTTER) && (Old.nKnown & EVENT_SHUTTER) &&
+               Old.nShutterState != New.nShutterState) {
+                Event.nEvent = EVENT_SHUTTER;
+                Event.dOld = Old.nShutterState;
+                Event.dNew = New.nShutterState;
+                m_PendingEvents.push_back({Sub.nId, Sub.fnCallback, Event});
+            }
+            if((nFields & EVENT_BOND) && (Sub.nEventMask & EVENT_BOND) && (Old.nKnown & EVENT_BOND) &&
+               Old.nBond != New.nBond) {
+                Event.nEvent = EVENT_BOND;
+                Event.dOld = Old.nBond;
+                Event.dNew = New.nBond;
+                m_PendingEvents.push_back({Sub.nId, Sub.fnCallback, Event});
+            }
+            if((nFields & EVENT_BATTERY) && (Sub.nEventMask & EVENT_BATTERY) && (Old.nKnown & EVENT_BATTERY)) {
+                if(Sub.dThreshold > 0)
+                    bCrossed = (Old.dBatteryVolts >= Sub.dThreshold) != (New.dBatteryVolts >= Sub.dThreshold);
+                else
+                    bCrossed = Old.dBatteryVolts != New.dBatteryVolts || Old.nBatteryPercent != New.nBatteryPercent;
+                if(bCrossed) {
+                    Event.nEvent = EVENT_BATTERY;
+                    Event.dOld = Old.dBatteryVolts;
+                    Event.dNew = New.dBatteryVolts;
+                    Event.nBatteryPercent = New.nBatteryPercent;
+                    m_PendingEvents.push_back({Sub.nId, Sub.fnCallback, Event});
+                    Event.nBatteryPercent = 0;
+                }
+            }
+        }
+
+        if(nFields & EVENT_AZ)
+            Old.dAz = New.dAz;
+        if(nFields & EVENT_MOTOR)
+            Old.nMotorState = New.nMotorState;
+        if(nFields & EVENT_SHUTTER)
+            Old.nShutterState = New.nShutterState;
+        if(nFields & EVENT_BOND)
+            Old.nBond = New.nBond;
+        if(nFields & EVENT_BATTERY) {
+            Old.dBatteryVolts = New.dBatteryVolts;
+            Old.nBatteryPercent = New.nBatteryPercent;
+        }
+        Old.nKnown |= nFields;
+    }
+}
+
+// Calls the subscribers with the queued events, without any lock so they can call the driver,
+// subscribe or unsubscribe. One thread at a time keeps them in order, a thread that finds
+// another one dispatching leaves its events to it.
+void CRigelDome::dispatchEvents()
+{
+    PendingEvent Call;
+    bool bSubscribed;
+
+    std::unique_lock<std::mutex> lock(m_ObserverMutex);
+    if(m_bDispatching)
+        return;
+    m_bDispatching = true;
+    m_DispatchThread = std::this_thread::get_id();
+    while(!m_PendingEvents.empty()) {
+        Call = m_PendingEvents.front();
+        m_PendingEvents.pop_front();
+        bSubscribed = false;
+        for(Subscription &Sub : m_Subscriptions)
+            bSubscribed |= Sub.nId == Call.nId;
+        if(!bSubscribed)
+            continue;
+        m_nDispatchingId = Call.nId;
+        lock.unlock();
+        Call.fnCallback(Call.Event);
+        lock.lock();
+        m_nDispatchingId = 0;
+        m_ObserverCond.notify_all();
+    }
+    m_bDispatching = false;
+    m_DispatchThread = std::thread::id();
+}
+
+// our own subscriber, the shutter and BT link changes that go to the logs
+void CRigelDome::logStateEvent(const DomeEvent &Event)
+{
+    char szMsg[64];
+
+    switch(Event.nEvent) {
+        case EVENT_SHUTTER :
+            if((int)Event.dNew == OPEN)
+                snprintf(szMsg, sizeof(szMsg), "Shutter Opened");
+            else if((int)Event.dNew == CLOSED)
+                snprintf(szMsg, sizeof(szMsg), "Shutter Closed");
+            else
+                return;
+            break;
+        case EVENT_BOND :
+            snprintf(szMsg, sizeof(szMsg), "Shutter BT link %s", Event.dNew != 0 ? "up" : "lost");
+            break;
+        default:
+            return;
+    }
+
+#if defined PLUGIN_DEBUG && PLUGIN_DEBUG >= 2
+    ltime = time(NULL);
+    timestamp = asctime(localtime(&ltime));
+    timestamp[strlen(timestamp) - 1] = 0;
+    fprintf(Logfile, "[%s] [CRigelDome::logStateEvent] %s\n", timestamp, szMsg);
+    fflush(Logfile);
+#endif
+    if(m_bDebugLog && m_pLogger) {
+        char szEventLogMsg[256];
+        ltime = time(NULL);
+        timestamp = asctime(localtime(&ltime));
+        timestamp[strlen(timestamp) - 1] = 0;
+        snprintf(szEventLogMsg, 256, "[%s] %s", timestamp, szMsg);
+        m_pLogger->out(szEventLogMsg);
+    }
+}
+
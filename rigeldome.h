@@ -11,31 +11,207 @@
 #include <time.h>
 
 #include <string>
-#include <vector>
-#include <sstream>
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <vector>
+#include <deque>
 
 #include "../../licensedinterfaces/sberrorx.h"
 #include "../../licensedinterfaces/serxinterface.h"
 #include "../../licensedinterfaces/loggerinterface.h"
 
-#include "StopWatch.h"
+#include "rigelclock.h"
+#include "rigeltransport.h"
+#include "seqlock.h"
+#include "spscqueue.h"
+#include "commandlane.h"
 
 #define DRIVER_VERSION      1.22
 // #define PLUGIN_DEBUG 2
 
 #define SERIAL_BUFFER_SIZE 20
-#define MAX_TIMEOUT 5000
+#define V_RESPONSE_SIZE 256     // the V reply is 13 tab separated fields
+#define V_RESPONSE_FIELDS 13
+#define V_MAX_FAILURES 3        // unusable V replies in a row before we fall back to the individual queries
+#define V_REPROBE_INTERVAL 300  // seconds, how long we stay on the individual queries before trying V again
+#define RX_BUFFER_SIZE 256      // receive ring buffer, must be a power of 2
+#define MAX_TIMEOUT 5000        // ms, also the reply timeout until we have RTT measurements
+#define MIN_TIMEOUT 50          // ms, lower bound of the adaptive reply timeouts
+#define MAX_QUERY_RETRIES 2     // a query that got no reply is sent again at most this many times
+#define QUERY_RETRY_BUDGET MAX_TIMEOUT  // ms, no new attempt once a query has been at it this long
+#define LINK_PREEMPT_SLICE 10   // ms, how long a poll can hold the link before it notices a safety command waiting
+#define MAX_STALE_LINES 8       // unexpected lines dropped while waiting for one reply before we give up
+#define MAX_BATCH_SIZE 8        // commands sent back to back by domeCommandBatch
+#define BATCH_BUFFER_SIZE (MAX_BATCH_SIZE * SERIAL_BUFFER_SIZE)
 #define ND_LOG_BUFFER_SIZE 256
 
 #define SHUTTER_CHECK_WAIT	3
+#define BOND_CHECK_WAIT     30      // seconds between BBOND checks while the shutter link is up
+#define STATE_MAX_AGE       0.1     // seconds a status snapshot is served before we ask the dome again
+
+// background status poller defaults
+#define DEFAULT_POLL_INTERVAL       250     // ms, while the dome or the shutter is moving
+#define DEFAULT_POLL_IDLE_INTERVAL  1000    // ms, first poll once everything stopped, doubles on each idle poll
+#define DEFAULT_POLL_IDLE_MAX       30000   // ms, idle back off limit
+#define DEFAULT_MAX_STATUS_AGE      2000    // ms, older snapshots are not served to the host, an idle one is
+                                            // served until the poller's next idle poll is due, see getStatus
+
+#define DEFAULT_COALESCE_WINDOW     50      // ms, identical read only queries inside this window share one exchange
+
+// optional I/O thread
+#define IO_QUEUE_SIZE               4       // exchanges in flight, the link owner only ever has one
+#define DEFAULT_IO_PRIORITY         0       // SCHED_FIFO priority, 0 = normal scheduling
+#define DEFAULT_IO_CPU              -1      // core the I/O thread is pinned to, -1 = any
 
 // error codes
 // Error code
-enum RigelDomeErrors {RD_OK=0, NOT_CONNECTED, RD_CANT_CONNECT, RD_BAD_CMD_RESPONSE, COMMAND_FAILED};
+enum RigelDomeErrors {RD_OK=0, NOT_CONNECTED, RD_CANT_CONNECT, RD_BAD_CMD_RESPONSE, COMMAND_FAILED, RD_TIMEOUT, RD_PREEMPTED, RD_ABORTED, RD_STATUS_PENDING};
 enum RigelDomeShutterState {OPEN=0, CLOSED, OPENING, CLOSING, SHUTTER_ERROR, UNKNOWN, NOT_FITTED};
 enum RigelMotorState {IDLE=0, MOVING_TO_TARGET, MOVING_TO_VELOCITY, MOVING_AT_SIDEREAL, MOVING_ANTICLOCKWISE, MOVING_CLOCKWISE, CALIBRATIG, GOING_HOME};
 
+// read only queries, see g_RigelCommands in rigeldome.cpp
+enum RigelQueries {Q_ANGLE=0, Q_MSTATE, Q_SHUTTER, Q_BBOND, Q_BAT, Q_V, Q_VER, Q_PULSAR, Q_ENCREV, Q_AT_HOME, Q_HOME, Q_PARK, NB_QUERIES};
+// what a reply should look like, anything else is a stale line from an earlier command
+enum RigelReplyTypes {REPLY_ANY=0, REPLY_ACK, REPLY_NUMBER, REPLY_TEXT, REPLY_FIELDS};
+// commands that take about the same time to answer share a reply timeout
+enum RigelTimingClasses {TIMING_QUERY=0, TIMING_MOTION, TIMING_SHUTTER, NB_TIMING_CLASSES};
+// how an async command is started. LAUNCH_INLINE runs it on the caller unless other commands are queued.
+enum RigelLaunchModes {LAUNCH_QUEUED=0, LAUNCH_INLINE};
+// who gets the serial link first, lower is more urgent. Safety commands also cut a poll short.
+enum RigelPriorities {PRIO_SAFETY=0, PRIO_MOTION, PRIO_CONFIG, PRIO_POLL, NB_PRIORITIES};
+
+// field index in the V reply
+enum RigelVFields {V_AZ=0, V_MOTOR_STATE=1, V_SHUTTER_STATE=5};
+
+// decoded V reply, also used as the published status snapshot
+struct DomeStatus {
+    double  dAz;
+    int     nMotorState;
+    int     nShutterState;
+    int     nNbFields;
+    double  dFields[V_RESPONSE_FIELDS];    // every field as a number, including the ones we don't use yet
+
+    // set when the snapshot is published
+    double          dEl;
+    int             nShutterErr;
+    unsigned int    nGeneration;            // command generation the query was sent in
+    double          dTimeStamp;             // seconds, see CRigelDome::getTimeStamp
+};
+
+// one command of a pipelined batch
+struct RigelCommand {
+    const char  *pszCmd;
+    char        *pszResult;     // can be NULL if we don't care about the reply
+    int         nResultMaxLen;
+    int         nErr;
+};
+
+// serial link counters
+struct LinkStats {
+    unsigned long   nRoundTrips;    // writes to the link, a batch counts once
+    unsigned long   nCoalesced;     // queries served from a shared reply
+    unsigned long   nStaleLines;    // lines dropped because they didn't match the command
+    unsigned long   nResyncs;       // purges after an error
+    unsigned long   nRetries;       // queries sent again after a lost reply
+    unsigned long   nRetriesOk;     // ... that got their reply on the new attempt
+    unsigned long   nPreempted;     // polls cut short by a safety command
+    unsigned long   nSnapshotReads; // status reads served without taking any lock
+    unsigned long   nStateWaits;    // status refreshes that waited for another thread's refresh
+    double          dStateWaitMs;   // ... total and longest wait
+    double          dStateWaitMaxMs;
+    unsigned long   nLinkWaits;     // exchanges that waited for the link
+    double          dLinkWaitMs;    // ... total and longest wait
+    double          dLinkWaitMaxMs;
+};
+
+// round trip time estimator for one timing class, in ms (SRTT/RTTVAR as in RFC 6298)
+struct RttStats {
+    double          dSrtt;
+    double          dRttVar;
+    int             nTimeout;       // current reply timeout
+    int             nBackoff;       // timeouts in a row, each one doubles nTimeout
+    unsigned long   nSamples;
+    unsigned long   nTimeouts;
+};
+
+// one exchange handed to the I/O thread, see CRigelDome::exchangeBatch
+struct IoRequest {
+    RigelCommand    *pCmds;
+    int             nNbCmds;
+    const bool      *pbSent;
+    const char      *pszBatch;
+    size_t          nBatchLen;
+    bool            bRetry;
+    unsigned int    nSlot;
+};
+
+// where the I/O thread leaves the result of an exchange
+struct IoCompletion {
+    std::atomic<bool>   bDone;
+    int                 nErr;
+};
+
+// getBatteryLevelsAsync result
+struct BatteryLevels {
+    int     nErr;
+    double  dShutterVolts;
+    int     nPercent;
+};
+
+// state changes a subscriber can ask for, see CRigelDome::subscribe
+enum RigelEvents {EVENT_AZ=0x01, EVENT_MOTOR=0x02, EVENT_SHUTTER=0x04, EVENT_BOND=0x08, EVENT_BATTERY=0x10};
+#define EVENT_ALL (EVENT_AZ | EVENT_MOTOR | EVENT_SHUTTER | EVENT_BOND | EVENT_BATTERY)
+
+// one change found by the status engine
+struct DomeEvent {
+    int     nEvent;             // one of RigelEvents
+    double  dOld;               // az in degrees, motor or shutter state, bond 0/1, shutter battery volts
+    double  dNew;
+    int     nBatteryPercent;    // EVENT_BATTERY only
+    double  dTimeStamp;         // seconds, see CRigelDome::getTimeStamp
+};
+
+typedef std::function<void(const DomeEvent &)> DomeEventCallback;
+
+// last values the status engine saw, nKnown has the EVENT_* bit of each field that has one
+struct ObservedState {
+    double          dAz;
+    int             nMotorState;
+    int             nShutterState;
+    int             nBond;
+    double          dBatteryVolts;
+    int             nBatteryPercent;
+    unsigned int    nKnown;
+};
+
+struct Subscription {
+    int                 nId;
+    int                 nEventMask;
+    double              dThreshold;
+    double              dAzRef;         // az of the last EVENT_AZ sent to this subscriber
+    bool                bAzRefValid;
+    DomeEventCallback   fnCallback;
+};
+
+// an event waiting for m_DomeMutex to be released before it goes to its subscriber
+struct PendingEvent {
+    int                 nId;
+    DomeEventCallback   fnCallback;
+    DomeEvent           Event;
+};
+
+// last reply to a read only query
+struct QueryReply {
+    char    szReply[V_RESPONSE_SIZE];
+    double  dTimeStamp;
+    bool    bValid;
+};
+
 class CRigelDome
 {
 public:
@@ -46,7 +222,7 @@ public:
     void        Disconnect(void);
     bool        IsConnected(void) { return m_bIsConnected; }
 
-    void        SetSerxPointer(SerXInterface *p) { m_pSerx = p; }
+    void        SetSerxPointer(SerXInterface *p) { m_pSerx = p; m_SerXTransport.setSerx(p); }
     void        setLogger(LoggerInterface *pLogger) { m_pLogger = pLogger; };
 
     // Dome commands
@@ -72,6 +248,25 @@ public:
 
     int abortCurrentCommand();
 
+    // async commands, the future gets the error code the synchronous call returns (the synchronous
+    // calls are these with LAUNCH_INLINE). They run in submission order on a worker thread,
+    // abortCurrentCommandAsync drops the ones that haven't started (RD_ABORTED) and sends STOP right away.
+    std::future<int> syncDomeAsync(double dAz, double dEl, int nLaunch = LAUNCH_QUEUED);
+    std::future<int> parkDomeAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> unparkDomeAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> gotoAzimuthAsync(double dNewAz, int nLaunch = LAUNCH_QUEUED);
+    std::future<int> openShutterAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> closeShutterAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> goHomeAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> calibrateAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> setHomeAzAsync(double dAz, int nLaunch = LAUNCH_QUEUED);
+    std::future<int> setParkAzAsync(double dAz, int nLaunch = LAUNCH_QUEUED);
+    std::future<int> btForceAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<BatteryLevels> getBatteryLevelsAsync(int nLaunch = LAUNCH_QUEUED);
+    std::future<int> abortCurrentCommandAsync(int nLaunch = LAUNCH_QUEUED);
+    // called from the worker each time an async command completes or is dropped, see rigelsequence.h
+    void setCommandHook(std::function<void()> fnHook) { m_CmdLane.setDoneHook(fnHook); m_SafetyLane.setDoneHook(fnHook); }
+
     // getter/setter
     int getNbTicksPerRev();
     int getBatteryLevel();
@@ -84,6 +279,7 @@ public:
 
     double getCurrentAz();
     double getCurrentEl();
+    int getCurrentAzEl(double &dAz, double &dEl);
 
     int getCurrentShutterState();
     int getBatteryLevels(double &shutterVolts, int &percent);
@@ -93,15 +289,124 @@ public:
 
     void setDebugLog(bool enable);
     void logString(const char *message);
+
+    static int parseExtendedState(const char *pszResp, DomeStatus &Status);
+
+    // state change callbacks, all fed by one status engine from the status snapshots, BBOND and BAT replies.
+    // dThreshold is the az change in degrees for EVENT_AZ, for EVENT_BATTERY the shutter volts the battery
+    // has to cross, 0 = any change. Callbacks run in order, one at a time, on a thread that got a new state
+    // (a host call or the poller) once it released the dome state, they shouldn't block.
+    // No call to a subscriber starts after unsubscribe returns.
+    int  subscribe(int nEventMask, DomeEventCallback fnCallback, double dThreshold = 0.0);
+    void unsubscribe(int nId);
+
+    // background status polling. requirePolling(true) keeps the poller running while connected whatever
+    // the host set, until the matching requirePolling(false). Neither from a subscriber.
+    void setPolling(bool bEnable, int nIntervalMs, int nIdleIntervalMs, int nIdleMaxMs, int nMaxAgeMs);
+    void requirePolling(bool bRequire);
+    bool isPolling() { return m_bPollerRunning; }
+
+    // while one is alive on a thread, getStatus there doesn't wait for the poller's next snapshot, it
+    // asks for one and returns RD_STATUS_PENDING. For loops that can't block, see rigelsequence.h
+    class CStatusNoWait {
+    public:
+        CStatusNoWait();
+        ~CStatusNoWait();
+    private:
+        bool    m_bOuter;
+    };
+
+    // read only query coalescing
+    void setCoalesceWindow(int nWindowMs);
+    void getLinkStats(LinkStats &Stats);
+    void getRttStats(int nTimingClass, RttStats &Stats);
+
+    // byte transport, only while disconnected
+    int  setTransport(int nTransport);
+    int  setTransport(CRigelTransport *pTransport);
+    int  getTransport() { return m_nTransport; }
+
+    // time source for all the timers, only while disconnected. Simulations use a CVirtualClock.
+    int  setClock(CRigelClock *pClock);
+
+    // run the serial exchanges on a dedicated thread, only while disconnected.
+    // nPriority > 0 asks for SCHED_FIFO at that priority, nCpu >= 0 pins the thread to that core (Linux only).
+    int  setIoThread(bool bEnable, int nPriority = DEFAULT_IO_PRIORITY, int nCpu = DEFAULT_IO_CPU);
+    bool isIoThreadRunning() { return m_bIoRunning; }
+    void getIoThreadSched(bool &bRealTime, bool &bPinned) { bRealTime = m_bIoRealTime; bPinned = m_bIoPinned; }
     
 protected:
-    
-    int             readResponse(char *pszRespBuffer, int bufferLen);
+
+    // owns the serial link for one exchange
+    class CLinkLock {
+    public:
+        CLinkLock(CRigelDome *pDome, int nPriority) : m_pDome(pDome) { m_pDome->acquireLink(nPriority); }
+        ~CLinkLock() { m_pDome->releaseLink(); }
+    private:
+        CRigelDome  *m_pDome;
+    };
+
+    void            acquireLink(int nPriority);
+    void            releaseLink();
+    bool            isLinkPreempted();
+
+    // m_DomeMutex, the events queued while a thread holds it go out when it releases its outermost lock
+    class CStateLock {
+    public:
+        CStateLock(CRigelDome *pDome, bool bRecordWait = false);
+        ~CStateLock();
+    private:
+        CRigelDome  *m_pDome;
+    };
+
+    // command bodies, run by the async lanes
+    int             doSyncDome(double dAz, double dEl);
+    int             doParkDome();
+    int             doUnparkDome();
+    int             doGotoAzimuth(double dNewAz);
+    int             doOpenShutter();
+    int             doCloseShutter();
+    int             doGoHome();
+    int             doCalibrate();
+    int             doSetHomeAz(double dAz);
+    int             doSetParkAz(double dAz);
+    int             doBtForce();
+    int             doGetBatteryLevels(double &dShutterVolts, int &nPercent);
+    int             doAbortCurrentCommand();
+
+    // a command remembers the abort generation it was submitted under, once abortCurrentCommand
+    // moves it on the command can't write anymore (RD_ABORTED), see sendBatch
+    class CCommandScope {
+    public:
+        CCommandScope(unsigned int nAbortGeneration);
+        ~CCommandScope();
+    private:
+        long long   m_nOuter;
+    };
+
+    template <typename R, typename F>
+    std::future<R> submitCommand(CCommandLane &Lane, F fnCommand, const R &Cancelled, int nLaunch)
+    {
+        unsigned int nAbortGeneration = m_nAbortGeneration;
+
+        return Lane.submit<R>([fnCommand, nAbortGeneration] {
+            CCommandScope Scope(nAbortGeneration);
+            return fnCommand();
+        }, Cancelled, nLaunch == LAUNCH_INLINE);
+    }
+    bool            isCommandAborted();
+
+    int             readResponse(char *pszRespBuffer, int bufferLen, int nReplyType = REPLY_ANY, int nTimeoutMs = MAX_TIMEOUT);
+    void            dropStaleRxLines();
+    int             fillRxBuffer(int nTimeoutMs);
+    bool            extractRxLine(char *pszRespBuffer, int nBufferLen);
+    void            clearRxBuffer();
     int             getDomeAz(double &dDomeAz);
-    int             getDomeEl(double &dDomeEl);
     int             getDomeHomeAz(double &dAz);
     int             getDomeParkAz(double &dAz);
     int             getShutterState(int &nState);
+    void            parseShutterState(const char *pszResp, int &nState);
+    int             getMotorState(int &nState);
     int             getDomeStepPerRev(int &nStepPerRev);
 
     int             isDomeMoving(bool &bIsMoving);
@@ -109,42 +414,200 @@ protected:
 
     int             connectToShutter();
     int             isConnectedToShutter(bool &bConnected);
+    int             getShutterBond(bool &bConnected);
+    bool            isShutterBondFresh();
+    void            invalidateShutterBond();
+    void            setShutterBond(bool bConnected);
     int             domeCommand(const char *pszCmd, char *pszResult, int nResultMaxLen);
+    int             domeCommandBatch(RigelCommand *pCmds, int nNbCmds);
+    int             sendBatch(RigelCommand *pCmds, int nNbCmds, bool bRetry);
+    int             exchangeBatch(RigelCommand *pCmds, int nNbCmds, const bool *pbSent, const char *pszBatch, size_t nBatchLen, bool bRetry);
+    void            clearQueryCache();
+    void            resetRttStats();
+    void            addRttSample(int nTimingClass, double dRttMs);
+    void            addRttTimeout(int nTimingClass);
+    void            updateReplyTimeout(int nTimingClass);
     int             getExtendedState();
-    int             parseFields(const char *pszResp, std::vector<std::string> &svFields, char cSeparator);
+    int             refreshState(bool bForce = false);
+    void            publishState(unsigned int nGeneration);
+    int             getStatus(DomeStatus &Status);
+    void            getLastStatus(DomeStatus &Status);
+    void            recordStateWait(double dWaitMs);
+    void            resetLockStats();
+    bool            isStatusFresh(const DomeStatus &Status, double dMaxAge);
+    static bool     isStatusMoving(const DomeStatus &Status);
+    void            invalidateState(bool bShutterToo = false);
+    void            observeState(unsigned int nFields, const ObservedState &New);
+    void            dispatchEvents();
+    void            resetObserved();
+    void            logStateEvent(const DomeEvent &Event);
+    double          getTimeStamp();
+
+    void            startPoller();      // m_PollerCtlMutex held
+    void            stopPoller();       // m_PollerCtlMutex held
+    void            pollerThread();
+    int             nextPollInterval();
+
+    void            startIoThread();
+    void            stopIoThread();
+    void            ioThread();
+    void            setIoThreadSched();
+    int             runOnIoThread(RigelCommand *pCmds, int nNbCmds, const bool *pbSent, const char *pszBatch, size_t nBatchLen, bool bRetry);
     
     LoggerInterface *m_pLogger;
     bool            m_bDebugLog;
     
-    bool            m_bIsConnected;
-    bool            m_bHomed;
-    bool            m_bParked;
-    bool            m_bCalibrating;
+    // read by the lock free dapi paths while commands update them
+    std::atomic<bool>   m_bIsConnected;
+    std::atomic<bool>   m_bHomed;
+    std::atomic<bool>   m_bParked;
+    std::atomic<bool>   m_bCalibrating;
     
     int             m_nNbStepPerRev;
     double          m_dShutterBatteryVolts;
     double          m_dShutterBatteryPercent;
-    double          m_dHomeAz;
+    std::atomic<double> m_dHomeAz;
     
-    double          m_dParkAz;
+    std::atomic<double> m_dParkAz;
 
-    double          m_dCurrentAzPosition;
-    double          m_dCurrentElPosition;
+    std::atomic<double> m_dCurrentAzPosition;
+    std::atomic<double> m_dCurrentElPosition;
 
-    double          m_dGotoAz;
+    std::atomic<double> m_dGotoAz;
     
     SerXInterface   *m_pSerx;
+
+    // all port I/O goes through m_pTransport
+    CSerXTransport  m_SerXTransport;
+#ifdef SB_LINUX_BUILD
+    CPosixSerialTransport   m_PosixSerialTransport;
+#endif
+#if defined(SB_LINUX_BUILD) || defined(SB_MAC_BUILD)
+    CTcpTransport   m_TcpTransport;
+#endif
+    CRigelTransport *m_pTransport;
+    int             m_nTransport;
+
+    // receive ring buffer, indexes are free running and masked on access
+    char            m_cRxBuffer[RX_BUFFER_SIZE];
+    unsigned int    m_nRxHead;
+    unsigned int    m_nRxTail;
     
     char            m_szFirmwareVersion[SERIAL_BUFFER_SIZE];
-    int             m_nShutterState;
-    int             m_nPreviousShutterState;
-    bool            m_bHasShutter;
-    bool            m_bShutterOpened;
+    std::atomic<int>    m_nShutterState;
+    std::atomic<bool>   m_bHasShutter;
+    std::atomic<bool>   m_bShutterOpened;
 
     char            m_szLogBuffer[ND_LOG_BUFFER_SIZE];
-    int             m_nMotorState;
+    std::atomic<int>    m_nMotorState;
+
+    CRigelClock     *m_pClock;
+	CRigelTimer		m_cmdDelayCheckTimer;
+
+    // shutter BT bond, only checked again on a timer, after an error or after we (re)bond
+    bool            m_bShutterBonded;
+    bool            m_bShutterBondValid;
+    CRigelTimer     m_BondCheckTimer;
+
+    // status snapshot shared by the az/el, motion and shutter getters
+    CSeqLock<DomeStatus>        m_StatusSnapshot;
+    CRigelTimer                 m_StatusClock;
+    std::atomic<unsigned int>   m_nCmdGeneration;
+    std::atomic<bool>           m_bShutterStateValid;
+    int             m_nShutterStateErr;
+    bool            m_bUseExtendedState;
+    bool            m_bExtendedStateOk;
+    int             m_nExtendedStateFailures;   // in a row
+    CRigelTimer     m_ExtendedStateTimer;       // since we fell back to the individual queries
+    DomeStatus      m_DomeStatus;
+
+    // dome state, shared between the host threads and the poller
+    std::recursive_mutex        m_DomeMutex;
+    std::atomic<unsigned long>  m_nSnapshotReads;
+    std::atomic<unsigned long>  m_nStateWaits;      // written with m_DomeMutex held
+    std::atomic<double>         m_dStateWaitMs;
+    std::atomic<double>         m_dStateWaitMaxMs;
+
+    // status engine, compares each new state with m_Observed and queues the subscribers' events
+    std::mutex                  m_ObserverMutex;
+    std::condition_variable     m_ObserverCond;         // a callback returned
+    ObservedState               m_Observed;             // m_ObserverMutex
+    std::vector<Subscription>   m_Subscriptions;        // m_ObserverMutex
+    std::deque<PendingEvent>    m_PendingEvents;        // m_ObserverMutex
+    bool                        m_bDispatching;         // m_ObserverMutex
+    std::thread::id             m_DispatchThread;       // m_ObserverMutex
+    int                         m_nDispatchingId;       // m_ObserverMutex, subscriber being called
+    int                         m_nNextSubscription;
+
+    // replies shared by identical read only queries, cleared by anything else we send
+    QueryReply                  m_QueryCache[NB_QUERIES];
+    double                      m_dCoalesceWindow;
+    std::atomic<unsigned long>  m_nRoundTrips;
+    std::atomic<unsigned long>  m_nCoalesced;
+
+    // framing, we only purge the port once we know we lost track of the replies
+    bool                        m_bLinkResync;
+    std::atomic<unsigned long>  m_nStaleLines;
+    std::atomic<unsigned long>  m_nResyncs;
+    std::atomic<unsigned long>  m_nRetries;
+    std::atomic<unsigned long>  m_nRetriesOk;
+    std::atomic<unsigned long>  m_nPreempted;
+
+    // serial link arbitration. m_DomeMutex protects the dome state and can be held across several
+    // exchanges, the link is only held for one so an urgent command can get in between.
+    std::mutex                  m_LinkMutex;
+    std::condition_variable     m_LinkCond;
+    bool                        m_bLinkBusy;
+    int                         m_nLinkPriority;        // priority of the current owner
+    int                         m_nLinkWaiting[NB_PRIORITIES];
+    std::atomic<bool>           m_bLinkPreempt;         // a safety command is waiting
+    unsigned long               m_nLinkWaits;           // m_LinkMutex
+    double                      m_dLinkWaitMs;
+    double                      m_dLinkWaitMaxMs;
+
+    // reply timeouts derived from the measured round trip times
+    RttStats                    m_Rtt[NB_TIMING_CLASSES];
+
+    // background poller
+    std::mutex                  m_PollerCtlMutex;       // settings, requests, start and stop of the thread
+    int                         m_nPollingRequests;     // m_PollerCtlMutex, see requirePolling
+    std::thread                 m_PollThread;
+    std::mutex                  m_PollMutex;
+    std::condition_variable     m_PollCond;     // wakes up the poller
+    std::condition_variable     m_PublishCond;  // a new snapshot was published
+    bool                        m_bPollNow;
+    std::atomic<bool>           m_bPollerRunning;
+    bool                        m_bPollingEnabled;
+    int                         m_nPollInterval;        // dome or shutter moving
+    int                         m_nPollIdleInterval;    // idle back off start
+    int                         m_nPollIdleMax;         // idle back off limit
+    int                         m_nPollIdleCurrent;
+    std::atomic<int>            m_nPollWaitMs;          // poller's wait after its last snapshot
+    std::atomic<bool>           m_bPollResetBackoff;
+    std::atomic<double>         m_dMaxStatusAge;
+
+    // I/O thread, owns the transport while it runs. The link owner pushes one exchange and
+    // waits for its completion slot, so there is only ever one producer.
+    std::thread                 m_IoThread;
+    CSpscQueue<IoRequest, IO_QUEUE_SIZE> m_IoQueue;
+    IoCompletion                m_IoSlots[IO_QUEUE_SIZE];
+    unsigned int                m_nIoSeq;               // link owner only
+    std::mutex                  m_IoMutex;              // only to sleep and wake up
+    std::condition_variable     m_IoCond;               // work for the I/O thread
+    std::condition_variable     m_IoDoneCond;           // an exchange completed
+    std::atomic<bool>           m_bIoRunning;
+    bool                        m_bIoEnabled;
+    int                         m_nIoPriority;
+    int                         m_nIoCpu;
+    std::atomic<bool>           m_bIoRealTime;
+    std::atomic<bool>           m_bIoPinned;
+
+    // async commands. Everything runs in order on m_CmdLane, STOP has its own lane so it doesn't
+    // wait behind the queue it cancels.
+    CCommandLane                m_CmdLane;
+    CCommandLane                m_SafetyLane;
+    std::atomic<unsigned int>   m_nAbortGeneration;
 
-	CStopWatch		m_cmdDelayCheckTimer;
     // timestamp for logs
     char *timestamp;
     time_t ltime;
@@ -0,0 +1,427 @@
+//
+//  rigelsequence.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  C++20 coroutine layer over CRigelDome for multi step sequences (night start, night end ...).
+//  A sequence is a CDomeTask coroutine that co_awaits command replies, motion or shutter completion
+//  and delays. CDomeSequencer resumes them all from one thread :
+//  - command replies wake it up through the async command hook, no polling
+//  - completions are checked when the status engine reports a motor or shutter change, and at the
+//    poll interval in case an event was missed. The is*Complete calls are served from the status
+//    snapshot without waiting for a new one, so the sequencer keeps the background poller running
+//    (CRigelDome::requirePolling) while it runs, the host's settings are left alone.
+//    isFindHomeComplete still sends one HOME ? once the dome has stopped.
+//  - delays are timers of the loop, nothing sleeps on a SleeperInterface
+//
+//  int nErr = co_await Seq.command(Dome.closeShutterAsync());
+//  nErr = co_await Seq.closeComplete();
+//
+//  Optional, only compiled with C++20 (the plugin itself is C++17), everything is in this header.
+//  A sequencer owns the dome's command hook, only one per CRigelDome.
+
+#ifndef __RIGEL_SEQUENCE__
+#define __RIGEL_SEQUENCE__
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#define RIGEL_HAS_COROUTINES 1
+
+#include <coroutine>
+#include <deque>
+#include <list>
+#include <vector>
+
+#include "rigeldome.h"
+
+#define SEQUENCE_POLL_INTERVAL      DEFAULT_POLL_INTERVAL   // ms, completion checks
+#define SEQUENCE_PENDING_RECHECK    20                      // ms, check again once the poller had time for a snapshot
+#define SEQUENCE_MOTION_TIMEOUT     180000                  // ms, rotation, park, home
+#define SEQUENCE_SHUTTER_TIMEOUT    120000                  // ms, shutter open or close
+
+class CDomeSequencer;
+
+// a sequence or a step of one, returns an error code like the CRigelDome calls. Starts suspended,
+// runs once it's given to CDomeSequencer::start or co_awaited from another task.
+class CDomeTask
+{
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    // back to the task that awaited us, or to the sequencer loop for a top level task
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle hTask) noexcept
+        {
+            if(hTask.promise().hContinuation)
+                return hTask.promise().hContinuation;
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct promise_type {
+        int                     nResult = RD_OK;
+        std::coroutine_handle<> hContinuation;
+
+        CDomeTask get_return_object() { return CDomeTask(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(int nErr) { nResult = nErr; }
+        void unhandled_exception() { nResult = ERR_CMDFAILED; }
+    };
+
+    CDomeTask() {}
+    explicit CDomeTask(Handle hTask) : m_hTask(hTask) {}
+    CDomeTask(CDomeTask &&Other) noexcept : m_hTask(Other.m_hTask) { Other.m_hTask = nullptr; }
+    CDomeTask &operator=(CDomeTask &&Other) noexcept
+    {
+        if(this != &Other) {
+            if(m_hTask)
+                m_hTask.destroy();
+            m_hTask = Other.m_hTask;
+            Other.m_hTask = nullptr;
+        }
+        return *this;
+    }
+    CDomeTask(const CDomeTask &) = delete;
+    CDomeTask &operator=(const CDomeTask &) = delete;
+    ~CDomeTask() { if(m_hTask) m_hTask.destroy(); }
+
+    bool done() const { return !m_hTask || m_hTask.done(); }
+    int  result() const { return m_hTask ? m_hTask.promise().nResult : RD_ABORTED; }
+    Handle handle() const { return m_hTask; }
+
+    // co_await of a sub sequence, runs it right away and resumes us when it returns
+    bool await_ready() { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> hCaller)
+    {
+        m_hTask.promise().hContinuation = hCaller;
+        return m_hTask;
+    }
+    int await_resume() { return result(); }
+
+private:
+    Handle  m_hTask;
+};
+
+class CDomeSequencer
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    CDomeSequencer(CRigelDome &Dome, int nPollMs = SEQUENCE_POLL_INTERVAL)
+        : m_Dome(Dome), m_nPollMs(nPollMs), m_bRunning(true), m_bWoken(false), m_bStateChanged(false)
+    {
+        // without the poller every completion check would be serial I/O on the loop thread
+        m_Dome.requirePolling(true);
+        m_nSubscription = m_Dome.subscribe(EVENT_MOTOR | EVENT_SHUTTER, [this](const DomeEvent &) { stateChanged(); });
+        m_Dome.setCommandHook([this] { wake(); });
+        m_Thread = std::thread(&CDomeSequencer::loop, this);
+    }
+
+    ~CDomeSequencer() { stop(); }
+
+    // unfinished tasks are destroyed, their futures get RD_ABORTED. Not from a command hook or a subscriber.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if(!m_bRunning)
+                return;
+            m_bRunning = false;
+        }
+        // both wait out the calls already on their way to wake(), nothing calls us once they return
+        m_Dome.setCommandHook(nullptr);
+        m_Dome.unsubscribe(m_nSubscription);
+        m_Cond.notify_all();
+        m_Thread.join();
+        m_Dome.requirePolling(false);
+        for(TopTask &Task : m_Tasks)
+            Task.Result.set_value(Task.Task.done() ? Task.Task.result() : RD_ABORTED);
+        m_Tasks.clear();
+        m_Waiters.clear();
+        for(TopTask &Task : m_Started)
+            Task.Result.set_value(RD_ABORTED);
+        m_Started.clear();
+    }
+
+    // hand a sequence to the loop, the future gets what it co_returns
+    std::future<int> start(CDomeTask &&Task)
+    {
+        std::future<int> Result;
+
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Started.emplace_back();
+            m_Started.back().Task = std::move(Task);
+            Result = m_Started.back().Result.get_future();
+        }
+        m_Cond.notify_one();
+        return Result;
+    }
+
+    // a waiting coroutine, only touched by the loop thread
+    struct Waiter {
+        std::coroutine_handle<>     hTask;
+        std::function<bool(int &)>  fnReady;        // true once done, sets the result. Empty for a delay.
+        bool                        bPolled;        // checked on state changes and at the poll interval, else on every wake up
+        Clock::time_point           tNextCheck;
+        Clock::time_point           tDeadline;
+        int                         nDeadlineResult;
+        int                         *pnResult;
+    };
+
+    struct WaitAwaiter {
+        CDomeSequencer  *pSequencer;
+        Waiter          Wait;
+        int             nResult;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> hTask)
+        {
+            Wait.hTask = hTask;
+            Wait.pnResult = &nResult;
+            pSequencer->m_Waiters.push_back(Wait);
+        }
+        int await_resume() { return nResult; }
+    };
+
+    struct CommandAwaiter {
+        CDomeSequencer      *pSequencer;
+        std::future<int>    Reply;
+
+        bool await_ready() { return Reply.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+        void await_suspend(std::coroutine_handle<> hTask)
+        {
+            Waiter Wait;
+            std::future<int> *pReply = &Reply;
+
+            Wait.hTask = hTask;
+            Wait.fnReady = [pReply](int &) { return pReply->wait_for(std::chrono::seconds(0)) == std::future_status::ready; };
+            Wait.bPolled = false;
+            Wait.tNextCheck = Clock::now();
+            Wait.tDeadline = Clock::time_point::max();
+            Wait.nDeadlineResult = RD_OK;
+            Wait.pnResult = NULL;
+            pSequencer->m_Waiters.push_back(Wait);
+        }
+        int await_resume() { return Reply.get(); }
+    };
+
+    // reply to a command started with one of the CRigelDome *Async calls
+    CommandAwaiter command(std::future<int> &&Reply) { return CommandAwaiter{this, std::move(Reply)}; }
+
+    // RD_OK once the is*Complete call says so, its error if it fails, RD_TIMEOUT after nTimeoutMs
+    WaitAwaiter complete(int (CRigelDome::*pfnIsComplete)(bool &), int nTimeoutMs)
+    {
+        CRigelDome *pDome = &m_Dome;
+        Waiter Wait;
+
+        Wait.fnReady = [pDome, pfnIsComplete](int &nResult) {
+            CRigelDome::CStatusNoWait NoWait;
+            bool bComplete = false;
+
+            // RD_STATUS_PENDING : no fresh snapshot yet, the poller was asked for one, see checkWaiters
+            nResult = (pDome->*pfnIsComplete)(bComplete);
+            return (nResult != RD_OK && nResult != RD_STATUS_PENDING) || bComplete;
+        };
+        Wait.bPolled = true;
+        Wait.tNextCheck = Clock::now();
+        Wait.tDeadline = Clock::now() + std::chrono::milliseconds(nTimeoutMs);
+        Wait.nDeadlineResult = RD_TIMEOUT;
+        return WaitAwaiter{this, Wait, RD_OK};
+    }
+
+    WaitAwaiter gotoComplete(int nTimeoutMs = SEQUENCE_MOTION_TIMEOUT) { return complete(&CRigelDome::isGoToComplete, nTimeoutMs); }
+    WaitAwaiter parkComplete(int nTimeoutMs = SEQUENCE_MOTION_TIMEOUT) { return complete(&CRigelDome::isParkComplete, nTimeoutMs); }
+    WaitAwaiter unparkComplete(int nTimeoutMs = SEQUENCE_MOTION_TIMEOUT) { return complete(&CRigelDome::isUnparkComplete, nTimeoutMs); }
+    WaitAwaiter findHomeComplete(int nTimeoutMs = SEQUENCE_MOTION_TIMEOUT) { return complete(&CRigelDome::isFindHomeComplete, nTimeoutMs); }
+    WaitAwaiter calibratingComplete(int nTimeoutMs = SEQUENCE_MOTION_TIMEOUT) { return complete(&CRigelDome::isCalibratingComplete, nTimeoutMs); }
+    WaitAwaiter openComplete(int nTimeoutMs = SEQUENCE_SHUTTER_TIMEOUT) { return complete(&CRigelDome::isOpenComplete, nTimeoutMs); }
+    WaitAwaiter closeComplete(int nTimeoutMs = SEQUENCE_SHUTTER_TIMEOUT) { return complete(&CRigelDome::isCloseComplete, nTimeoutMs); }
+
+    WaitAwaiter delay(int nMs)
+    {
+        Waiter Wait;
+
+        Wait.bPolled = false;
+        Wait.tNextCheck = Clock::time_point::max();
+        Wait.tDeadline = Clock::now() + std::chrono::milliseconds(nMs);
+        Wait.nDeadlineResult = RD_OK;
+        return WaitAwaiter{this, Wait, RD_OK};
+    }
+
+    CRigelDome &dome() { return m_Dome; }
+
+private:
+    struct TopTask {
+        CDomeTask           Task;
+        std::promise<int>   Result;
+    };
+
+    void wake()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bWoken = true;
+        }
+        m_Cond.notify_one();
+    }
+
+    void stateChanged()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_bStateChanged = true;
+            m_bWoken = true;
+        }
+        m_Cond.notify_one();
+    }
+
+    Clock::time_point nextWakeUp()
+    {
+        Clock::time_point tNext = Clock::time_point::max();
+
+        for(const Waiter &Wait : m_Waiters) {
+            if(Wait.bPolled)
+                tNext = std::min(tNext, Wait.tNextCheck);
+            tNext = std::min(tNext, Wait.tDeadline);
+        }
+        return tNext;
+    }
+
+    // resume what's ready, coroutines resumed here can add new waiters, they're checked on the next pass
+    void checkWaiters(bool bStateChanged)
+    {
+        std::vector<Waiter> Pending;
+        std::vector<Waiter> Ready;
+        Clock::time_point tNow = Clock::now();
+        int nResult;
+
+        Pending.swap(m_Waiters);
+        for(Waiter &Wait : Pending) {
+            nResult = RD_OK;
+            if(Wait.fnReady && (!Wait.bPolled || bStateChanged || tNow >= Wait.tNextCheck)) {
+                if(Wait.fnReady(nResult)) {
+                    if(Wait.pnResult)
+                        *Wait.pnResult = nResult;
+                    Ready.push_back(Wait);
+                    continue;
+                }
+                // a snapshot that shows no change has no event to wake us up
+                Wait.tNextCheck = tNow + std::chrono::milliseconds(nResult == RD_STATUS_PENDING ? SEQUENCE_PENDING_RECHECK : m_nPollMs);
+            }
+            if(tNow >= Wait.tDeadline) {
+                if(Wait.pnResult)
+                    *Wait.pnResult = Wait.nDeadlineResult;
+                Ready.push_back(Wait);
+                continue;
+            }
+            m_Waiters.push_back(Wait);
+        }
+        for(Waiter &Wait : Ready)
+            Wait.hTask.resume();
+    }
+
+    void reapTasks()
+    {
+        std::list<TopTask>::iterator it = m_Tasks.begin();
+
+        while(it != m_Tasks.end()) {
+            if(it->Task.done()) {
+                it->Result.set_value(it->Task.result());
+                it = m_Tasks.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    void loop()
+    {
+        std::list<TopTask> Started;
+        std::list<TopTask>::iterator it;
+        Clock::time_point tNext;
+        bool bStateChanged;
+
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                tNext = nextWakeUp();
+                auto bWork = [&] { return !m_Started.empty() || m_bWoken || !m_bRunning; };
+                if(tNext == Clock::time_point::max())
+                    m_Cond.wait(lock, bWork);
+                else
+                    m_Cond.wait_until(lock, tNext, bWork);
+                if(!m_bRunning)
+                    break;
+                Started.splice(Started.end(), m_Started);
+                m_bWoken = false;
+                bStateChanged = m_bStateChanged;
+                m_bStateChanged = false;
+            }
+
+            while(!Started.empty()) {
+                it = Started.begin();
+                m_Tasks.splice(m_Tasks.end(), Started, it);
+                it->Task.handle().resume();
+            }
+            checkWaiters(bStateChanged);
+            reapTasks();
+        }
+    }
+
+    CRigelDome                  &m_Dome;
+    int                         m_nPollMs;
+    std::thread                 m_Thread;
+    std::mutex                  m_Mutex;
+    std::condition_variable     m_Cond;
+    bool                        m_bRunning;
+    bool                        m_bWoken;
+    bool                        m_bStateChanged;    // m_Mutex, a motor or shutter event since the last pass
+    int                         m_nSubscription;
+    std::list<TopTask>          m_Started;      // m_Mutex
+    std::list<TopTask>          m_Tasks;        // loop thread
+    std::vector<Waiter>         m_Waiters;      // loop thread
+};
+
+#pragma mark - sequences
+
+// what dapiPark starts and dapiIsParkComplete polls, in one task
+inline CDomeTask nightEndSequence(CDomeSequencer &Seq)
+{
+    CRigelDome &Dome = Seq.dome();
+    int nErr;
+
+    if(Dome.hasShutterUnit()) {
+        nErr = co_await Seq.command(Dome.closeShutterAsync());
+        if(nErr == RD_OK)
+            nErr = co_await Seq.closeComplete();
+        if(nErr)
+            co_return nErr;
+    }
+    nErr = co_await Seq.command(Dome.parkDomeAsync());
+    if(nErr == RD_OK)
+        nErr = co_await Seq.parkComplete();
+    co_return nErr;
+}
+
+// unpark, then open the shutter once the dome has stopped
+inline CDomeTask nightStartSequence(CDomeSequencer &Seq)
+{
+    CRigelDome &Dome = Seq.dome();
+    int nErr;
+
+    nErr = co_await Seq.command(Dome.unparkDomeAsync());
+    if(nErr == RD_OK)
+        nErr = co_await Seq.unparkComplete();
+    if(nErr || !Dome.hasShutterUnit())
+        co_return nErr;
+    nErr = co_await Seq.command(Dome.openShutterAsync());
+    if(nErr == RD_OK)
+        nErr = co_await Seq.openComplete();
+    co_return nErr;
+}
+
+#endif
+#endif
@@ -0,0 +1,506 @@
+//
+//  rigeltransport.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+
+#include "rigeltransport.h"
+
+#include <string.h>
+
+#if defined(SB_LINUX_BUILD) || defined(SB_MAC_BUILD)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#ifdef SB_LINUX_BUILD
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <chrono>
+#endif
+
+#pragma mark - SerX transport
+
+int CSerXTransport::open(const char *pszPort)
+{
+    if(!m_pSerx)
+        return ERR_COMMNOLINK;
+
+    // 115200 8N1
+    if(m_pSerx->open(pszPort, RIGEL_BAUDRATE, SerXInterface::B_NOPARITY, "-DTR_CONTROL 1"))
+        return ERR_COMMNOLINK;
+
+    return SB_OK;
+}
+
+void CSerXTransport::close()
+{
+    if(m_pSerx)
+        m_pSerx->close();
+}
+
+bool CSerXTransport::isOpen()
+{
+    return m_pSerx && m_pSerx->isConnected();
+}
+
+int CSerXTransport::write(const char *pData, unsigned long ulLen)
+{
+    unsigned long ulBytesWrite = 0;
+    int nErr;
+
+    nErr = m_pSerx->writeFile((void *)pData, ulLen, ulBytesWrite);
+    if(nErr)
+        return nErr;
+    if(ulBytesWrite != ulLen)
+        return ERR_CMDFAILED;
+    return SB_OK;
+}
+
+int CSerXTransport::read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs)
+{
+    int nBytesWaiting = 0;
+    int nErr;
+
+    // read everything that is already there in one go, if nothing is there yet block for the first byte.
+    nErr = m_pSerx->bytesWaitingRx(nBytesWaiting);
+    if(nErr || nBytesWaiting <= 0)
+        nBytesWaiting = 1;
+    if((unsigned long)nBytesWaiting < ulLen)
+        ulLen = (unsigned long)nBytesWaiting;
+
+    ulRead = 0;
+    return m_pSerx->readFile(pBuffer, ulLen, ulRead, (unsigned long)nTimeoutMs);
+}
+
+int CSerXTransport::purge()
+{
+    return m_pSerx->purgeTxRx();
+}
+
+#ifdef SB_LINUX_BUILD
+#pragma mark - native Linux serial transport
+
+CPosixSerialTransport::CPosixSerialTransport()
+{
+    m_nFd = -1;
+    m_nEpollFd = -1;
+}
+
+CPosixSerialTransport::~CPosixSerialTransport()
+{
+    close();
+}
+
+int CPosixSerialTransport::open(const char *pszPort)
+{
+    struct termios Tio;
+    struct epoll_event Event;
+    int nModemBits = TIOCM_DTR;
+
+    close();
+
+    m_nFd = ::open(pszPort, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+
+    // raw 115200 8N1, no flow control
+    if(tcgetattr(m_nFd, &Tio)) {
+        close();
+        return ERR_COMMNOLINK;
+    }
+    cfmakeraw(&Tio);
+    cfsetispeed(&Tio, B115200);
+    cfsetospeed(&Tio, B115200);
+    Tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    Tio.c_cflag |= CLOCAL | CREAD;
+    // the fd is non blocking and we wait in epoll, so a read returns whatever the driver has right away
+    Tio.c_cc[VMIN] = 0;
+    Tio.c_cc[VTIME] = 0;
+    if(tcsetattr(m_nFd, TCSANOW, &Tio)) {
+        close();
+        return ERR_COMMNOLINK;
+    }
+    // same as the SerX "-DTR_CONTROL 1"
+    ioctl(m_nFd, TIOCMBIS, &nModemBits);
+
+    m_sPort = pszPort;
+    setLowLatency();
+    setFtdiLatencyTimer();
+
+    m_nEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(m_nEpollFd < 0) {
+        close();
+        return ERR_COMMNOLINK;
+    }
+    memset(&Event, 0, sizeof(Event));
+    Event.events = EPOLLIN;
+    Event.data.fd = m_nFd;
+    if(epoll_ctl(m_nEpollFd, EPOLL_CTL_ADD, m_nFd, &Event)) {
+        close();
+        return ERR_COMMNOLINK;
+    }
+
+    tcflush(m_nFd, TCIOFLUSH);
+    return SB_OK;
+}
+
+void CPosixSerialTransport::close()
+{
+    if(m_nEpollFd >= 0)
+        ::close(m_nEpollFd);
+    if(m_nFd >= 0)
+        ::close(m_nFd);
+    m_nEpollFd = -1;
+    m_nFd = -1;
+}
+
+// ask the tty driver to push received bytes to us right away instead of batching them.
+// Not all drivers support it, that's fine.
+void CPosixSerialTransport::setLowLatency()
+{
+    struct serial_struct Serial;
+
+    if(ioctl(m_nFd, TIOCGSERIAL, &Serial))
+        return;
+    Serial.flags |= ASYNC_LOW_LATENCY;
+    ioctl(m_nFd, TIOCSSERIAL, &Serial);
+}
+
+// FTDI adapters hold received bytes up to latency_timer ms (16 by default) before sending them
+// over USB. Set it to 1 ms when we're allowed to, it's per adapter and survives until unplugged.
+void CPosixSerialTransport::setFtdiLatencyTimer()
+{
+    char szDevice[PATH_MAX];
+    char szSysfsPath[PATH_MAX + 64];
+    const char *pszName;
+    FILE *pFile;
+
+    if(!realpath(m_sPort.c_str(), szDevice))
+        return;
+    pszName = strrchr(szDevice, '/');
+    pszName = pszName ? pszName + 1 : szDevice;
+
+    snprintf(szSysfsPath, sizeof(szSysfsPath), "/sys/bus/usb-serial/devices/%s/latency_timer", pszName);
+    pFile = fopen(szSysfsPath, "w");
+    if(!pFile)
+        return;
+    fputs("1", pFile);
+    fclose(pFile);
+}
+
+int CPosixSerialTransport::write(const char *pData, unsigned long ulLen)
+{
+    struct pollfd Poll;
+    ssize_t nWritten;
+
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+
+    while(ulLen) {
+        nWritten = ::write(m_nFd, pData, ulLen);
+        if(nWritten > 0) {
+            pData += nWritten;
+            ulLen -= (unsigned long)nWritten;
+            continue;
+        }
+        if(nWritten < 0 && errno == EINTR)
+            continue;
+        if(nWritten < 0 && errno != EAGAIN)
+            return ERR_COMMNOLINK;
+        // output buffer full, our commands are short so this is rare
+        Poll.fd = m_nFd;
+        Poll.events = POLLOUT;
+        if(poll(&Poll, 1, 1000) <= 0)
+            return ERR_CMDFAILED;
+    }
+    return SB_OK;
+}
+
+int CPosixSerialTransport::read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs)
+{
+    std::chrono::steady_clock::time_point tDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(nTimeoutMs);
+    struct epoll_event Event;
+    ssize_t nRead;
+    int nReady;
+    int nWaitMs;
+    bool bReadable = false;
+
+    ulRead = 0;
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+
+    while(true) {
+        nRead = ::read(m_nFd, pBuffer, ulLen);
+        if(nRead > 0) {
+            ulRead = (unsigned long)nRead;
+            return SB_OK;
+        }
+        if(nRead < 0 && errno == EINTR)
+            continue;
+        if(nRead < 0 && errno != EAGAIN)
+            return ERR_COMMNOLINK;
+        // with VMIN 0 an empty read is no data, unless epoll just said there was some : the tty hung up
+        if(nRead == 0 && bReadable)
+            return ERR_COMMNOLINK;
+
+        // nothing there yet, wait for the driver to tell us there is, until the caller's deadline
+        nWaitMs = (int)std::chrono::ceil<std::chrono::milliseconds>(tDeadline - std::chrono::steady_clock::now()).count();
+        if(nWaitMs <= 0)
+            return SB_OK;   // timeout
+        nReady = epoll_wait(m_nEpollFd, &Event, 1, nWaitMs);
+        if(nReady < 0 && errno == EINTR)
+            continue;
+        if(nReady < 0)
+            return ERR_COMMNOLINK;
+        if(nReady == 0)
+            return SB_OK;   // timeout
+        // adapter unplugged or port gone
+        if(Event.events & (EPOLLERR | EPOLLHUP))
+            return ERR_COMMNOLINK;
+        bReadable = true;
+    }
+}
+
+int CPosixSerialTransport::purge()
+{
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+    tcflush(m_nFd, TCIOFLUSH);
+    return SB_OK;
+}
+#endif
+
+#if defined(SB_LINUX_BUILD) || defined(SB_MAC_BUILD)
+#pragma mark - TCP transport
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // macOS, SO_NOSIGPIPE is set on the socket instead
+#endif
+
+CTcpTransport::CTcpTransport()
+{
+    m_nFd = -1;
+    m_bOpen = false;
+    m_nReconnects = 0;
+}
+
+CTcpTransport::~CTcpTransport()
+{
+    close();
+}
+
+int CTcpTransport::open(const char *pszPort)
+{
+    const char *pszColon;
+    int nErr;
+
+    close();
+
+    pszColon = strrchr(pszPort, ':');
+    if(!pszColon || pszColon == pszPort || !pszColon[1])
+        return ERR_COMMNOLINK;
+
+    m_sHost.assign(pszPort, pszColon - pszPort);
+    m_sPort = pszColon + 1;
+    m_nReconnects = 0;
+
+    nErr = connectSocket();
+    if(nErr)
+        return nErr;
+
+    m_bOpen = true;
+    return SB_OK;
+}
+
+void CTcpTransport::close()
+{
+    closeSocket();
+    m_bOpen = false;
+}
+
+void CTcpTransport::closeSocket()
+{
+    if(m_nFd >= 0)
+        ::close(m_nFd);
+    m_nFd = -1;
+}
+
+int CTcpTransport::connectSocket()
+{
+    struct addrinfo Hints;
+    struct addrinfo *pResults = NULL;
+    struct addrinfo *pAddr;
+    struct pollfd Poll;
+    socklen_t nLen;
+    int nSockErr;
+    int nOn = 1;
+    int nFd = -1;
+
+    memset(&Hints, 0, sizeof(Hints));
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(m_sHost.c_str(), m_sPort.c_str(), &Hints, &pResults) || !pResults)
+        return ERR_COMMNOLINK;
+
+    for(pAddr = pResults; pAddr; pAddr = pAddr->ai_next) {
+        nFd = socket(pAddr->ai_family, pAddr->ai_socktype, pAddr->ai_protocol);
+        if(nFd < 0)
+            continue;
+        fcntl(nFd, F_SETFL, fcntl(nFd, F_GETFL) | O_NONBLOCK);
+        fcntl(nFd, F_SETFD, FD_CLOEXEC);
+
+        // connect with a timeout, an unreachable server would block for minutes otherwise
+        if(connect(nFd, pAddr->ai_addr, pAddr->ai_addrlen) == 0)
+            break;
+        if(errno == EINPROGRESS) {
+            Poll.fd = nFd;
+            Poll.events = POLLOUT;
+            nSockErr = 0;
+            nLen = sizeof(nSockErr);
+            if(poll(&Poll, 1, TCP_CONNECT_TIMEOUT) == 1 &&
+               getsockopt(nFd, SOL_SOCKET, SO_ERROR, &nSockErr, &nLen) == 0 && nSockErr == 0)
+                break;
+        }
+        ::close(nFd);
+        nFd = -1;
+    }
+    freeaddrinfo(pResults);
+    if(nFd < 0)
+        return ERR_COMMNOLINK;
+
+    // commands are a few bytes and we wait for the reply, don't let Nagle hold them back
+    setsockopt(nFd, IPPROTO_TCP, TCP_NODELAY, &nOn, sizeof(nOn));
+    // notice a dead server or a pulled cable even when we're only waiting for replies
+    setsockopt(nFd, SOL_SOCKET, SO_KEEPALIVE, &nOn, sizeof(nOn));
+#ifdef SB_LINUX_BUILD
+    int nValue = TCP_KEEPALIVE_IDLE;
+    setsockopt(nFd, IPPROTO_TCP, TCP_KEEPIDLE, &nValue, sizeof(nValue));
+    nValue = TCP_KEEPALIVE_INTVL;
+    setsockopt(nFd, IPPROTO_TCP, TCP_KEEPINTVL, &nValue, sizeof(nValue));
+    nValue = TCP_KEEPALIVE_CNT;
+    setsockopt(nFd, IPPROTO_TCP, TCP_KEEPCNT, &nValue, sizeof(nValue));
+#else
+    int nValue = TCP_KEEPALIVE_IDLE;
+    setsockopt(nFd, IPPROTO_TCP, TCP_KEEPALIVE, &nValue, sizeof(nValue));
+    setsockopt(nFd, SOL_SOCKET, SO_NOSIGPIPE, &nOn, sizeof(nOn));
+#endif
+
+    m_nFd = nFd;
+    return SB_OK;
+}
+
+int CTcpTransport::write(const char *pData, unsigned long ulLen)
+{
+    struct pollfd Poll;
+    ssize_t nWritten;
+    bool bSentSome = false;
+
+    if(!m_bOpen)
+        return ERR_COMMNOLINK;
+
+    // the server dropped us since the last command, reconnect before sending
+    if(m_nFd < 0) {
+        if(connectSocket())
+            return ERR_COMMNOLINK;
+        m_nReconnects++;
+    }
+
+    while(ulLen) {
+        nWritten = send(m_nFd, pData, ulLen, MSG_NOSIGNAL);
+        if(nWritten > 0) {
+            pData += nWritten;
+            ulLen -= (unsigned long)nWritten;
+            bSentSome = true;
+            continue;
+        }
+        if(nWritten < 0 && errno == EINTR)
+            continue;
+        if(nWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            Poll.fd = m_nFd;
+            Poll.events = POLLOUT;
+            if(poll(&Poll, 1, 1000) <= 0)
+                return ERR_CMDFAILED;
+            continue;
+        }
+        // connection is gone. If none of this command made it out we can send it again on a new one.
+        closeSocket();
+        if(bSentSome || connectSocket())
+            return ERR_COMMNOLINK;
+        m_nReconnects++;
+    }
+    return SB_OK;
+}
+
+int CTcpTransport::read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs)
+{
+    struct pollfd Poll;
+    ssize_t nRead;
+    int nReady;
+
+    ulRead = 0;
+    if(m_nFd < 0)
+        return ERR_COMMNOLINK;
+
+    while(true) {
+        nRead = recv(m_nFd, pBuffer, ulLen, 0);
+        if(nRead > 0) {
+#ifdef SB_LINUX_BUILD
+            // most servers don't disable Nagle on their side, so their next reply waits for our ack.
+            // Quick ack doesn't stick, it has to be set again after every read.
+            int nOn = 1;
+            setsockopt(m_nFd, IPPROTO_TCP, TCP_QUICKACK, &nOn, sizeof(nOn));
+#endif
+            ulRead = (unsigned long)nRead;
+            return SB_OK;
+        }
+        if(nRead < 0 && errno == EINTR)
+            continue;
+        if(nRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            // closed by the server, the next write reconnects
+            closeSocket();
+            return ERR_COMMNOLINK;
+        }
+
+        Poll.fd = m_nFd;
+        Poll.events = POLLIN;
+        nReady = poll(&Poll, 1, nTimeoutMs);
+        if(nReady < 0 && errno == EINTR)
+            continue;
+        if(nReady < 0)
+            return ERR_COMMNOLINK;
+        if(nReady == 0)
+            return SB_OK;   // timeout
+        nTimeoutMs = 0;
+    }
+}
+
+// we can only drop what already made it to us, whatever the server still buffers will come
+// in later and be dealt with by the reply framing check.
+int CTcpTransport::purge()
+{
+    char cScratch[256];
+    ssize_t nRead;
+
+    if(m_nFd < 0)
+        return SB_OK;
+
+    do {
+        nRead = recv(m_nFd, cScratch, sizeof(cScratch), 0);
+    } while(nRead > 0);
+
+    if(nRead == 0)
+        closeSocket();
+    return SB_OK;
+}
+#endif
@@ -0,0 +1,115 @@
+//
+//  rigeltransport.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Byte transports used by CRigelDome to talk to the dome controller.
+//  CSerXTransport goes through the TheSkyX serial port interface, CPosixSerialTransport
+//  opens the tty itself (Linux only) so it can tune the port for low latency and
+//  CTcpTransport talks to a serial to Ethernet server (ser2net, Moxa, ...) directly (Linux and macOS).
+
+#ifndef __RIGEL_TRANSPORT__
+#define __RIGEL_TRANSPORT__
+
+#include <string>
+
+#include "../../licensedinterfaces/sberrorx.h"
+#include "../../licensedinterfaces/serxinterface.h"
+
+#define RIGEL_BAUDRATE 115200
+
+#define TCP_CONNECT_TIMEOUT 3000    // ms
+#define TCP_KEEPALIVE_IDLE  10      // s
+#define TCP_KEEPALIVE_INTVL 5       // s
+#define TCP_KEEPALIVE_CNT   3
+
+enum RigelTransports {TRANSPORT_SERX=0, TRANSPORT_NATIVE_SERIAL, TRANSPORT_TCP, TRANSPORT_EXTERNAL, NB_TRANSPORTS};
+
+class CRigelTransport
+{
+public:
+    virtual ~CRigelTransport() {}
+
+    virtual int     open(const char *pszPort) = 0;
+    virtual void    close() = 0;
+    virtual bool    isOpen() = 0;
+    // write everything or fail
+    virtual int     write(const char *pData, unsigned long ulLen) = 0;
+    // wait up to nTimeoutMs for data then return what is there, up to ulLen bytes. ulRead is 0 on timeout.
+    virtual int     read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs) = 0;
+    // drop anything not read or not sent yet
+    virtual int     purge() = 0;
+};
+
+class CSerXTransport : public CRigelTransport
+{
+public:
+    CSerXTransport() : m_pSerx(NULL) {}
+
+    void    setSerx(SerXInterface *pSerx) { m_pSerx = pSerx; }
+
+    int     open(const char *pszPort);
+    void    close();
+    bool    isOpen();
+    int     write(const char *pData, unsigned long ulLen);
+    int     read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs);
+    int     purge();
+
+private:
+    SerXInterface   *m_pSerx;
+};
+
+#ifdef SB_LINUX_BUILD
+class CPosixSerialTransport : public CRigelTransport
+{
+public:
+    CPosixSerialTransport();
+    ~CPosixSerialTransport();
+
+    int     open(const char *pszPort);
+    void    close();
+    bool    isOpen() { return m_nFd >= 0; }
+    int     write(const char *pData, unsigned long ulLen);
+    int     read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs);
+    int     purge();
+
+private:
+    void    setLowLatency();
+    void    setFtdiLatencyTimer();
+
+    int         m_nFd;
+    int         m_nEpollFd;
+    std::string m_sPort;
+};
+#endif
+
+#if defined(SB_LINUX_BUILD) || defined(SB_MAC_BUILD)
+// the port name is "host:port". The connection stays up between commands and is
+// re-established on the next write if the server drops it.
+class CTcpTransport : public CRigelTransport
+{
+public:
+    CTcpTransport();
+    ~CTcpTransport();
+
+    int     open(const char *pszPort);
+    void    close();
+    bool    isOpen() { return m_bOpen; }
+    int     write(const char *pData, unsigned long ulLen);
+    int     read(char *pBuffer, unsigned long ulLen, unsigned long &ulRead, int nTimeoutMs);
+    int     purge();
+
+    unsigned long   getReconnects() { return m_nReconnects; }
+
+private:
+    int     connectSocket();
+    void    closeSocket();
+
+    int             m_nFd;
+    bool            m_bOpen;
+    std::string     m_sHost;
+    std::string     m_sPort;
+    unsigned long   m_nReconnects;
+};
+#endif
+
+#endif
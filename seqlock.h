@@ -0,0 +1,77 @@
+//
+//  seqlock.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Sequence lock used to publish the dome status snapshot.
+//  One writer at a time (serialized by the caller), any number of readers.
+//  Readers never block the writer, they copy again if a write happened while
+//  they were copying. The payload is kept in relaxed atomic words so a torn
+//  copy is detected and thrown away instead of being undefined behavior.
+
+#ifndef __SEQLOCK__
+#define __SEQLOCK__
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+template <typename T>
+class CSeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "CSeqLock payload must be trivially copyable");
+
+public:
+    CSeqLock() : m_nSeq(0)
+    {
+        for(int i = 0; i < NB_WORDS; i++)
+            m_nWords[i].store(0, std::memory_order_relaxed);
+    }
+
+    // writer side, callers must not call this concurrently.
+    void store(const T &Data)
+    {
+        uint64_t nWords[NB_WORDS];
+        unsigned int nSeq;
+
+        memset(nWords, 0, sizeof(nWords));
+        memcpy(nWords, &Data, sizeof(T));
+
+        nSeq = m_nSeq.load(std::memory_order_relaxed);
+        m_nSeq.store(nSeq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for(int i = 0; i < NB_WORDS; i++)
+            m_nWords[i].store(nWords[i], std::memory_order_relaxed);
+        m_nSeq.store(nSeq + 2, std::memory_order_release);
+    }
+
+    // reader side, returns false if nothing was ever stored.
+    bool load(T &Data) const
+    {
+        uint64_t nWords[NB_WORDS];
+        unsigned int nSeqBefore;
+        unsigned int nSeqAfter;
+
+        do {
+            nSeqBefore = m_nSeq.load(std::memory_order_acquire);
+            for(int i = 0; i < NB_WORDS; i++)
+                nWords[i] = m_nWords[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            nSeqAfter = m_nSeq.load(std::memory_order_relaxed);
+        } while((nSeqBefore & 1) || nSeqBefore != nSeqAfter);
+
+        if(!nSeqBefore)
+            return false;
+
+        memcpy(&Data, nWords, sizeof(T));
+        return true;
+    }
+
+private:
+    enum { NB_WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+    std::atomic<unsigned int>   m_nSeq;
+    std::atomic<uint64_t>       m_nWords[NB_WORDS];
+};
+
+#endif
@@ -0,0 +1,203 @@
+//
+//  rigelsim.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Pulsar Rigel dome controller simulator. Opens a pseudo terminal and answers the commands
+//  the driver sends with the firmware's reply format. The dome and the shutter move following
+//  a simple physical model (acceleration, top speed, shutter travel time) and each reply is
+//  delayed by a configurable latency plus jitter, commands going to the shutter over BT
+//  get an extra delay.
+//
+//  make sim && ./sim/rigelsim -L /tmp/rigel
+//  then connect the driver (or anything else) to /tmp/rigel at 115200.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+
+#include "rigelsimmodel.h"
+
+typedef std::chrono::steady_clock Clock;
+
+#define SIM_LINE_MAX        64
+
+static volatile sig_atomic_t g_bRunning = 1;
+
+static void onSignal(int)
+{
+    g_bRunning = 0;
+}
+
+static void usage(const char *pszName)
+{
+    fprintf(stderr,
+            "usage : %s [options]\n"
+            "  -L path   symlink to the pty slave (e.g. /tmp/rigel)\n"
+            "  -l ms     reply latency (default 15)\n"
+            "  -j ms     reply jitter, uniform on top of the latency (default 5)\n"
+            "  -b ms     extra latency for shutter commands over BT (default 100)\n"
+            "  -a deg/s2 dome acceleration (default 2)\n"
+            "  -v deg/s  dome top speed (default 5)\n"
+            "  -t s      shutter full travel time (default 30)\n"
+            "  -x factor run the motion model faster than real time (default 1)\n"
+            "  -e steps  encoder steps per revolution (default 68400)\n"
+            "  -s seed   random seed for the jitter (default 1)\n"
+            "  -n        no shutter fitted\n"
+            "  -d        print the commands and replies\n", pszName);
+}
+
+int main(int argc, char **argv)
+{
+    SimConfig Config = {15.0, 5.0, 100.0, 2.0, 5.0, 30.0, 1.0, 68400, true, false, NULL, 1};
+    struct termios Tio;
+    struct pollfd Poll;
+    std::deque<std::pair<Clock::time_point, std::string> > Replies;
+    std::string sLine;
+    std::string sReply;
+    Clock::time_point tNow;
+    Clock::time_point tLastTick;
+    Clock::time_point tReady;
+    char cBuffer[256];
+    const char *pszSlave;
+    ssize_t nRead;
+    ssize_t i;
+    int nMasterFd;
+    int nSlaveFd;
+    int nTimeout;
+    int nOpt;
+    bool bShutterLink;
+
+    while((nOpt = getopt(argc, argv, "L:l:j:b:a:v:t:x:e:s:ndh")) != -1) {
+        switch(nOpt) {
+            case 'L': Config.pszLink = optarg; break;
+            case 'l': Config.dLatency = atof(optarg); break;
+            case 'j': Config.dJitter = atof(optarg); break;
+            case 'b': Config.dBtLatency = atof(optarg); break;
+            case 'a': Config.dAccel = atof(optarg); break;
+            case 'v': Config.dMaxSpeed = atof(optarg); break;
+            case 't': Config.dShutterTime = atof(optarg); break;
+            case 'x': Config.dTimeScale = atof(optarg); break;
+            case 'e': Config.nEncRev = atoi(optarg); break;
+            case 's': Config.nSeed = (unsigned int)atoi(optarg); break;
+            case 'n': Config.bShutter = false; break;
+            case 'd': Config.bVerbose = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(Config.dAccel <= 0 || Config.dMaxSpeed <= 0 || Config.dShutterTime <= 0 || Config.dTimeScale <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    CRigelSim Sim(Config);
+    std::mt19937 Rng(Config.nSeed);
+    std::uniform_real_distribution<double> Jitter(0.0, Config.dJitter);
+
+    nMasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(nMasterFd < 0 || grantpt(nMasterFd) || unlockpt(nMasterFd)) {
+        fprintf(stderr, "can't open a pseudo terminal : %s\n", strerror(errno));
+        return 1;
+    }
+    tcgetattr(nMasterFd, &Tio);
+    cfmakeraw(&Tio);
+    tcsetattr(nMasterFd, TCSANOW, &Tio);
+    pszSlave = ptsname(nMasterFd);
+
+    // keep the slave open so the master doesn't see a hangup every time the driver disconnects
+    nSlaveFd = open(pszSlave, O_RDWR | O_NOCTTY);
+    if(nSlaveFd >= 0) {
+        tcgetattr(nSlaveFd, &Tio);
+        cfmakeraw(&Tio);
+        tcsetattr(nSlaveFd, TCSANOW, &Tio);
+    }
+
+    if(Config.pszLink) {
+        unlink(Config.pszLink);
+        if(symlink(pszSlave, Config.pszLink)) {
+            fprintf(stderr, "can't create %s : %s\n", Config.pszLink, strerror(errno));
+            return 1;
+        }
+    }
+    printf("Rigel simulator on %s%s%s\n", pszSlave, Config.pszLink ? " -> " : "", Config.pszLink ? Config.pszLink : "");
+    fflush(stdout);
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    tLastTick = Clock::now();
+    while(g_bRunning) {
+        // wake up for the next motion step or the next reply, whichever comes first
+        nTimeout = SIM_TICK;
+        if(!Replies.empty()) {
+            tNow = Clock::now();
+            if(Replies.front().first <= tNow)
+                nTimeout = 0;
+            else
+                nTimeout = std::min(nTimeout, (int)std::chrono::duration_cast<std::chrono::milliseconds>(Replies.front().first - tNow).count() + 1);
+        }
+
+        Poll.fd = nMasterFd;
+        Poll.events = POLLIN;
+        if(poll(&Poll, 1, nTimeout) == 1 && (Poll.revents & POLLIN)) {
+            nRead = read(nMasterFd, cBuffer, sizeof(cBuffer));
+            for(i = 0; i < nRead; i++) {
+                if(cBuffer[i] == '\n')
+                    continue;
+                if(cBuffer[i] != '\r') {
+                    if(sLine.size() < SIM_LINE_MAX)
+                        sLine += cBuffer[i];
+                    continue;
+                }
+                sReply = Sim.command(sLine, bShutterLink);
+                // the controller answers in order, one at a time
+                tNow = Clock::now();
+                tReady = tNow + std::chrono::microseconds((long)((Config.dLatency + Jitter(Rng) + (bShutterLink ? Config.dBtLatency : 0)) * 1000.0));
+                if(!Replies.empty() && Replies.back().first > tNow)
+                    tReady += Replies.back().first - tNow;
+                Replies.push_back(std::make_pair(tReady, sReply + "\r"));
+                if(Config.bVerbose)
+                    printf("> %s\n", sLine.c_str());
+                sLine.clear();
+            }
+        }
+
+        tNow = Clock::now();
+        while(!Replies.empty() && Replies.front().first <= tNow) {
+            if(write(nMasterFd, Replies.front().second.data(), Replies.front().second.size()) < 0)
+                break;
+            if(Config.bVerbose) {
+                Replies.front().second.pop_back();
+                printf("< %s\n", Replies.front().second.c_str());
+            }
+            Replies.pop_front();
+        }
+        if(Config.bVerbose)
+            fflush(stdout);
+
+        while(std::chrono::duration<double, std::milli>(tNow - tLastTick).count() >= SIM_TICK) {
+            Sim.update(SIM_TICK / 1000.0 * Config.dTimeScale);
+            tLastTick += std::chrono::milliseconds(SIM_TICK);
+        }
+    }
+
+    if(Config.pszLink)
+        unlink(Config.pszLink);
+    if(nSlaveFd >= 0)
+        close(nSlaveFd);
+    close(nMasterFd);
+    return 0;
+}
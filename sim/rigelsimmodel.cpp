@@ -0,0 +1,242 @@
+//
+//  rigelsimmodel.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "rigelsimmodel.h"
+
+CRigelSim::CRigelSim(const SimConfig &Config)
+{
+    m_Config = Config;
+    m_dAz = 180.0;
+    m_dSpeed = 0;
+    m_dTarget = 180.0;
+    m_bHasTarget = false;
+    m_bStopping = false;
+    m_nMotorState = SIM_IDLE;
+    m_dCalibrationLeft = 0;
+    m_dHomeAz = 180.0;
+    m_dParkAz = 180.0;
+    m_dShutterPos = 0;
+    m_nShutterState = Config.bShutter ? SIM_CLOSED : SIM_NOT_FITTED;
+    m_bBonded = Config.bShutter;
+    m_dBondDelay = 0;
+}
+
+double CRigelSim::wrap(double dAz)
+{
+    dAz = fmod(dAz, 360.0);
+    if(dAz < 0)
+        dAz += 360.0;
+    return dAz;
+}
+
+double CRigelSim::shortest(double dFrom, double dTo)
+{
+    double dDelta = wrap(dTo - dFrom);
+    return dDelta > 180.0 ? dDelta - 360.0 : dDelta;
+}
+
+void CRigelSim::startMove(double dTarget, int nState)
+{
+    m_dTarget = wrap(dTarget);
+    m_bHasTarget = true;
+    m_bStopping = false;
+    m_nMotorState = nState;
+}
+
+// one step of the model, dDt in seconds
+void CRigelSim::update(double dDt)
+{
+    double dRemaining;
+    double dBrakeDistance;
+    double dDir;
+    double dStep;
+
+    // rotation, trapezoidal profile : accelerate to top speed, brake in time to stop on target
+    if(m_nMotorState == SIM_CALIBRATING) {
+        dDir = 1.0;
+        dRemaining = m_dCalibrationLeft;
+    }
+    else if(m_bHasTarget && !m_bStopping) {
+        dRemaining = shortest(m_dAz, m_dTarget);
+        dDir = dRemaining < 0 ? -1.0 : 1.0;
+        dRemaining = fabs(dRemaining);
+    }
+    else {
+        dDir = m_dSpeed < 0 ? -1.0 : 1.0;
+        dRemaining = 0;
+    }
+
+    dBrakeDistance = (m_dSpeed * m_dSpeed) / (2.0 * m_Config.dAccel);
+    if(m_nMotorState != SIM_IDLE && !m_bStopping && dRemaining > dBrakeDistance && m_dSpeed * dDir >= 0) {
+        m_dSpeed += dDir * m_Config.dAccel * dDt;
+        if(fabs(m_dSpeed) > m_Config.dMaxSpeed)
+            m_dSpeed = dDir * m_Config.dMaxSpeed;
+    }
+    else if(m_dSpeed != 0) {
+        dStep = m_Config.dAccel * dDt;
+        if(fabs(m_dSpeed) <= dStep)
+            m_dSpeed = 0;
+        else
+            m_dSpeed -= (m_dSpeed > 0 ? 1.0 : -1.0) * dStep;
+    }
+
+    dStep = m_dSpeed * dDt;
+    m_dAz = wrap(m_dAz + dStep);
+    if(m_nMotorState == SIM_CALIBRATING)
+        m_dCalibrationLeft -= fabs(dStep);
+
+    if(m_nMotorState != SIM_IDLE) {
+        if(m_bStopping && m_dSpeed == 0) {
+            m_nMotorState = SIM_IDLE;
+            m_bHasTarget = false;
+        }
+        else if(m_nMotorState == SIM_CALIBRATING && m_dCalibrationLeft <= 0 && m_dSpeed == 0) {
+            m_nMotorState = SIM_IDLE;
+        }
+        else if(m_nMotorState != SIM_CALIBRATING && m_bHasTarget &&
+                fabs(shortest(m_dAz, m_dTarget)) < SIM_ON_TARGET && fabs(m_dSpeed) < m_Config.dAccel * dDt * 2) {
+            m_dAz = m_dTarget;
+            m_dSpeed = 0;
+            m_bHasTarget = false;
+            m_nMotorState = SIM_IDLE;
+        }
+    }
+
+    // shutter, constant speed
+    if(m_nShutterState == SIM_OPENING) {
+        m_dShutterPos += dDt / m_Config.dShutterTime;
+        if(m_dShutterPos >= 1.0) {
+            m_dShutterPos = 1.0;
+            m_nShutterState = SIM_OPEN;
+        }
+    }
+    else if(m_nShutterState == SIM_CLOSING) {
+        m_dShutterPos -= dDt / m_Config.dShutterTime;
+        if(m_dShutterPos <= 0) {
+            m_dShutterPos = 0;
+            m_nShutterState = SIM_CLOSED;
+        }
+    }
+
+    if(m_dBondDelay > 0) {
+        m_dBondDelay -= dDt;
+        if(m_dBondDelay <= 0)
+            m_bBonded = true;
+    }
+}
+
+std::string CRigelSim::command(const std::string &sCmd, bool &bShutterLink)
+{
+    char szReply[256];
+    bool bShutterUp = m_Config.bShutter && m_bBonded;
+
+    bShutterLink = false;
+
+    if(sCmd == "ANGLE") {
+        snprintf(szReply, sizeof(szReply), "%3.1f", m_dAz);
+        return szReply;
+    }
+    if(sCmd.compare(0, 8, "ANGLE K ") == 0) {
+        m_dAz = wrap(atof(sCmd.c_str() + 8));
+        return "A";
+    }
+    if(sCmd == "MSTATE") {
+        snprintf(szReply, sizeof(szReply), "%d", m_nMotorState);
+        return szReply;
+    }
+    if(sCmd == "GO H") {
+        startMove(m_dHomeAz, SIM_GOING_HOME);
+        return "A";
+    }
+    if(sCmd == "GO P") {
+        startMove(m_dParkAz, SIM_MOVING_TO_TARGET);
+        return "A";
+    }
+    if(sCmd.compare(0, 3, "GO ") == 0) {
+        startMove(atof(sCmd.c_str() + 3), SIM_MOVING_TO_TARGET);
+        return "A";
+    }
+    if(sCmd == "STOP") {
+        m_bStopping = true;
+        m_dCalibrationLeft = 0;
+        return "A";
+    }
+    if(sCmd == "CALIBRATE") {
+        m_nMotorState = SIM_CALIBRATING;
+        m_bStopping = false;
+        m_bHasTarget = false;
+        m_dCalibrationLeft = 360.0;
+        return "A";
+    }
+    if(sCmd == "HOME ?") {
+        return fabs(shortest(m_dAz, m_dHomeAz)) < SIM_AT_HOME && m_nMotorState == SIM_IDLE ? "1" : "0";
+    }
+    if(sCmd == "HOME") {
+        snprintf(szReply, sizeof(szReply), "%3.1f", m_dHomeAz);
+        return szReply;
+    }
+    if(sCmd.compare(0, 5, "HOME ") == 0) {
+        m_dHomeAz = wrap(atof(sCmd.c_str() + 5));
+        return "A";
+    }
+    if(sCmd == "PARK") {
+        snprintf(szReply, sizeof(szReply), "%3.1f", m_dParkAz);
+        return szReply;
+    }
+    if(sCmd.compare(0, 5, "PARK ") == 0) {
+        m_dParkAz = wrap(atof(sCmd.c_str() + 5));
+        return "A";
+    }
+    if(sCmd == "ENCREV") {
+        snprintf(szReply, sizeof(szReply), "%d", m_Config.nEncRev);
+        return szReply;
+    }
+    if(sCmd == "VER")
+        return "2.3";
+    if(sCmd == "PULSAR")
+        return "Rigel Dome Simulator";
+    if(sCmd == "V") {
+        // az, motor state, 3 unused, shutter state, 7 unused
+        snprintf(szReply, sizeof(szReply), "%3.1f\t%d\t0\t0\t0\t%d\t0\t0\t0\t0\t0\t0\t0",
+                 m_dAz, m_nMotorState, bShutterUp ? m_nShutterState : (m_Config.bShutter ? SIM_UNKNOWN : SIM_NOT_FITTED));
+        return szReply;
+    }
+
+    // everything below goes to the shutter over BT
+    bShutterLink = true;
+    if(sCmd == "SHUTTER") {
+        snprintf(szReply, sizeof(szReply), "%d", bShutterUp ? m_nShutterState : (m_Config.bShutter ? SIM_UNKNOWN : SIM_NOT_FITTED));
+        return szReply;
+    }
+    if(sCmd == "OPEN") {
+        if(bShutterUp && m_nShutterState != SIM_OPEN)
+            m_nShutterState = SIM_OPENING;
+        return "A";
+    }
+    if(sCmd == "CLOSE") {
+        if(bShutterUp && m_nShutterState != SIM_CLOSED)
+            m_nShutterState = SIM_CLOSING;
+        return "A";
+    }
+    if(sCmd == "BAT") {
+        if(!bShutterUp)
+            return "0 0";
+        return "87 12250";
+    }
+    if(sCmd == "BBOND")
+        return m_bBonded ? "1" : "0";
+    if(sCmd == "BBOND 1" || sCmd == "BTFORCE") {
+        if(m_Config.bShutter && !m_bBonded)
+            m_dBondDelay = SIM_BOND_TIME;
+        return "A";
+    }
+
+    bShutterLink = false;
+    return "E";
+}
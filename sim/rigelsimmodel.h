@@ -0,0 +1,74 @@
+//
+//  rigelsimmodel.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Dome and shutter model behind the Rigel simulators. It answers one command line at a time
+//  and moves when update() is called, it has no notion of time or I/O of its own so the
+//  pty simulator can run it in real time and bench_night in virtual time.
+
+#ifndef __RIGEL_SIM_MODEL__
+#define __RIGEL_SIM_MODEL__
+
+#include <string>
+
+// same values as the driver enums
+enum SimShutterState {SIM_OPEN=0, SIM_CLOSED, SIM_OPENING, SIM_CLOSING, SIM_SHUTTER_ERROR, SIM_UNKNOWN, SIM_NOT_FITTED};
+enum SimMotorState {SIM_IDLE=0, SIM_MOVING_TO_TARGET, SIM_CALIBRATING=6, SIM_GOING_HOME=7};
+
+#define SIM_TICK            10      // ms, motion model step
+#define SIM_ON_TARGET       0.05    // deg
+#define SIM_AT_HOME         0.5     // deg
+#define SIM_BOND_TIME       2.0     // s, BT pairing after BBOND 1 / BTFORCE
+
+struct SimConfig {
+    double  dLatency;           // ms
+    double  dJitter;            // ms, uniform 0..dJitter on top of the latency
+    double  dBtLatency;         // ms, extra for commands relayed to the shutter
+    double  dAccel;             // deg/s^2
+    double  dMaxSpeed;          // deg/s
+    double  dShutterTime;       // s, full travel
+    double  dTimeScale;         // > 1 runs the physics faster than real time
+    int     nEncRev;            // steps per revolution
+    bool    bShutter;
+    bool    bVerbose;
+    const char *pszLink;
+    unsigned int nSeed;
+};
+
+class CRigelSim
+{
+public:
+    CRigelSim(const SimConfig &Config);
+
+    void    update(double dDt);
+    double  getAz() { return m_dAz; }
+    int     getMotorState() { return m_nMotorState; }
+    int     getShutterState() { return m_nShutterState; }
+    std::string command(const std::string &sCmd, bool &bShutterLink);
+
+    static double wrap(double dAz);
+    static double shortest(double dFrom, double dTo);
+
+private:
+    void    startMove(double dTarget, int nState);
+
+    SimConfig   m_Config;
+
+    double      m_dAz;
+    double      m_dSpeed;           // deg/s, signed
+    double      m_dTarget;
+    bool        m_bHasTarget;
+    bool        m_bStopping;
+    int         m_nMotorState;
+    double      m_dCalibrationLeft; // deg left to turn while calibrating
+
+    double      m_dHomeAz;
+    double      m_dParkAz;
+
+    double      m_dShutterPos;      // 0 closed, 1 open
+    int         m_nShutterState;
+    bool        m_bBonded;
+    double      m_dBondDelay;
+};
+
+#endif
@@ -0,0 +1,59 @@
+//
+//  spscqueue.h
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Bounded lock free queue, one producer thread and one consumer thread.
+//  Each index is only written by one side, the other side reads it with acquire so
+//  it sees the slot contents that were written before the index moved.
+//  Used to hand exchanges to the I/O thread, the link owner is the only producer.
+
+#ifndef __SPSC_QUEUE__
+#define __SPSC_QUEUE__
+
+#include <atomic>
+
+template <typename T, unsigned int N>
+class CSpscQueue
+{
+    static_assert(N && !(N & (N - 1)), "CSpscQueue size must be a power of 2");
+
+public:
+    CSpscQueue() : m_nHead(0), m_nTail(0) {}
+
+    // producer side, false if the queue is full
+    bool push(const T &Item)
+    {
+        unsigned int nHead = m_nHead.load(std::memory_order_relaxed);
+
+        if(nHead - m_nTail.load(std::memory_order_acquire) == N)
+            return false;
+        m_Items[nHead & (N - 1)] = Item;
+        m_nHead.store(nHead + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side, false if the queue is empty
+    bool pop(T &Item)
+    {
+        unsigned int nTail = m_nTail.load(std::memory_order_relaxed);
+
+        if(nTail == m_nHead.load(std::memory_order_acquire))
+            return false;
+        Item = m_Items[nTail & (N - 1)];
+        m_nTail.store(nTail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const
+    {
+        return m_nTail.load(std::memory_order_acquire) == m_nHead.load(std::memory_order_acquire);
+    }
+
+private:
+    T                           m_Items[N];
+    // on their own cache lines so the two sides don't bounce each other's line
+    alignas(64) std::atomic<unsigned int>   m_nHead;    // producer
+    alignas(64) std::atomic<unsigned int>   m_nTail;    // consumer
+};
+
+#endif
@@ -37,6 +37,12 @@ X2Dome::X2Dome(const char* pszSelection,
 	m_bLinked = false;
     m_bCalibratingDome = false;
     m_bBattRequest = 0;
+
+    m_bBackgroundPolling = false;
+    m_nPollInterval = DEFAULT_POLL_INTERVAL;
+    m_nPollIdleInterval = DEFAULT_POLL_IDLE_INTERVAL;
+    m_nPollIdleMax = DEFAULT_POLL_IDLE_MAX;
+    m_nMaxStatusAge = DEFAULT_MAX_STATUS_AGE;
     
     m_RigelDome.SetSerxPointer(pSerX);
     m_RigelDome.setLogger(pLogger);
@@ -46,7 +52,22 @@ X2Dome::X2Dome(const char* pszSelection,
         m_RigelDome.setDebugLog( m_bShutterEventLog );
         m_RigelDome.setHomeAz( m_pIniUtil->readDouble(PARENT_KEY, CHILD_KEY_HOME_AZ, 180) );
         m_RigelDome.setParkAz( m_pIniUtil->readDouble(PARENT_KEY, CHILD_KEY_PARK_AZ, 180) );
+        m_bBackgroundPolling = m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_POLLING, 0);
+        m_nPollInterval = m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_POLL_INTERVAL, DEFAULT_POLL_INTERVAL);
+        m_nPollIdleInterval = m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_POLL_IDLE_INTERVAL, DEFAULT_POLL_IDLE_INTERVAL);
+        m_nPollIdleMax = m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_POLL_IDLE_MAX, DEFAULT_POLL_IDLE_MAX);
+        m_nMaxStatusAge = m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_MAX_STATUS_AGE, DEFAULT_MAX_STATUS_AGE);
+        // no UI for this one, 0 turns query coalescing off
+        m_RigelDome.setCoalesceWindow( m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_COALESCE_WINDOW, DEFAULT_COALESCE_WINDOW) );
+        // no UI either, 1 opens the tty directly instead of going through TheSkyX (Linux only),
+        // 2 connects to NetworkAddress (host:port of a serial to Ethernet server, Linux and macOS)
+        m_RigelDome.setTransport( m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_TRANSPORT, TRANSPORT_SERX) );
+        // no UI, serial exchanges on their own thread, optionally SCHED_FIFO and pinned to a core (Linux)
+        m_RigelDome.setIoThread( m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_IO_THREAD, 0) != 0,
+                                 m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_IO_PRIORITY, DEFAULT_IO_PRIORITY),
+                                 m_pIniUtil->readInt(PARENT_KEY, CHILD_KEY_IO_CPU, DEFAULT_IO_CPU) );
     }
+    m_RigelDome.setPolling(m_bBackgroundPolling, m_nPollInterval, m_nPollIdleInterval, m_nPollIdleMax, m_nMaxStatusAge);
 }
 
 
@@ -76,8 +97,11 @@ int X2Dome::establishLink(void)
     char szPort[DRIVER_MAX_STRING];
 
     X2MutexLocker ml(GetMutex());
-    // get serial port device name
-    portNameOnToCharPtr(szPort,DRIVER_MAX_STRING);
+    // get serial port device name, or the server address when going over TCP
+    if(m_RigelDome.getTransport() == TRANSPORT_TCP && m_pIniUtil)
+        m_pIniUtil->readString(PARENT_KEY, CHILD_KEY_NETWORK_ADDRESS, "", szPort, DRIVER_MAX_STRING);
+    else
+        portNameOnToCharPtr(szPort,DRIVER_MAX_STRING);
     nErr = m_RigelDome.Connect(szPort);
     if(nErr)
         m_bLinked = false;
@@ -186,22 +210,35 @@ int X2Dome::execModalSettingsDialog()
     dx->setPropertyDouble("homePosition","value", m_RigelDome.getHomeAz());
     dx->setPropertyDouble("parkPosition","value", m_RigelDome.getParkAz());
 
+    dx->setChecked("backgroundPolling", m_bBackgroundPolling);
+    dx->setPropertyInt("pollInterval", "value", m_nPollInterval);
+    dx->setPropertyInt("pollIdleInterval", "value", m_nPollIdleInterval);
+    dx->setPropertyInt("pollIdleMax", "value", m_nPollIdleMax);
+    dx->setPropertyInt("maxStatusAge", "value", m_nMaxStatusAge);
+
     m_bBattRequest = 0;
     m_bCalibratingDome = false;
     
-    X2MutexLocker ml(GetMutex());
-
     //Display the user interface
+    // no X2 mutex while the dialog is up, uiEvent takes it around each dome call
     if ((nErr = ui->exec(bPressedOK)))
         return nErr;
 
     //Retreive values from the user interface
     if (bPressedOK)
     {
+        X2MutexLocker ml(GetMutex());
+
         dx->propertyDouble("homePosition", "value", dHomeAz);
         dx->propertyDouble("parkPosition", "value", dParkAz);
         m_bShutterEventLog = dx->isChecked("enableEventLog");
         m_RigelDome.setDebugLog(m_bShutterEventLog);
+        m_bBackgroundPolling = dx->isChecked("backgroundPolling");
+        dx->propertyInt("pollInterval", "value", m_nPollInterval);
+        dx->propertyInt("pollIdleInterval", "value", m_nPollIdleInterval);
+        dx->propertyInt("pollIdleMax", "value", m_nPollIdleMax);
+        dx->propertyInt("maxStatusAge", "value", m_nMaxStatusAge);
+        m_RigelDome.setPolling(m_bBackgroundPolling, m_nPollInterval, m_nPollIdleInterval, m_nPollIdleMax, m_nMaxStatusAge);
         if(m_bLinked)
         {
             m_RigelDome.setHomeAz(dHomeAz);
@@ -212,6 +249,11 @@ int X2Dome::execModalSettingsDialog()
         nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_LOG_EVENT, m_bShutterEventLog);
         nErr |= m_pIniUtil->writeDouble(PARENT_KEY, CHILD_KEY_HOME_AZ, dHomeAz);
         nErr |= m_pIniUtil->writeDouble(PARENT_KEY, CHILD_KEY_PARK_AZ, dParkAz);
+        nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_POLLING, m_bBackgroundPolling);
+        nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_POLL_INTERVAL, m_nPollInterval);
+        nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_POLL_IDLE_INTERVAL, m_nPollIdleInterval);
+        nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_POLL_IDLE_MAX, m_nPollIdleMax);
+        nErr |= m_pIniUtil->writeInt(PARENT_KEY, CHILD_KEY_MAX_STATUS_AGE, m_nMaxStatusAge);
     }
     return nErr;
 
@@ -226,8 +268,10 @@ void X2Dome::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
     char szTmpBuf[SERIAL_BUFFER_SIZE];
     char szErrorMessage[LOG_BUFFER_SIZE];
     
-    if (!strcmp(pszEvent, "on_pushButtonCancel_clicked"))
+    if (!strcmp(pszEvent, "on_pushButtonCancel_clicked")) {
+        X2MutexLocker ml(GetMutex());
         m_RigelDome.abortCurrentCommand();
+    }
 
     if (!strcmp(pszEvent, "on_timer"))
     {
@@ -235,7 +279,10 @@ void X2Dome::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
             if(m_bCalibratingDome) {
                 // are we still calibrating ?
                 bComplete = false;
-                nErr = m_RigelDome.isCalibratingComplete(bComplete);
+                {
+                    X2MutexLocker ml(GetMutex());
+                    nErr = m_RigelDome.isCalibratingComplete(bComplete);
+                }
                 if(nErr) {
                     uiex->setEnabled("pushButton",true);
                     uiex->setEnabled("pushButtonOK",true);
@@ -253,7 +300,10 @@ void X2Dome::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
                 uiex->setEnabled("pushButton",true);
                 uiex->setEnabled("pushButtonOK",true);
                 // read step per rev from dome
-                snprintf(szTmpBuf,16,"%d",m_RigelDome.getNbTicksPerRev());
+                {
+                    X2MutexLocker ml(GetMutex());
+                    snprintf(szTmpBuf,16,"%d",m_RigelDome.getNbTicksPerRev());
+                }
                 uiex->setPropertyString("ticksPerRev","text", szTmpBuf);
                 m_bCalibratingDome = false;
                 
@@ -263,7 +313,10 @@ void X2Dome::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
                 // don't ask to often
                 if (!(m_bBattRequest%4)) {
                     if(m_bHasShutterControl) {
-                        m_RigelDome.getBatteryLevels(dShutterBattery, nShutterBatteryPercent);
+                        {
+                            X2MutexLocker ml(GetMutex());
+                            m_RigelDome.getBatteryLevels(dShutterBattery, nShutterBatteryPercent);
+                        }
                         snprintf(szTmpBuf,16,"%d%% ( %3.2f V )",nShutterBatteryPercent, dShutterBattery);
                         uiex->setPropertyString("shutterBatteryLevel","text", szTmpBuf);
                     }
@@ -285,6 +338,7 @@ void X2Dome::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
             // disable "ok" and "calibrate"
             uiex->setEnabled("pushButton",false);
             uiex->setEnabled("pushButtonOK",false);
+            X2MutexLocker ml(GetMutex());
             m_RigelDome.calibrate();
             m_bCalibratingDome = true;
         }
@@ -293,6 +347,7 @@ void X2Dome::uiEvent(X2GUIExchangeInterface* uiex, const char* pszEvent)
     if (!strcmp(pszEvent, "on_pushButton_2_clicked"))
     {
         if(m_bLinked) {
+            X2MutexLocker ml(GetMutex());
             m_RigelDome.btForce();
         }
     }
@@ -362,15 +417,18 @@ double	X2Dome::driverInfoVersion(void) const
 //
 #pragma mark - DomeDriverInterface
 
+// Position and is*Complete calls don't take the X2 mutex. CRigelDome serves them from its status
+// snapshot and only locks the serial link itself when the snapshot is too old, so they never wait
+// behind a command or the settings dialog. Commands still serialize on the X2 mutex.
+
 int X2Dome::dapiGetAzEl(double* pdAz, double* pdEl)
 {
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
 
-    *pdAz = m_RigelDome.getCurrentAz();
-    *pdEl = m_RigelDome.getCurrentEl();
+    // one status query for both axis
+    m_RigelDome.getCurrentAzEl(*pdAz, *pdEl);
     return SB_OK;
 }
 
@@ -520,7 +578,6 @@ int X2Dome::dapiFindHome(void)
 int X2Dome::dapiIsGotoComplete(bool* pbComplete)
 {
     int nErr;
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
@@ -537,7 +594,6 @@ int X2Dome::dapiIsGotoComplete(bool* pbComplete)
 int X2Dome::dapiIsOpenComplete(bool* pbComplete)
 {
     int nErr;
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
@@ -564,7 +620,6 @@ int X2Dome::dapiIsOpenComplete(bool* pbComplete)
 int	X2Dome::dapiIsCloseComplete(bool* pbComplete)
 {
     int nErr;
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
@@ -591,7 +646,6 @@ int	X2Dome::dapiIsCloseComplete(bool* pbComplete)
 int X2Dome::dapiIsParkComplete(bool* pbComplete)
 {
     int nErr;
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
@@ -606,7 +660,6 @@ int X2Dome::dapiIsParkComplete(bool* pbComplete)
 int X2Dome::dapiIsUnparkComplete(bool* pbComplete)
 {
     int nErr;
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
@@ -621,7 +674,6 @@ int X2Dome::dapiIsUnparkComplete(bool* pbComplete)
 int X2Dome::dapiIsFindHomeComplete(bool* pbComplete)
 {
     int nErr;
-    X2MutexLocker ml(GetMutex());
 
     if(!m_bLinked)
         return ERR_NOLINK;
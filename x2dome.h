@@ -20,6 +20,17 @@ class TickCountInterface;
 #define CHILD_KEY_HOME_AZ "HomeAzimuth"
 #define CHILD_KEY_PARK_AZ "ParkAzimuth"
 #define CHILD_KEY_LOG_EVENT "LogEvents"
+#define CHILD_KEY_POLLING "BackgroundPolling"
+#define CHILD_KEY_POLL_INTERVAL "PollInterval"
+#define CHILD_KEY_POLL_IDLE_INTERVAL "PollIdleInterval"
+#define CHILD_KEY_POLL_IDLE_MAX "PollIdleMaxInterval"
+#define CHILD_KEY_MAX_STATUS_AGE "MaxStatusAge"
+#define CHILD_KEY_COALESCE_WINDOW "QueryCoalesceWindow"
+#define CHILD_KEY_TRANSPORT "Transport"
+#define CHILD_KEY_NETWORK_ADDRESS "NetworkAddress"
+#define CHILD_KEY_IO_THREAD "IoThread"
+#define CHILD_KEY_IO_PRIORITY "IoThreadPriority"
+#define CHILD_KEY_IO_CPU "IoThreadCpu"
 
 #if defined(SB_WIN_BUILD)
 #define DEF_PORT_NAME					"COM1"
@@ -142,12 +153,18 @@ private:
 
 
 	int         m_nPrivateISIndex;
-	bool        m_bLinked;
+	std::atomic<bool>   m_bLinked;  // read without the X2 mutex
     CRigelDome  m_RigelDome;
-    bool        m_bHasShutterControl;
+    std::atomic<bool>   m_bHasShutterControl;
     bool        m_bOpenUpperShutterOnly;
     bool        m_bCalibratingDome;
     int         m_bBattRequest;
     bool        m_bShutterEventLog;
+
+    bool        m_bBackgroundPolling;
+    int         m_nPollInterval;
+    int         m_nPollIdleInterval;
+    int         m_nPollIdleMax;
+    int         m_nMaxStatusAge;
     
 };
@@ -0,0 +1,975 @@
+//
+//  x2host.cpp
+//  Rigel rotation drive unit for Pulsar Dome X2 plugin
+//
+//  Minimal X2 host for Linux. Loads the built libRigelDome.so the way TheSkyX does, gives it
+//  stub SerX, mutex, logger, ini, sleeper and tick count interfaces and runs a script of dapi
+//  calls that mimics TheSkyX polling. This measures the shipped binary end to end, usually
+//  against the simulator :
+//
+//  make && make sim && make x2host
+//  ./sim/rigelsim -L /tmp/rigel -x 10 &
+//  ./x2host/x2host -p /tmp/rigel [-f script] [-o Key=Value] [-v]
+//
+//  or let the host start the simulator with a given link latency and run the dapi benchmark :
+//  ./x2host/x2host -s 15 -B
+//
+//  For each dapi call we report p50/p95/p99/max wall time and the serial writes and replies
+//  per call, a write being one exchange with the dome (a batch of queries goes out in one write).
+//  With BackgroundPolling=1 the poller's exchanges are counted against the call that was running.
+//
+//  -S N runs a contention stress test instead : a thread slewing and polling dapiIsGotoComplete
+//  like TheSkyX, N threads polling dapiGetAzEl / dapiIsGotoComplete and the settings dialog
+//  opened for a few seconds, the GUI timer firing on_timer (-H keeps the X2 mutex held while the
+//  dialog is up, as execModalSettingsDialog did before the lock split). The host mutex records
+//  wait and hold times per thread.
+//
+//  Script, one command per line, # starts a comment :
+//  connect | disconnect
+//  getazel N | gotocomplete N | opencomplete N | closecomplete N
+//  parkcomplete N | unparkcomplete N | homecomplete N      N calls back to back
+//  goto AZ [POLL_MS]                               dapiGotoAzEl then poll like TheSkyX until done
+//  open [POLL_MS] | close [POLL_MS] | park [POLL_MS] | unpark | home [POLL_MS]
+//  abort | sync AZ | sleep MS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../../licensedinterfaces/sberrorx.h"
+#include "../../../licensedinterfaces/basicstringinterface.h"
+#include "../../../licensedinterfaces/serxinterface.h"
+#include "../../../licensedinterfaces/basiciniutilinterface.h"
+#include "../../../licensedinterfaces/theskyxfacadefordriversinterface.h"
+#include "../../../licensedinterfaces/sleeperinterface.h"
+#include "../../../licensedinterfaces/loggerinterface.h"
+#include "../../../licensedinterfaces/mutexinterface.h"
+#include "../../../licensedinterfaces/tickcountinterface.h"
+#include "../../../licensedinterfaces/serialportparams2interface.h"
+#include "../../../licensedinterfaces/domedriverinterface.h"
+#include "../../../licensedinterfaces/x2guiinterface.h"
+
+typedef std::chrono::steady_clock Clock;
+
+#define HOST_PARENT_KEY     "RigelDome"
+#define HOST_POLL_DEFAULT   500     // ms, TheSkyX polls the is*Complete calls about twice a second
+#define HOST_MOVE_TIMEOUT   600     // s
+#define HOST_SIM_PATH       "./sim/rigelsim"
+#define HOST_SIM_TIMESCALE  "10"    // moves run 10 times faster than real time
+#define HOST_SIM_WAIT       5000    // ms for the simulator to come up
+
+extern char **environ;
+
+typedef int (*PlugInNameProc)(BasicStringInterface &str);
+typedef int (*PlugInFactoryProc)(const char *pszSelection, const int &nInstanceIndex, SerXInterface *pSerXIn,
+                                 TheSkyXFacadeForDriversInterface *pTheSkyXIn, SleeperInterface *pSleeperIn,
+                                 BasicIniUtilInterface *pIniUtilIn, LoggerInterface *pLoggerIn,
+                                 MutexInterface *pIOMutexIn, TickCountInterface *pTickCountIn, void **ppObjectOut);
+
+#pragma mark - stub interfaces
+
+class CHostString : public BasicStringInterface
+{
+public:
+    BasicStringInterface &operator=(const char *pszString) { m_sString = pszString ? pszString : ""; return *this; }
+    BasicStringInterface &operator+=(const char *pszString) { m_sString += pszString ? pszString : ""; return *this; }
+    const char *c_str() { return m_sString.c_str(); }
+
+private:
+    std::string m_sString;
+};
+
+// plain POSIX tty, raw 8N1
+class CHostSerX : public SerXInterface
+{
+public:
+    CHostSerX() : m_nFd(-1), m_nWrites(0), m_nReplies(0) {}
+    ~CHostSerX() { close(); }
+
+    int open(const char *pszPort, const unsigned long &, const Parity &, const char *)
+    {
+        struct termios Tio;
+
+        m_nFd = ::open(pszPort, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if(m_nFd < 0)
+            return ERR_COMMNOLINK;
+        tcgetattr(m_nFd, &Tio);
+        cfmakeraw(&Tio);
+        cfsetispeed(&Tio, B115200);
+        cfsetospeed(&Tio, B115200);
+        Tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(m_nFd, TCSANOW, &Tio);
+        return SB_OK;
+    }
+
+    int close()
+    {
+        if(m_nFd >= 0)
+            ::close(m_nFd);
+        m_nFd = -1;
+        return SB_OK;
+    }
+
+    bool isConnected() const { return m_nFd >= 0; }
+    int flushTx() { return tcdrain(m_nFd); }
+    int purgeTxRx() { return tcflush(m_nFd, TCIOFLUSH); }
+
+    int waitForBytesRx(const int &nNumBytes, const int &nTimeOutMilli)
+    {
+        Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(nTimeOutMilli);
+        int nBytes = 0;
+
+        while(Clock::now() < tDeadline) {
+            bytesWaitingRx(nBytes);
+            if(nBytes >= nNumBytes)
+                return SB_OK;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return ERR_COMMTIMEOUT;
+    }
+
+    int readFile(void *pBuffer, const unsigned long ulLen, unsigned long &ulRead, const unsigned long &ulTimeout)
+    {
+        struct pollfd Poll;
+        ssize_t nRead;
+
+        ulRead = 0;
+        Poll.fd = m_nFd;
+        Poll.events = POLLIN;
+        if(poll(&Poll, 1, (int)ulTimeout) <= 0)
+            return SB_OK;
+        nRead = ::read(m_nFd, pBuffer, ulLen);
+        if(nRead > 0) {
+            ulRead = (unsigned long)nRead;
+            m_nReplies += (unsigned long)std::count((char *)pBuffer, (char *)pBuffer + nRead, '\r');
+        }
+        return SB_OK;
+    }
+
+    int writeFile(void *pBuffer, const unsigned long &ulLen, unsigned long &ulWritten)
+    {
+        ssize_t nWritten = ::write(m_nFd, pBuffer, ulLen);
+
+        m_nWrites++;
+        ulWritten = nWritten > 0 ? (unsigned long)nWritten : 0;
+        return nWritten < 0 ? ERR_CMDFAILED : SB_OK;
+    }
+
+    int bytesWaitingRx(int &nBytes)
+    {
+        nBytes = 0;
+        return ioctl(m_nFd, FIONREAD, &nBytes) ? ERR_CMDFAILED : SB_OK;
+    }
+
+    // the plugin reads and writes from its own threads too
+    unsigned long writes() { return m_nWrites; }
+    unsigned long replies() { return m_nReplies; }
+
+private:
+    int                         m_nFd;
+    std::atomic<unsigned long>  m_nWrites;
+    std::atomic<unsigned long>  m_nReplies;
+};
+
+// wait and hold times of the X2 mutex, per thread so recording doesn't need another lock
+struct LockStats {
+    std::vector<double> dWaits;     // ms
+    std::vector<double> dHolds;     // ms
+};
+
+static thread_local LockStats *t_pLockStats = NULL;
+
+class CHostMutex : public MutexInterface
+{
+public:
+    CHostMutex() : m_nDepth(0) {}
+
+    void lock()
+    {
+        Clock::time_point tStart = Clock::now();
+
+        m_Mutex.lock();
+        // recursive, only the outermost lock counts
+        if(m_nDepth++ == 0) {
+            m_tHoldStart = Clock::now();
+            if(t_pLockStats)
+                t_pLockStats->dWaits.push_back(std::chrono::duration<double, std::milli>(m_tHoldStart - tStart).count());
+        }
+    }
+
+    void unlock()
+    {
+        if(--m_nDepth == 0 && t_pLockStats)
+            t_pLockStats->dHolds.push_back(std::chrono::duration<double, std::milli>(Clock::now() - m_tHoldStart).count());
+        m_Mutex.unlock();
+    }
+
+private:
+    std::recursive_mutex    m_Mutex;
+    int                     m_nDepth;       // only touched by the owner
+    Clock::time_point       m_tHoldStart;
+};
+
+class CHostLogger : public LoggerInterface
+{
+public:
+    CHostLogger(bool bVerbose) : m_bVerbose(bVerbose) {}
+
+    int out(const char *pszLogThis)
+    {
+        if(m_bVerbose)
+            fprintf(stderr, "[plugin] %s\n", pszLogThis);
+        return 0;
+    }
+
+private:
+    bool    m_bVerbose;
+};
+
+class CHostSleeper : public SleeperInterface
+{
+public:
+    void sleep(const int &nMilliSeconds) { std::this_thread::sleep_for(std::chrono::milliseconds(nMilliSeconds)); }
+};
+
+class CHostTickCount : public TickCountInterface
+{
+public:
+    CHostTickCount() : m_tStart(Clock::now()) {}
+    int elapsed() { return (int)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - m_tStart).count(); }
+
+private:
+    Clock::time_point m_tStart;
+};
+
+// in memory, nothing is saved
+class CHostIni : public BasicIniUtilInterface
+{
+public:
+    void set(const std::string &sParent, const std::string &sChild, const std::string &sValue) { m_Values[sParent + "/" + sChild] = sValue; }
+
+    int writeString(const char *pszParent, const char *pszChild, const char *pszValue) { set(pszParent, pszChild, pszValue); return SB_OK; }
+    int writeInt(const char *pszParent, const char *pszChild, const int &nValue) { set(pszParent, pszChild, std::to_string(nValue)); return SB_OK; }
+    int writeDouble(const char *pszParent, const char *pszChild, const double &dValue) { set(pszParent, pszChild, std::to_string(dValue)); return SB_OK; }
+
+    void readString(const char *pszParent, const char *pszChild, const char *pszDefault, char *pszValue, int nMaxSize)
+    {
+        const std::string *pValue = find(pszParent, pszChild);
+        snprintf(pszValue, (size_t)nMaxSize, "%s", pValue ? pValue->c_str() : pszDefault);
+    }
+
+    int readInt(const char *pszParent, const char *pszChild, const int &nDefault)
+    {
+        const std::string *pValue = find(pszParent, pszChild);
+        return pValue ? atoi(pValue->c_str()) : nDefault;
+    }
+
+    double readDouble(const char *pszParent, const char *pszChild, const double &dDefault)
+    {
+        const std::string *pValue = find(pszParent, pszChild);
+        return pValue ? atof(pValue->c_str()) : dDefault;
+    }
+
+private:
+    const std::string *find(const char *pszParent, const char *pszChild)
+    {
+        std::map<std::string, std::string>::iterator it = m_Values.find(std::string(pszParent) + "/" + pszChild);
+        return it == m_Values.end() ? NULL : &it->second;
+    }
+
+    std::map<std::string, std::string> m_Values;
+};
+
+#pragma mark - script
+
+struct CompleteCall {
+    const char  *pszCmd;
+    const char  *pszName;
+    int         (DomeDriverInterface::*pComplete)(bool *);
+};
+
+static const CompleteCall g_CompleteCalls[] = {
+    {"gotocomplete",    "dapiIsGotoComplete",       &DomeDriverInterface::dapiIsGotoComplete},
+    {"opencomplete",    "dapiIsOpenComplete",       &DomeDriverInterface::dapiIsOpenComplete},
+    {"closecomplete",   "dapiIsCloseComplete",      &DomeDriverInterface::dapiIsCloseComplete},
+    {"parkcomplete",    "dapiIsParkComplete",       &DomeDriverInterface::dapiIsParkComplete},
+    {"unparkcomplete",  "dapiIsUnparkComplete",     &DomeDriverInterface::dapiIsUnparkComplete},
+    {"homecomplete",    "dapiIsFindHomeComplete",   &DomeDriverInterface::dapiIsFindHomeComplete}
+};
+
+struct CallStats {
+    std::vector<double> dTimes;     // ms
+    unsigned long       nErrors;
+    unsigned long       nWrites;
+    unsigned long       nReplies;
+};
+
+// where a call started, in time and on the wire
+struct CallMark {
+    Clock::time_point   tStart;
+    unsigned long       nWrites;
+    unsigned long       nReplies;
+};
+
+class CHost
+{
+public:
+    CHost(DomeDriverInterface *pDome, CHostSerX *pSerx) : m_pDome(pDome), m_pSerx(pSerx) {}
+
+    int     run(FILE *pScript);
+    void    report(double dElapsed);
+
+private:
+    int     command(const std::vector<std::string> &Args);
+    int     waitComplete(const char *pszName, int (DomeDriverInterface::*pComplete)(bool *), int nPollMs);
+    int     timed(const char *pszName, int nErr, const CallMark &Mark);
+    CallMark mark();
+
+    DomeDriverInterface             *m_pDome;
+    CHostSerX                       *m_pSerx;
+    std::map<std::string, CallStats> m_Stats;
+};
+
+CallMark CHost::mark()
+{
+    CallMark Mark = {Clock::now(), m_pSerx->writes(), m_pSerx->replies()};
+    return Mark;
+}
+
+// records one call, returns its error
+int CHost::timed(const char *pszName, int nErr, const CallMark &Mark)
+{
+    CallStats &Stats = m_Stats[pszName];
+
+    Stats.dTimes.push_back(std::chrono::duration<double, std::milli>(Clock::now() - Mark.tStart).count());
+    Stats.nWrites += m_pSerx->writes() - Mark.nWrites;
+    Stats.nReplies += m_pSerx->replies() - Mark.nReplies;
+    if(nErr)
+        Stats.nErrors++;
+    return nErr;
+}
+
+// like TheSkyX : ask for completion at a fixed rate and refresh the dome position in between
+int CHost::waitComplete(const char *pszName, int (DomeDriverInterface::*pComplete)(bool *), int nPollMs)
+{
+    Clock::time_point tDeadline = Clock::now() + std::chrono::seconds(HOST_MOVE_TIMEOUT);
+    CallMark Mark;
+    bool bComplete = false;
+    double dAz;
+    double dEl;
+    int nErr;
+
+    while(Clock::now() < tDeadline) {
+        Mark = mark();
+        nErr = timed(pszName, (m_pDome->*pComplete)(&bComplete), Mark);
+        if(nErr || bComplete)
+            return nErr;
+        Mark = mark();
+        timed("dapiGetAzEl", m_pDome->dapiGetAzEl(&dAz, &dEl), Mark);
+        std::this_thread::sleep_for(std::chrono::milliseconds(nPollMs));
+    }
+    return ERR_COMMTIMEOUT;
+}
+
+int CHost::command(const std::vector<std::string> &Args)
+{
+    const std::string &sCmd = Args[0];
+    double dArg = Args.size() > 1 ? atof(Args[1].c_str()) : 0;
+    int nPollMs = Args.size() > 2 ? atoi(Args[2].c_str()) : HOST_POLL_DEFAULT;
+    int nCount = Args.size() > 1 ? atoi(Args[1].c_str()) : 1;
+    CallMark Mark;
+    bool bComplete;
+    double dAz;
+    double dEl;
+    int nErr = SB_OK;
+    size_t nCall;
+    int i;
+
+    Mark = mark();
+    if(sCmd == "connect")
+        return timed("establishLink", m_pDome->establishLink(), Mark);
+    if(sCmd == "disconnect")
+        return timed("terminateLink", m_pDome->terminateLink(), Mark);
+
+    if(sCmd == "getazel") {
+        for(i = 0; i < nCount && !nErr; i++) {
+            Mark = mark();
+            nErr = timed("dapiGetAzEl", m_pDome->dapiGetAzEl(&dAz, &dEl), Mark);
+        }
+        return nErr;
+    }
+
+    for(nCall = 0; nCall < sizeof(g_CompleteCalls) / sizeof(g_CompleteCalls[0]); nCall++) {
+        if(sCmd != g_CompleteCalls[nCall].pszCmd)
+            continue;
+        for(i = 0; i < nCount && !nErr; i++) {
+            Mark = mark();
+            nErr = timed(g_CompleteCalls[nCall].pszName, (m_pDome->*g_CompleteCalls[nCall].pComplete)(&bComplete), Mark);
+        }
+        return nErr;
+    }
+
+    // moves, the optional argument is the poll interval
+    if(sCmd == "open" || sCmd == "close" || sCmd == "park" || sCmd == "home")
+        nPollMs = Args.size() > 1 ? atoi(Args[1].c_str()) : HOST_POLL_DEFAULT;
+
+    if(sCmd == "goto") {
+        nErr = timed("dapiGotoAzEl", m_pDome->dapiGotoAzEl(dArg, 0), Mark);
+        return nErr ? nErr : waitComplete("dapiIsGotoComplete", &DomeDriverInterface::dapiIsGotoComplete, nPollMs);
+    }
+    if(sCmd == "open") {
+        nErr = timed("dapiOpen", m_pDome->dapiOpen(), Mark);
+        return nErr ? nErr : waitComplete("dapiIsOpenComplete", &DomeDriverInterface::dapiIsOpenComplete, nPollMs);
+    }
+    if(sCmd == "close") {
+        nErr = timed("dapiClose", m_pDome->dapiClose(), Mark);
+        return nErr ? nErr : waitComplete("dapiIsCloseComplete", &DomeDriverInterface::dapiIsCloseComplete, nPollMs);
+    }
+    if(sCmd == "park") {
+        nErr = timed("dapiPark", m_pDome->dapiPark(), Mark);
+        return nErr ? nErr : waitComplete("dapiIsParkComplete", &DomeDriverInterface::dapiIsParkComplete, nPollMs);
+    }
+    if(sCmd == "home") {
+        nErr = timed("dapiFindHome", m_pDome->dapiFindHome(), Mark);
+        return nErr ? nErr : waitComplete("dapiIsFindHomeComplete", &DomeDriverInterface::dapiIsFindHomeComplete, nPollMs);
+    }
+    if(sCmd == "unpark") {
+        nErr = timed("dapiUnpark", m_pDome->dapiUnpark(), Mark);
+        return nErr ? nErr : waitComplete("dapiIsUnparkComplete", &DomeDriverInterface::dapiIsUnparkComplete, HOST_POLL_DEFAULT);
+    }
+    if(sCmd == "abort")
+        return timed("dapiAbort", m_pDome->dapiAbort(), Mark);
+    if(sCmd == "sync")
+        return timed("dapiSync", m_pDome->dapiSync(dArg, 0), Mark);
+    if(sCmd == "sleep") {
+        std::this_thread::sleep_for(std::chrono::milliseconds((int)dArg));
+        return SB_OK;
+    }
+
+    fprintf(stderr, "unknown script command %s\n", sCmd.c_str());
+    return ERR_CMDFAILED;
+}
+
+// keeps going after a failed line, returns the first error so the exit status shows it
+int CHost::run(FILE *pScript)
+{
+    char szLine[256];
+    char *pszToken;
+    std::vector<std::string> Args;
+    int nLine = 0;
+    int nFirstErr = SB_OK;
+    int nErr;
+
+    while(fgets(szLine, sizeof(szLine), pScript)) {
+        nLine++;
+        if(strchr(szLine, '#'))
+            *strchr(szLine, '#') = 0;
+        Args.clear();
+        for(pszToken = strtok(szLine, " \t\r\n"); pszToken; pszToken = strtok(NULL, " \t\r\n"))
+            Args.push_back(pszToken);
+        if(Args.empty())
+            continue;
+
+        nErr = command(Args);
+        if(nErr) {
+            fprintf(stderr, "line %d : %s failed, err = %d\n", nLine, Args[0].c_str(), nErr);
+            if(Args[0] == "connect")
+                return nErr;
+            if(!nFirstErr)
+                nFirstErr = nErr;
+        }
+    }
+    return nFirstErr;
+}
+
+static double percentile(const std::vector<double> &dValues, double dPercent)
+{
+    return dValues[(size_t)(dPercent / 100.0 * (double)(dValues.size() - 1))];
+}
+
+void CHost::report(double dElapsed)
+{
+    std::map<std::string, CallStats>::iterator it;
+    std::vector<double> dTimes;
+    double dCount;
+
+    printf("%-24s %7s %9s %9s %9s %9s %8s %8s %6s\n", "call", "count", "p50 ms", "p95 ms", "p99 ms", "max ms",
+           "wr/call", "rx/call", "errors");
+    for(it = m_Stats.begin(); it != m_Stats.end(); ++it) {
+        dTimes = it->second.dTimes;
+        std::sort(dTimes.begin(), dTimes.end());
+        dCount = (double)dTimes.size();
+        printf("%-24s %7zu %9.3f %9.3f %9.3f %9.3f %8.3f %8.3f %6lu\n", it->first.c_str(), dTimes.size(),
+               percentile(dTimes, 50), percentile(dTimes, 95), percentile(dTimes, 99), dTimes.back(),
+               (double)it->second.nWrites / dCount, (double)it->second.nReplies / dCount, it->second.nErrors);
+    }
+    printf("%lu serial writes, %lu replies in %.1f s\n", m_pSerx->writes(), m_pSerx->replies(), dElapsed);
+}
+
+#pragma mark - stress
+
+// TheSkyX's side of the settings dialog, nothing to show
+class CHostExchange : public X2GUIExchangeInterface
+{
+public:
+    void setChecked(const char *, const int &) {}
+    int isChecked(const char *) { return 0; }
+    void setEnabled(const char *, const int &) {}
+    int setPropertyString(const char *, const char *, const char *) { return SB_OK; }
+    int setPropertyDouble(const char *, const char *, const double &) { return SB_OK; }
+    int propertyDouble(const char *, const char *, double &) { return SB_OK; }
+    int setPropertyInt(const char *, const char *, const int &) { return SB_OK; }
+    int propertyInt(const char *, const char *, int &) { return SB_OK; }
+    void messageBox(const char *, const char *) {}
+    int setText(const char *, const char *) { return SB_OK; }
+};
+
+struct StressConfig {
+    int     nPollers;           // threads calling dapiGetAzEl / dapiIsGotoComplete back to back
+    int     nPollerPeriod;      // ms between poller calls, 0 = flat out
+    int     nGotoPoll;          // ms between dapiIsGotoComplete calls of the slewing thread
+    double  dDuration;          // s
+    double  dDialogStart;       // s into the run
+    double  dDialogTime;        // s the settings dialog stays open, 0 = never
+    int     nUiTimer;           // ms between on_timer events while the dialog is open
+    bool    bDialogLock;        // hold the X2 mutex while the dialog is open
+};
+
+struct StressThread {
+    std::string                                 sRole;
+    LockStats                                   Lock;
+    std::map<std::string, std::vector<double> > Calls;     // ms
+    unsigned long                               nErrors;
+    double                                      dMaxGap;    // ms, slewer only
+};
+
+class CStress
+{
+public:
+    CStress(DomeDriverInterface *pDome, MutexInterface *pMutex, const StressConfig &Config) :
+        m_pDome(pDome), m_pMutex(pMutex), m_Config(Config), m_bRunning(true) {}
+
+    int     run();
+
+private:
+    void    poller(StressThread &Thread);
+    void    slewer(StressThread &Thread);
+    void    dialog(StressThread &Thread);
+    bool    call(StressThread &Thread, const char *pszName, int nErr, Clock::time_point tStart);
+    void    report(std::vector<StressThread> &Threads, double dElapsed);
+
+    DomeDriverInterface *m_pDome;
+    MutexInterface      *m_pMutex;
+    StressConfig        m_Config;
+    std::atomic<bool>   m_bRunning;
+};
+
+bool CStress::call(StressThread &Thread, const char *pszName, int nErr, Clock::time_point tStart)
+{
+    Thread.Calls[pszName].push_back(std::chrono::duration<double, std::milli>(Clock::now() - tStart).count());
+    if(nErr)
+        Thread.nErrors++;
+    return nErr == SB_OK;
+}
+
+// a client refreshing its display as fast as it can
+void CStress::poller(StressThread &Thread)
+{
+    Clock::time_point tStart;
+    bool bComplete;
+    double dAz;
+    double dEl;
+
+    t_pLockStats = &Thread.Lock;
+    while(m_bRunning) {
+        tStart = Clock::now();
+        call(Thread, "dapiGetAzEl", m_pDome->dapiGetAzEl(&dAz, &dEl), tStart);
+        tStart = Clock::now();
+        call(Thread, "dapiIsGotoComplete", m_pDome->dapiIsGotoComplete(&bComplete), tStart);
+        if(m_Config.nPollerPeriod)
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_Config.nPollerPeriod));
+    }
+}
+
+// TheSkyX's dome thread while slaving : goto, then poll for completion at a fixed rate.
+// The gap between two polls is what shows starvation.
+void CStress::slewer(StressThread &Thread)
+{
+    std::mt19937 Rng(1);
+    std::uniform_real_distribution<double> Az(0.0, 360.0);
+    Clock::time_point tStart;
+    Clock::time_point tLastPoll;
+    bool bComplete;
+    double dGap;
+
+    t_pLockStats = &Thread.Lock;
+    while(m_bRunning) {
+        tStart = Clock::now();
+        if(!call(Thread, "dapiGotoAzEl", m_pDome->dapiGotoAzEl(Az(Rng), 0), tStart))
+            continue;
+        tLastPoll = Clock::now();
+        bComplete = false;
+        while(m_bRunning && !bComplete) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_Config.nGotoPoll));
+            tStart = Clock::now();
+            if(!call(Thread, "dapiIsGotoComplete", m_pDome->dapiIsGotoComplete(&bComplete), tStart))
+                break;
+            dGap = std::chrono::duration<double, std::milli>(Clock::now() - tLastPoll).count();
+            Thread.dMaxGap = std::max(Thread.dMaxGap, dGap);
+            tLastPoll = Clock::now();
+        }
+    }
+}
+
+// the settings dialog, the GUI timer fires on_timer while it's up
+void CStress::dialog(StressThread &Thread)
+{
+    CHostExchange Exchange;
+    X2GUIEventInterface *pEvents = NULL;
+    Clock::time_point tRunStart = Clock::now();
+    Clock::time_point tClose;
+    Clock::time_point tStart;
+
+    t_pLockStats = &Thread.Lock;
+    m_pDome->queryAbstraction(X2GUIEventInterface_Name, (void **)&pEvents);
+    if(!pEvents || m_Config.dDialogTime <= 0)
+        return;
+
+    while(m_bRunning && Clock::now() < tRunStart + std::chrono::duration<double>(m_Config.dDialogStart))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if(!m_bRunning)
+        return;
+
+    X2MutexLocker ml(m_Config.bDialogLock ? m_pMutex : NULL);
+    tClose = Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(m_Config.dDialogTime));
+    while(m_bRunning && Clock::now() < tClose) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(m_Config.nUiTimer));
+        tStart = Clock::now();
+        pEvents->uiEvent(&Exchange, "on_timer");
+        call(Thread, "uiEvent on_timer", SB_OK, tStart);
+    }
+}
+
+static void printLine(const char *pszRole, const char *pszName, std::vector<double> &dValues, double dElapsed)
+{
+    if(dValues.empty())
+        return;
+    std::sort(dValues.begin(), dValues.end());
+    printf("%-10s %-20s %8zu %9.1f %9.3f %9.3f %9.3f %10.3f\n", pszRole, pszName, dValues.size(), (double)dValues.size() / dElapsed,
+           percentile(dValues, 50), percentile(dValues, 99), percentile(dValues, 99.9), dValues.back());
+}
+
+void CStress::report(std::vector<StressThread> &Threads, double dElapsed)
+{
+    std::map<std::string, std::vector<double> >::iterator it;
+    double dHeld;
+    size_t i;
+    size_t j;
+
+    printf("%-10s %-20s %8s %9s %9s %9s %9s %10s\n", "thread", "call", "count", "per s", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for(i = 0; i < Threads.size(); i++)
+        for(it = Threads[i].Calls.begin(); it != Threads[i].Calls.end(); ++it)
+            printLine(Threads[i].sRole.c_str(), it->first.c_str(), it->second, dElapsed);
+
+    printf("\nX2 mutex\n");
+    printf("%-10s %-20s %8s %9s %9s %9s %9s %10s\n", "thread", "", "count", "per s", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for(i = 0; i < Threads.size(); i++) {
+        printLine(Threads[i].sRole.c_str(), "wait", Threads[i].Lock.dWaits, dElapsed);
+        printLine(Threads[i].sRole.c_str(), "hold", Threads[i].Lock.dHolds, dElapsed);
+    }
+    for(i = 0; i < Threads.size(); i++) {
+        dHeld = 0;
+        for(j = 0; j < Threads[i].Lock.dHolds.size(); j++)
+            dHeld += Threads[i].Lock.dHolds[j];
+        if(dHeld > 0)
+            printf("%-10s held the mutex %.1f%% of the run\n", Threads[i].sRole.c_str(), dHeld / (dElapsed * 10.0));
+        if(Threads[i].sRole == "slewer")
+            printf("%-10s longest gap between dapiIsGotoComplete polls %.1f ms (nominal %d ms)\n",
+                   Threads[i].sRole.c_str(), Threads[i].dMaxGap, m_Config.nGotoPoll);
+        if(Threads[i].nErrors)
+            printf("%-10s %lu errors\n", Threads[i].sRole.c_str(), Threads[i].nErrors);
+    }
+}
+
+int CStress::run()
+{
+    std::vector<StressThread> Threads(m_Config.nPollers + 2);
+    std::vector<std::thread> Workers;
+    Clock::time_point tStart;
+    double dElapsed;
+    int nErr;
+    size_t i;
+
+    nErr = m_pDome->establishLink();
+    if(nErr) {
+        fprintf(stderr, "establishLink failed, err = %d\n", nErr);
+        return nErr;
+    }
+
+    for(i = 0; i < Threads.size(); i++) {
+        Threads[i].nErrors = 0;
+        Threads[i].dMaxGap = 0;
+    }
+    Threads[0].sRole = "slewer";
+    Threads[1].sRole = "dialog";
+    for(i = 2; i < Threads.size(); i++)
+        Threads[i].sRole = "poller" + std::to_string(i - 2);
+
+    tStart = Clock::now();
+    Workers.push_back(std::thread(&CStress::slewer, this, std::ref(Threads[0])));
+    Workers.push_back(std::thread(&CStress::dialog, this, std::ref(Threads[1])));
+    for(i = 2; i < Threads.size(); i++)
+        Workers.push_back(std::thread(&CStress::poller, this, std::ref(Threads[i])));
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(m_Config.dDuration));
+    m_bRunning = false;
+    for(i = 0; i < Workers.size(); i++)
+        Workers[i].join();
+    dElapsed = std::chrono::duration<double>(Clock::now() - tStart).count();
+
+    m_pDome->dapiAbort();
+    m_pDome->terminateLink();
+    report(Threads, dElapsed);
+    return SB_OK;
+}
+
+#pragma mark - main
+
+static const char *g_pszDefaultScript =
+    "connect\n"
+    "getazel 500\n"
+    "gotocomplete 500\n"
+    "goto 90 250\n"
+    "getazel 500\n"
+    "open 500\n"
+    "close 500\n"
+    "goto 200 250\n"
+    "home 250\n"
+    "park 250\n"
+    "disconnect\n";
+
+// every dapi entry point, the polled ones many times
+static const char *g_pszBenchScript =
+    "connect\n"
+    "getazel 2000\n"
+    "gotocomplete 2000\n"
+    "opencomplete 500\n"
+    "closecomplete 500\n"
+    "parkcomplete 200\n"
+    "unparkcomplete 200\n"
+    "homecomplete 200\n"
+    "goto 90 100\n"
+    "goto 270 100\n"
+    "goto 100 100\n"
+    "sleep 200\n"
+    "abort\n"
+    "sync 100\n"
+    "open 100\n"
+    "close 100\n"
+    "home 100\n"
+    "park 100\n"
+    "unpark\n"
+    "goto 200 100\n"   // park right after a goto, the park check must not use the goto target
+    "park 100\n"
+    "unpark\n"
+    "disconnect\n";
+
+// simulator on a private link, see sim/rigelsim.cpp
+static pid_t startSimulator(const char *pszLatency, const char *pszLink)
+{
+    const char *pszArgs[] = {HOST_SIM_PATH, "-L", pszLink, "-l", pszLatency, "-x", HOST_SIM_TIMESCALE, NULL};
+    Clock::time_point tDeadline = Clock::now() + std::chrono::milliseconds(HOST_SIM_WAIT);
+    struct stat Stat;
+    pid_t nPid;
+
+    unlink(pszLink);
+    if(posix_spawn(&nPid, HOST_SIM_PATH, NULL, NULL, (char **)pszArgs, environ)) {
+        fprintf(stderr, "can't start %s, run make sim first\n", HOST_SIM_PATH);
+        return -1;
+    }
+    while(Clock::now() < tDeadline) {
+        if(!stat(pszLink, &Stat))
+            return nPid;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    kill(nPid, SIGTERM);
+    waitpid(nPid, NULL, 0);
+    fprintf(stderr, "%s didn't come up\n", HOST_SIM_PATH);
+    return -1;
+}
+
+static void usage(const char *pszName)
+{
+    fprintf(stderr,
+            "usage : %s -p port | -s latency [options]\n"
+            "  -l path       plugin to load (default ./libRigelDome.so)\n"
+            "  -s ms         start the simulator with this link latency and use it as the port\n"
+            "  -f file       script to run (default : built in TheSkyX like session)\n"
+            "  -B            run the dapi benchmark script instead\n"
+            "  -S threads    stress test : a slewing thread, the settings dialog and this many pollers\n"
+            "  -D s          stress test duration (default 20)\n"
+            "  -W s          settings dialog open time during the stress test, 0 = never (default 5)\n"
+            "  -U ms         on_timer period while the dialog is open (default 250)\n"
+            "  -P ms         pause between poller calls, 0 = flat out (default 5)\n"
+            "  -H            hold the X2 mutex while the dialog is open\n"
+            "  -o Key=Value  plugin ini setting, e.g. -o BackgroundPolling=1\n"
+            "  -v            show the plugin log\n", pszName);
+}
+
+int main(int argc, char **argv)
+{
+    const char *pszLibrary = "./libRigelDome.so";
+    const char *pszPort = NULL;
+    const char *pszScript = NULL;
+    const char *pszBuiltin = g_pszDefaultScript;
+    const char *pszSimLatency = NULL;
+    char szSimLink[64];
+    pid_t nSimPid = -1;
+    StressConfig Stress = {0, 5, 100, 20.0, 5.0, 5.0, 250, false};
+    bool bStress = false;
+    bool bVerbose = false;
+    void *pLibrary;
+    void *pObject = NULL;
+    PlugInNameProc pNameProc;
+    PlugInFactoryProc pFactoryProc;
+    CHostString Name;
+    SerialPortParams2Interface *pPortParams = NULL;
+    DomeDriverInterface *pDome;
+    CHostSerX *pSerx = new CHostSerX();
+    CHostIni *pIni = new CHostIni();
+    CHostMutex *pMutex = new CHostMutex();
+    FILE *pScript;
+    Clock::time_point tStart;
+    std::string sSetting;
+    size_t nEqual;
+    int nInstance = 0;
+    int nOpt;
+    int nErr;
+
+    while((nOpt = getopt(argc, argv, "l:p:s:f:BS:D:W:U:P:Ho:vh")) != -1) {
+        switch(nOpt) {
+            case 'l': pszLibrary = optarg; break;
+            case 'p': pszPort = optarg; break;
+            case 's': pszSimLatency = optarg; break;
+            case 'f': pszScript = optarg; break;
+            case 'B': pszBuiltin = g_pszBenchScript; break;
+            case 'S': bStress = true; Stress.nPollers = atoi(optarg); break;
+            case 'D': Stress.dDuration = atof(optarg); break;
+            case 'W': Stress.dDialogTime = atof(optarg); break;
+            case 'U': Stress.nUiTimer = atoi(optarg); break;
+            case 'P': Stress.nPollerPeriod = atoi(optarg); break;
+            case 'H': Stress.bDialogLock = true; break;
+            case 'v': bVerbose = true; break;
+            case 'o':
+                sSetting = optarg;
+                nEqual = sSetting.find('=');
+                if(nEqual == std::string::npos) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                pIni->set(HOST_PARENT_KEY, sSetting.substr(0, nEqual), sSetting.substr(nEqual + 1));
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(pszSimLatency) {
+        snprintf(szSimLink, sizeof(szSimLink), "/tmp/x2host-rigel-%d", (int)getpid());
+        nSimPid = startSimulator(pszSimLatency, szSimLink);
+        if(nSimPid < 0)
+            return 1;
+        pszPort = szSimLink;
+    }
+    if(!pszPort) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pLibrary = dlopen(pszLibrary, RTLD_NOW | RTLD_LOCAL);
+    if(!pLibrary) {
+        fprintf(stderr, "can't load %s : %s\n", pszLibrary, dlerror());
+        return 1;
+    }
+    pNameProc = (PlugInNameProc)dlsym(pLibrary, "sbPlugInName2");
+    pFactoryProc = (PlugInFactoryProc)dlsym(pLibrary, "sbPlugInFactory2");
+    if(!pNameProc || !pFactoryProc) {
+        fprintf(stderr, "%s is not an X2 plugin\n", pszLibrary);
+        return 1;
+    }
+    pNameProc(Name);
+
+    // the plugin owns the interfaces from here on and deletes them when it goes away
+    pFactoryProc("", nInstance, pSerx, NULL, new CHostSleeper(), pIni, new CHostLogger(bVerbose),
+                 pMutex, new CHostTickCount(), &pObject);
+    if(!pObject) {
+        fprintf(stderr, "plugin factory failed\n");
+        return 1;
+    }
+    pDome = (DomeDriverInterface *)pObject;
+    pDome->queryAbstraction(SerialPortParams2Interface_Name, (void **)&pPortParams);
+    if(pPortParams)
+        pPortParams->setPortName(pszPort);
+    else
+        pIni->set(HOST_PARENT_KEY, "PortName", pszPort);
+
+    printf("%s on %s", Name.c_str(), pszPort);
+    if(pszSimLatency)
+        printf(", simulator with %s ms latency", pszSimLatency);
+    printf("\n");
+
+    if(bStress) {
+        printf("stress : %d pollers, %.0f s, dialog open %.1f s from %.1f s\n", Stress.nPollers, Stress.dDuration,
+               Stress.dDialogTime, Stress.dDialogStart);
+        CStress Stresser(pDome, pMutex, Stress);
+        nErr = Stresser.run();
+    }
+    else {
+        if(pszScript)
+            pScript = fopen(pszScript, "r");
+        else
+            pScript = fmemopen((void *)pszBuiltin, strlen(pszBuiltin), "r");
+        if(!pScript) {
+            fprintf(stderr, "can't open %s : %s\n", pszScript, strerror(errno));
+            nErr = ERR_CMDFAILED;
+        }
+        else {
+            CHost Host(pDome, pSerx);
+            tStart = Clock::now();
+            nErr = Host.run(pScript);
+            Host.report(std::chrono::duration<double>(Clock::now() - tStart).count());
+            fclose(pScript);
+        }
+    }
+
+    if(pDome->isLinked())
+        pDome->terminateLink();
+    delete pDome;
+    dlclose(pLibrary);
+    if(nSimPid > 0) {
+        kill(nSimPid, SIGTERM);
+        waitpid(nSimPid, NULL, 0);
+    }
+    return nErr ? 1 : 0;
+}